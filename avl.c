@@ -4,6 +4,9 @@
 
 #include <stddef.h>
 #include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
 #include <assert.h>
 
 #include "avl.h"
@@ -22,6 +25,25 @@ pw_avl_init(size_t el_size)
 	return avl;
 }
 
+struct pw_avl *
+pw_avl_init_pooled(size_t el_size, size_t chunk_el_count)
+{
+	struct pw_avl *avl;
+
+	assert(chunk_el_count > 0);
+	avl = pw_avl_init(el_size);
+	if (!avl) {
+		return NULL;
+	}
+
+	/* keep every node 8-byte aligned for the 64-bit key */
+	avl->node_size = (sizeof(struct pw_avl_node) + el_size + 7) & ~(size_t)7;
+	avl->chunk_el_count = chunk_el_count;
+	/* force a new chunk on first alloc */
+	avl->chunk_used = chunk_el_count;
+	return avl;
+}
+
 static void
 deinit_foreach_cb(struct pw_avl_node *node)
 {
@@ -47,19 +69,67 @@ pw_avl_deinit(struct pw_avl *avl)
 		return;
 	}
 
-	/* we need to iterate depth-first to avoid use-after-free,
-	 * so pw_avl_foreach() won't work */
-	deinit_foreach_cb(avl->root);
+	if (avl->chunk_el_count) {
+		struct pw_avl_chunk *chunk = avl->chunks, *next;
 
+		/* all nodes live inside the chunks, no need to walk the tree */
+		while (chunk) {
+			next = chunk->next;
+			free(chunk);
+			chunk = next;
+		}
+	} else if (avl->root) {
+		/* we need to iterate depth-first to avoid use-after-free,
+		 * so pw_avl_foreach() won't work */
+		deinit_foreach_cb(avl->root);
+	}
+
+	free(avl->frozen_keys);
+	free(avl->frozen_nodes);
 	free(avl);
 }
 
+static struct pw_avl_node *
+pool_alloc(struct pw_avl *avl)
+{
+	struct pw_avl_node *node;
+
+	if (avl->free_nodes) {
+		node = avl->free_nodes;
+		avl->free_nodes = node->next;
+	} else {
+		if (avl->chunk_used == avl->chunk_el_count) {
+			struct pw_avl_chunk *chunk;
+
+			chunk = malloc(sizeof(*chunk) + avl->chunk_el_count * avl->node_size);
+			if (!chunk) {
+				return NULL;
+			}
+
+			chunk->next = avl->chunks;
+			avl->chunks = chunk;
+			avl->chunk_used = 0;
+		}
+
+		node = (void *)((char *)avl->chunks->data + avl->chunk_used * avl->node_size);
+		avl->chunk_used++;
+	}
+
+	memset(node, 0, avl->node_size);
+	return node;
+}
+
 void *
 pw_avl_alloc(struct pw_avl *avl)
 {
 	struct pw_avl_node *node;
 
-	node = calloc(1, sizeof(*node) + avl->el_size);
+	if (avl->chunk_el_count) {
+		node = pool_alloc(avl);
+	} else {
+		node = calloc(1, sizeof(*node) + avl->el_size);
+	}
+
 	if (!node) {
 		return NULL;
 	}
@@ -73,6 +143,12 @@ pw_avl_free(struct pw_avl *avl, void *data)
 {
 	struct pw_avl_node *node = (void *)(data - offsetof(struct pw_avl_node, data));
 
+	if (avl->chunk_el_count) {
+		node->next = avl->free_nodes;
+		avl->free_nodes = node;
+		return;
+	}
+
 	free(node);
 }
 
@@ -122,6 +198,20 @@ rotate_left(struct pw_avl_node *root)
 	return new_root;
 }
 
+static void
+thaw(struct pw_avl *avl)
+{
+	if (!avl->frozen_keys) {
+		return;
+	}
+
+	free(avl->frozen_keys);
+	free(avl->frozen_nodes);
+	avl->frozen_keys = NULL;
+	avl->frozen_nodes = NULL;
+	avl->frozen_count = 0;
+}
+
 static struct pw_avl_node *
 insert(struct pw_avl_node *parent, struct pw_avl_node *node)
 {
@@ -167,11 +257,70 @@ pw_avl_insert(struct pw_avl *avl, uint64_t key, void *data)
 {
 	struct pw_avl_node *node = (void *)(data - offsetof(struct pw_avl_node, data));
 
+	thaw(avl);
 	node->key = key;
 	avl->root = insert(avl->root, node);
 	avl->el_count++;
 }
 
+static struct pw_avl_node *
+build_sorted(struct pw_avl_node **nodes, size_t count)
+{
+	struct pw_avl_node *node;
+	size_t mid = count / 2;
+
+	if (count == 0) {
+		return NULL;
+	}
+
+	node = nodes[mid];
+	node->left = build_sorted(nodes, mid);
+	node->right = build_sorted(nodes + mid + 1, count - mid - 1);
+	calc_height(node);
+	return node;
+}
+
+int
+pw_avl_build_sorted(struct pw_avl *avl, const uint64_t *keys, void **data, size_t count)
+{
+	struct pw_avl_node **nodes, *node, *last = NULL;
+	size_t i, uniq_cnt = 0;
+
+	if (avl->root) {
+		return -EINVAL;
+	}
+
+	for (i = 1; i < count; i++) {
+		if (keys[i] < keys[i - 1]) {
+			return -EINVAL;
+		}
+	}
+
+	nodes = malloc(count * sizeof(*nodes));
+	if (!nodes && count) {
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < count; i++) {
+		node = (void *)(data[i] - offsetof(struct pw_avl_node, data));
+		node->key = keys[i];
+		node->left = node->right = node->next = NULL;
+
+		if (i > 0 && keys[i] == keys[i - 1]) {
+			/* append to the same-key chain */
+			last->next = node;
+		} else {
+			nodes[uniq_cnt++] = node;
+		}
+		last = node;
+	}
+
+	avl->root = build_sorted(nodes, uniq_cnt);
+	avl->el_count = count;
+	free(nodes);
+	return 0;
+}
+
 static struct pw_avl_node *
 remove_node(struct pw_avl_node *parent, struct pw_avl_node *node)
 {
@@ -277,6 +426,7 @@ pw_avl_remove(struct pw_avl *avl, void *data)
 {
 	struct pw_avl_node *node = (void *)(data - offsetof(struct pw_avl_node, data));
 
+	thaw(avl);
 	avl->root = remove_node(avl->root, node);
 	assert(avl->el_count > 0);
 	avl->el_count--;
@@ -288,12 +438,51 @@ pw_avl_remove(struct pw_avl *avl, void *data)
 	node->height = 1;
 }
 
+/* index of the first frozen key >= given key, 0 if there's none */
+static size_t
+frozen_lower_bound(struct pw_avl *avl, uint64_t key)
+{
+	const uint64_t *keys = avl->frozen_keys;
+	size_t k = 1;
+
+	while (k <= avl->frozen_count) {
+		/* 8 levels down is 16 keys further, prefetch that cache line early */
+		__builtin_prefetch(keys + 16 * k);
+		k = 2 * k + (keys[k] < key);
+	}
+
+	/* strip the trailing right turns to get the lower bound */
+	return k >> __builtin_ffsl(~(unsigned long)k);
+}
+
+static void *
+frozen_get(struct pw_avl *avl, uint64_t key)
+{
+	size_t k = frozen_lower_bound(avl, key);
+
+	if (k == 0 || avl->frozen_keys[k] != key) {
+		return NULL;
+	}
+
+	return avl->frozen_nodes[k]->data;
+}
+
 void *
 pw_avl_get(struct pw_avl *avl, uint64_t key)
 {
 	struct pw_avl_node *node = avl->root;
+	int depth;
+
+	if (avl->frozen_keys) {
+		return frozen_get(avl, key);
+	}
+
+	for (depth = 0; node && node->key != key; depth++) {
+		/* no real path is this long, a rotation must be in progress */
+		if (depth == PW_AVL_MAX_HEIGHT) {
+			return NULL;
+		}
 
-	while (node && node->key != key) {
 		if (key > node->key) {
 			node = node->right;
 		} else {
@@ -304,6 +493,39 @@ pw_avl_get(struct pw_avl *avl, uint64_t key)
 	return node ? (void *)node->data : NULL;
 }
 
+void *
+pw_avl_get_first(struct pw_avl *avl, uint64_t lo, uint64_t hi)
+{
+	struct pw_avl_node *node = avl->root, *found = NULL;
+	int depth;
+	size_t k;
+
+	if (avl->frozen_keys) {
+		k = frozen_lower_bound(avl, lo);
+		found = k ? avl->frozen_nodes[k] : NULL;
+	} else {
+		/* a lower bound without a cursor, there's no way back up anyway */
+		for (depth = 0; node; depth++) {
+			if (depth == PW_AVL_MAX_HEIGHT) {
+				return NULL;
+			}
+
+			if (node->key >= lo) {
+				found = node;
+				node = node->left;
+			} else {
+				node = node->right;
+			}
+		}
+	}
+
+	if (!found || found->key > hi) {
+		return NULL;
+	}
+
+	return (void *)found->data;
+}
+
 void *
 pw_avl_get_next(struct pw_avl *avl, void *data)
 {
@@ -340,6 +562,283 @@ pw_avl_foreach(struct pw_avl *avl, pw_avl_foreach_cb cb, void *ctx1, void *ctx2)
 	foreach_cb(avl->root, cb, ctx1, ctx2);
 }
 
+static void *
+cursor_data(struct pw_avl_cursor *cur)
+{
+	return cur->cur ? (void *)cur->cur->data : NULL;
+}
+
+/* \return false if the path doesn't fit, the cursor is at the end then */
+static bool
+cursor_push(struct pw_avl_cursor *cur, struct pw_avl_node *node)
+{
+	if (cur->depth == PW_AVL_MAX_HEIGHT) {
+		/* only a tree that's modified in the meantime gets this deep */
+		cur->depth = 0;
+		cur->cur = NULL;
+		return false;
+	}
+
+	cur->path[cur->depth++] = node;
+	return true;
+}
+
+static void
+cursor_set_top(struct pw_avl_cursor *cur, bool chain_end)
+{
+	struct pw_avl_node *node;
+
+	if (cur->depth == 0) {
+		cur->cur = NULL;
+		return;
+	}
+
+	node = cur->path[cur->depth - 1];
+	while (chain_end && node->next) {
+		node = node->next;
+	}
+	cur->cur = node;
+}
+
+void *
+pw_avl_cursor_first(struct pw_avl *avl, struct pw_avl_cursor *cur)
+{
+	struct pw_avl_node *node = avl->root;
+
+	cur->depth = 0;
+	while (node) {
+		if (!cursor_push(cur, node)) {
+			return NULL;
+		}
+		node = node->left;
+	}
+
+	cursor_set_top(cur, false);
+	return cursor_data(cur);
+}
+
+void *
+pw_avl_cursor_last(struct pw_avl *avl, struct pw_avl_cursor *cur)
+{
+	struct pw_avl_node *node = avl->root;
+
+	cur->depth = 0;
+	while (node) {
+		if (!cursor_push(cur, node)) {
+			return NULL;
+		}
+		node = node->right;
+	}
+
+	cursor_set_top(cur, true);
+	return cursor_data(cur);
+}
+
+static void *
+cursor_bound(struct pw_avl *avl, struct pw_avl_cursor *cur, uint64_t key, bool inclusive)
+{
+	struct pw_avl_node *node = avl->root;
+	int found_depth = 0;
+
+	cur->depth = 0;
+	while (node) {
+		if (!cursor_push(cur, node)) {
+			return NULL;
+		}
+		if (key < node->key || (inclusive && key == node->key)) {
+			/* a candidate, but there may be a smaller one on the left */
+			found_depth = cur->depth;
+			node = node->left;
+		} else {
+			node = node->right;
+		}
+	}
+
+	/* the path to the candidate is a prefix of the path we took */
+	cur->depth = found_depth;
+	cursor_set_top(cur, false);
+	return cursor_data(cur);
+}
+
+void *
+pw_avl_cursor_lower_bound(struct pw_avl *avl, struct pw_avl_cursor *cur, uint64_t key)
+{
+	return cursor_bound(avl, cur, key, true);
+}
+
+void *
+pw_avl_cursor_upper_bound(struct pw_avl *avl, struct pw_avl_cursor *cur, uint64_t key)
+{
+	return cursor_bound(avl, cur, key, false);
+}
+
+void *
+pw_avl_cursor_seek(struct pw_avl *avl, struct pw_avl_cursor *cur, uint64_t key)
+{
+	void *data = cursor_bound(avl, cur, key, true);
+
+	if (data && cur->cur->key != key) {
+		cur->depth = 0;
+		cur->cur = NULL;
+		return NULL;
+	}
+
+	return data;
+}
+
+void *
+pw_avl_cursor_next(struct pw_avl_cursor *cur)
+{
+	struct pw_avl_node *node, *child;
+
+	if (!cur->cur) {
+		return NULL;
+	}
+
+	if (cur->cur->next) {
+		cur->cur = cur->cur->next;
+		return cursor_data(cur);
+	}
+
+	node = cur->path[cur->depth - 1];
+	if (node->right) {
+		node = node->right;
+		while (node) {
+			if (!cursor_push(cur, node)) {
+				return NULL;
+			}
+			node = node->left;
+		}
+		cursor_set_top(cur, false);
+		return cursor_data(cur);
+	}
+
+	/* go up until we leave a left subtree */
+	do {
+		child = cur->path[--cur->depth];
+	} while (cur->depth > 0 && cur->path[cur->depth - 1]->left != child);
+
+	cursor_set_top(cur, false);
+	return cursor_data(cur);
+}
+
+void *
+pw_avl_cursor_prev(struct pw_avl_cursor *cur)
+{
+	struct pw_avl_node *node, *child;
+
+	if (!cur->cur) {
+		return NULL;
+	}
+
+	node = cur->path[cur->depth - 1];
+	if (cur->cur != node) {
+		/* the chain is singly-linked, so find the predecessor from its head */
+		while (node->next != cur->cur) {
+			node = node->next;
+		}
+		cur->cur = node;
+		return cursor_data(cur);
+	}
+
+	if (node->left) {
+		node = node->left;
+		while (node) {
+			if (!cursor_push(cur, node)) {
+				return NULL;
+			}
+			node = node->right;
+		}
+		cursor_set_top(cur, true);
+		return cursor_data(cur);
+	}
+
+	/* go up until we leave a right subtree */
+	do {
+		child = cur->path[--cur->depth];
+	} while (cur->depth > 0 && cur->path[cur->depth - 1]->right != child);
+
+	cursor_set_top(cur, true);
+	return cursor_data(cur);
+}
+
+uint64_t
+pw_avl_cursor_key(struct pw_avl_cursor *cur)
+{
+	assert(cur->cur);
+	return cur->cur->key;
+}
+
+int
+pw_avl_foreach_range(struct pw_avl *avl, uint64_t lo, uint64_t hi, pw_avl_range_cb cb, void *ctx)
+{
+	struct pw_avl_cursor cur;
+	void *data;
+	int rc;
+
+	data = pw_avl_cursor_lower_bound(avl, &cur, lo);
+	while (data && pw_avl_cursor_key(&cur) <= hi) {
+		rc = cb(data, ctx);
+		if (rc) {
+			return rc;
+		}
+		data = pw_avl_cursor_next(&cur);
+	}
+
+	return 0;
+}
+
+static size_t
+freeze_fill(struct pw_avl *avl, struct pw_avl_node **sorted, size_t i, size_t k)
+{
+	if (k > avl->frozen_count) {
+		return i;
+	}
+
+	i = freeze_fill(avl, sorted, i, 2 * k);
+	avl->frozen_keys[k] = sorted[i]->key;
+	avl->frozen_nodes[k] = sorted[i];
+	i++;
+	return freeze_fill(avl, sorted, i, 2 * k + 1);
+}
+
+int
+pw_avl_freeze(struct pw_avl *avl)
+{
+	struct pw_avl_node **sorted;
+	struct pw_avl_cursor cur;
+	size_t count = 0;
+
+	thaw(avl);
+	if (!avl->root) {
+		return 0;
+	}
+
+	sorted = malloc(avl->el_count * sizeof(*sorted));
+	/* index 0 is unused, it marks "not found" */
+	avl->frozen_keys = malloc((avl->el_count + 1) * sizeof(*avl->frozen_keys));
+	avl->frozen_nodes = malloc((avl->el_count + 1) * sizeof(*avl->frozen_nodes));
+	if (!sorted || !avl->frozen_keys || !avl->frozen_nodes) {
+		free(sorted);
+		thaw(avl);
+		return -ENOMEM;
+	}
+
+	/* collect just the tree nodes, the same-key chains hang off them */
+	pw_avl_cursor_first(avl, &cur);
+	while (cur.cur) {
+		if (cur.cur == cur.path[cur.depth - 1]) {
+			sorted[count++] = cur.cur;
+		}
+		pw_avl_cursor_next(&cur);
+	}
+
+	avl->frozen_count = count;
+	freeze_fill(avl, sorted, 0, 1);
+	free(sorted);
+	return 0;
+}
+
 static void
 print_node(struct pw_avl_node *node)
 {
@@ -370,6 +869,296 @@ pw_avl_print(struct pw_avl *avl)
 }
 
 #ifdef PW_AVL_TEST
+#include <time.h>
+
+static double
+elapsed_ms(clock_t start)
+{
+	return (double)(clock() - start) * 1000 / CLOCKS_PER_SEC;
+}
+
+static uint64_t
+bench_key(uint64_t i)
+{
+	/* cheap shuffle, so the keys don't arrive sorted */
+	return (i * 2654435761u) & 0xffffffff;
+}
+
+/* a pooled tree of count elements, dup of them per key */
+static struct pw_avl *
+bench_tree(size_t count, size_t dup)
+{
+	struct pw_avl *avl = pw_avl_init_pooled(sizeof(uint32_t), 4096);
+	size_t i;
+
+	assert(avl);
+	for (i = 0; i < count; i++) {
+		uint32_t *data = pw_avl_alloc(avl);
+
+		assert(data);
+		*data = i;
+		pw_avl_insert(avl, bench_key(i / dup), data);
+	}
+	return avl;
+}
+
+static void
+bench_alloc(const char *name, struct pw_avl *avl, size_t count)
+{
+	clock_t start;
+	double insert_ms, get_ms, deinit_ms;
+	size_t i;
+
+	start = clock();
+	for (i = 0; i < count; i++) {
+		uint32_t *data = pw_avl_alloc(avl);
+
+		assert(data);
+		*data = i;
+		pw_avl_insert(avl, bench_key(i), data);
+	}
+	insert_ms = elapsed_ms(start);
+
+	start = clock();
+	for (i = 0; i < count; i++) {
+		uint32_t *data = pw_avl_get(avl, bench_key(i));
+
+		assert(data);
+	}
+	get_ms = elapsed_ms(start);
+
+	start = clock();
+	pw_avl_deinit(avl);
+	deinit_ms = elapsed_ms(start);
+
+	fprintf(stderr, "%-7s %8zu nodes: insert %8.2f ms, get %8.2f ms, deinit %8.2f ms\n",
+			name, count, insert_ms, get_ms, deinit_ms);
+}
+
+static void
+bench_build_sorted(size_t count)
+{
+	struct pw_avl *avl;
+	uint64_t *keys = malloc(count * sizeof(*keys));
+	void **data = malloc(count * sizeof(*data));
+	clock_t start;
+	double insert_ms, build_ms;
+	size_t i;
+	int rc;
+
+	assert(keys && data);
+
+	avl = pw_avl_init_pooled(sizeof(uint32_t), 4096);
+	start = clock();
+	for (i = 0; i < count; i++) {
+		pw_avl_insert(avl, i / 2, pw_avl_alloc(avl));
+	}
+	insert_ms = elapsed_ms(start);
+	pw_avl_deinit(avl);
+
+	avl = pw_avl_init_pooled(sizeof(uint32_t), 4096);
+	start = clock();
+	for (i = 0; i < count; i++) {
+		keys[i] = i / 2;
+		data[i] = pw_avl_alloc(avl);
+	}
+	rc = pw_avl_build_sorted(avl, keys, data, count);
+	assert(rc == 0);
+	build_ms = elapsed_ms(start);
+
+	for (i = 0; i < count; i += 2) {
+		void *el = pw_avl_get(avl, i / 2);
+
+		assert(el == data[i]);
+		assert(pw_avl_get_next(avl, el) == data[i + 1]);
+	}
+	pw_avl_deinit(avl);
+
+	fprintf(stderr, "sorted  %8zu nodes: insert %8.2f ms, build %8.2f ms\n",
+			count, insert_ms, build_ms);
+	free(keys);
+	free(data);
+}
+
+static void
+count_foreach_cb(void *el, void *ctx1, void *ctx2)
+{
+	(*(size_t *)ctx1)++;
+}
+
+static int
+count_range_cb(void *data, void *ctx)
+{
+	(*(size_t *)ctx)++;
+	return 0;
+}
+
+static void
+test_cursor(size_t count)
+{
+	/* 4 elements per key */
+	struct pw_avl *avl = bench_tree(count, 4);
+	struct pw_avl_cursor cur;
+	uint64_t prev_key = 0;
+	clock_t start;
+	double foreach_ms, cursor_ms, get_next_ms, seek_ms;
+	size_t i, visited;
+	uint32_t *data;
+
+	/* forward and backward iteration visit everything in key order */
+	visited = 0;
+	for (data = pw_avl_cursor_first(avl, &cur); data; data = pw_avl_cursor_next(&cur)) {
+		assert(visited == 0 || pw_avl_cursor_key(&cur) >= prev_key);
+		prev_key = pw_avl_cursor_key(&cur);
+		visited++;
+	}
+	assert(visited == count);
+
+	visited = 0;
+	for (data = pw_avl_cursor_last(avl, &cur); data; data = pw_avl_cursor_prev(&cur)) {
+		assert(visited == 0 || pw_avl_cursor_key(&cur) <= prev_key);
+		prev_key = pw_avl_cursor_key(&cur);
+		visited++;
+	}
+	assert(visited == count);
+
+	data = pw_avl_cursor_lower_bound(avl, &cur, bench_key(1) + 1);
+	assert(!data || pw_avl_cursor_key(&cur) > bench_key(1));
+	data = pw_avl_cursor_upper_bound(avl, &cur, bench_key(1));
+	assert(!data || pw_avl_cursor_key(&cur) > bench_key(1));
+	data = pw_avl_cursor_seek(avl, &cur, bench_key(1));
+	assert(data == pw_avl_get(avl, bench_key(1)));
+
+	visited = 0;
+	pw_avl_foreach_range(avl, 0, UINT64_MAX, count_range_cb, &visited);
+	assert(visited == count);
+
+	start = clock();
+	visited = 0;
+	pw_avl_foreach(avl, count_foreach_cb, &visited, NULL);
+	foreach_ms = elapsed_ms(start);
+
+	start = clock();
+	visited = 0;
+	for (data = pw_avl_cursor_first(avl, &cur); data; data = pw_avl_cursor_next(&cur)) {
+		visited++;
+	}
+	cursor_ms = elapsed_ms(start);
+
+	start = clock();
+	for (i = 0; i < count; i += 4) {
+		for (data = pw_avl_get(avl, bench_key(i / 4)); data; data = pw_avl_get_next(avl, data)) {
+			visited++;
+		}
+	}
+	get_next_ms = elapsed_ms(start);
+
+	start = clock();
+	for (i = 0; i < count; i += 4) {
+		uint64_t key = bench_key(i / 4);
+
+		for (data = pw_avl_cursor_seek(avl, &cur, key); data && pw_avl_cursor_key(&cur) == key;
+				data = pw_avl_cursor_next(&cur)) {
+			visited++;
+		}
+	}
+	seek_ms = elapsed_ms(start);
+
+	fprintf(stderr, "cursor  %8zu nodes: foreach %7.2f ms, cursor %7.2f ms, get+get_next %7.2f ms, seek+next %7.2f ms\n",
+			count, foreach_ms, cursor_ms, get_next_ms, seek_ms);
+	pw_avl_deinit(avl);
+}
+
+/* what a lock-free reader may see in the middle of rotate_right() */
+static void
+test_half_rotated(void)
+{
+	struct pw_avl *avl = pw_avl_init(0);
+	struct pw_avl_node *root, *left;
+	struct pw_avl_cursor cur;
+	uint64_t keys[] = { 20, 10, 30 };
+	void *data;
+	size_t i;
+
+	for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+		pw_avl_insert(avl, keys[i], pw_avl_alloc(avl));
+	}
+
+	/* the new root already points up, the old one still points down */
+	root = avl->root;
+	left = root->left;
+	left->right = root;
+
+	data = pw_avl_get(avl, 15);
+	assert(data == NULL);
+	data = pw_avl_get_first(avl, 15, 19);
+	assert(data == NULL);
+	data = pw_avl_cursor_lower_bound(avl, &cur, 15);
+	assert(data == NULL && pw_avl_cursor_next(&cur) == NULL);
+
+	left->right = NULL;
+	pw_avl_deinit(avl);
+}
+
+static void
+bench_freeze(size_t count)
+{
+	struct pw_avl *avl = bench_tree(count, 1);
+	clock_t start;
+	double tree_ms, frozen_ms;
+	size_t i, found = 0;
+	int rc;
+
+	/* one duplicate to check the chains still work */
+	pw_avl_insert(avl, bench_key(0), pw_avl_alloc(avl));
+
+	/* half hits, half misses, in an order unrelated to the allocation order */
+	start = clock();
+	for (i = 0; i < 2 * count; i++) {
+		found += pw_avl_get(avl, bench_key((i * 7919) % (2 * count))) != NULL;
+	}
+	tree_ms = elapsed_ms(start);
+	assert(found == count);
+
+	void *dup = pw_avl_get(avl, bench_key(0));
+	rc = pw_avl_freeze(avl);
+	assert(rc == 0);
+	assert(pw_avl_get(avl, bench_key(0)) == dup);
+	assert(pw_avl_get_next(avl, dup) != NULL);
+
+	found = 0;
+	start = clock();
+	for (i = 0; i < 2 * count; i++) {
+		found += pw_avl_get(avl, bench_key((i * 7919) % (2 * count))) != NULL;
+	}
+	frozen_ms = elapsed_ms(start);
+	assert(found == count);
+
+	/* an insert drops the index, but lookups must still work off the tree */
+	void *extra = pw_avl_alloc(avl);
+	pw_avl_insert(avl, bench_key(2 * count), extra);
+	assert(!pw_avl_is_frozen(avl));
+	assert(pw_avl_get(avl, bench_key(2 * count)) == extra);
+	assert(pw_avl_get(avl, bench_key(0)) == dup);
+	assert(pw_avl_get(avl, bench_key(2 * count + 1)) == NULL);
+
+	/* until it's frozen again, this time with the new node */
+	rc = pw_avl_freeze(avl);
+	assert(rc == 0 && pw_avl_is_frozen(avl));
+	assert(pw_avl_get(avl, bench_key(2 * count)) == extra);
+	assert(pw_avl_get(avl, bench_key(count - 1)) != NULL);
+
+	pw_avl_remove(avl, extra);
+	pw_avl_free(avl, extra);
+	assert(!pw_avl_is_frozen(avl));
+	assert(pw_avl_get(avl, bench_key(2 * count)) == NULL);
+
+	fprintf(stderr, "frozen  %8zu nodes: tree get %7.2f ms, frozen get %7.2f ms, index %zu bytes (%zu bytes/node in the tree)\n",
+			count, tree_ms, frozen_ms, (count + 1) * (sizeof(uint64_t) + sizeof(void *)),
+			avl->node_size);
+	pw_avl_deinit(avl);
+}
+
 int
 main(void)
 {
@@ -392,6 +1181,18 @@ main(void)
 	 *                  /   /  \
 	 *                 6   12  40
 	 */
+	pw_avl_deinit(avl);
+	test_half_rotated();
+
+	size_t counts[] = { 10000, 100000, 1000000 };
+	for (int i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+		bench_alloc("calloc", pw_avl_init(sizeof(uint32_t)), counts[i]);
+		bench_alloc("pooled", pw_avl_init_pooled(sizeof(uint32_t), 4096), counts[i]);
+		bench_build_sorted(counts[i]);
+		test_cursor(counts[i]);
+		bench_freeze(counts[i]);
+	}
+
 	return 0;
 }
 #endif
@@ -5,10 +5,15 @@
 #ifndef PW_AVL_H
 #define PW_AVL_H
 
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <inttypes.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 struct pw_avl_node {
 	struct pw_avl_node *left;
 	struct pw_avl_node *right;
@@ -18,23 +23,148 @@ struct pw_avl_node {
 	char data[0];
 };
 
+struct pw_avl_chunk {
+	struct pw_avl_chunk *next;
+	uint64_t data[0];
+};
+
 struct pw_avl {
 	size_t el_size;
 	size_t el_count;
 	struct pw_avl_node *root;
+
+	/* pooled mode only (chunk_el_count != 0) */
+	size_t node_size;
+	size_t chunk_el_count;
+	size_t chunk_used;
+	struct pw_avl_chunk *chunks;
+	struct pw_avl_node *free_nodes;
+
+	/* read-optimized lookup index, see pw_avl_freeze() */
+	size_t frozen_count;
+	uint64_t *frozen_keys;
+	struct pw_avl_node **frozen_nodes;
+};
+
+/* AVL height is bounded by ~1.44 * log2(n), so this covers any address space */
+#define PW_AVL_MAX_HEIGHT 48
+
+/**
+ * In-order iterator. It keeps the whole path from the root, so stepping
+ * doesn't need parent pointers or recursion. Any insert or remove in the
+ * tree invalidates the cursor. A path that doesn't fit ends the iteration.
+ */
+struct pw_avl_cursor {
+	struct pw_avl_node *path[PW_AVL_MAX_HEIGHT];
+	int depth;
+	struct pw_avl_node *cur; /**< position within path[depth - 1]'s same-key chain */
 };
 
 typedef void (*pw_avl_foreach_cb)(void *el, void *ctx1, void *ctx2);
+/** return non-zero to stop the iteration */
+typedef int (*pw_avl_range_cb)(void *data, void *ctx);
 
 struct pw_avl *pw_avl_init(size_t el_size);
+
+/**
+ * Init a tree that carves its nodes out of big chunks of `chunk_el_count`
+ * nodes each. Freed nodes are kept on a free list for reuse, and all memory
+ * is released at once in pw_avl_deinit(). Useful for big trees that are
+ * filled once at startup.
+ */
+struct pw_avl *pw_avl_init_pooled(size_t el_size, size_t chunk_el_count);
 void pw_avl_deinit(struct pw_avl *avl);
 void *pw_avl_alloc(struct pw_avl *avl);
 void pw_avl_free(struct pw_avl *avl, void *data);
 void pw_avl_insert(struct pw_avl *avl, uint64_t key, void *data);
+
+/**
+ * Build a perfectly balanced tree out of `count` elements allocated with
+ * pw_avl_alloc(), in linear time. The keys must be in non-decreasing order.
+ * Elements with the same key are chained just like with pw_avl_insert().
+ *
+ * \return 0 on success, -EINVAL if the tree is not empty or the keys
+ * are not sorted, -ENOMEM on allocation failure. The tree is unchanged
+ * on error.
+ */
+int pw_avl_build_sorted(struct pw_avl *avl, const uint64_t *keys, void **data, size_t count);
+
+/**
+ * The descent never goes deeper than PW_AVL_MAX_HEIGHT. A reader racing with
+ * a writer may see a rotation halfway done, with two nodes pointing at each
+ * other; it gets NULL then instead of looping, and should retry.
+ */
 void *pw_avl_get(struct pw_avl *avl, uint64_t key);
+
+/**
+ * \return the first element with key in [lo, hi], or NULL if there's none.
+ * The same element as pw_avl_cursor_lower_bound() would find, but with a
+ * single descent and no cursor to fill. Capped like pw_avl_get().
+ */
+void *pw_avl_get_first(struct pw_avl *avl, uint64_t lo, uint64_t hi);
 void *pw_avl_get_next(struct pw_avl *avl, void *data);
+
+/** key of an element that's in the tree */
+static inline uint64_t
+pw_avl_key(void *data)
+{
+	return ((struct pw_avl_node *)((char *)data - offsetof(struct pw_avl_node, data)))->key;
+}
 void pw_avl_remove(struct pw_avl *avl, void *data);
 void pw_avl_foreach(struct pw_avl *avl, pw_avl_foreach_cb cb, void *ctx, void *ctx2);
+
+/**
+ * Build a read-optimized index for pw_avl_get(). The keys are stored in one
+ * contiguous array in Eytzinger (BFS) order, so a lookup touches a few cache
+ * lines instead of chasing pointers all over the heap. Meant for tables
+ * that are built once and then only queried.
+ *
+ * The index is a one-shot snapshot: any subsequent insert or remove drops it
+ * for good, and lookups go back to the (still correct, but slower) tree.
+ * Nothing refreezes the tree automatically; callers that modify a frozen
+ * tree should call pw_avl_freeze() again once they're done with a batch.
+ *
+ * \return 0 on success, -ENOMEM otherwise (the tree is still usable).
+ */
+int pw_avl_freeze(struct pw_avl *avl);
+
+/** \return non-zero if pw_avl_get() currently goes through the frozen index */
+static inline int
+pw_avl_is_frozen(struct pw_avl *avl)
+{
+	return avl->frozen_keys != NULL;
+}
+
+/**
+ * Position the cursor and return the element it points to, or NULL if
+ * there's no such element. Elements are visited in key order, and the
+ * elements with the same key are visited in their chain order.
+ */
+void *pw_avl_cursor_first(struct pw_avl *avl, struct pw_avl_cursor *cur);
+void *pw_avl_cursor_last(struct pw_avl *avl, struct pw_avl_cursor *cur);
+/** first element with exactly the given key */
+void *pw_avl_cursor_seek(struct pw_avl *avl, struct pw_avl_cursor *cur, uint64_t key);
+/** first element with key >= given key */
+void *pw_avl_cursor_lower_bound(struct pw_avl *avl, struct pw_avl_cursor *cur, uint64_t key);
+/** first element with key > given key */
+void *pw_avl_cursor_upper_bound(struct pw_avl *avl, struct pw_avl_cursor *cur, uint64_t key);
+/** step the cursor, return NULL once it goes past the end */
+void *pw_avl_cursor_next(struct pw_avl_cursor *cur);
+void *pw_avl_cursor_prev(struct pw_avl_cursor *cur);
+/** key of the current element. The cursor must point to an element. */
+uint64_t pw_avl_cursor_key(struct pw_avl_cursor *cur);
+
+/**
+ * Call `cb` for every element with key in [lo, hi], in key order.
+ *
+ * \return 0 if all elements were visited, or the first non-zero value
+ * returned by `cb`.
+ */
+int pw_avl_foreach_range(struct pw_avl *avl, uint64_t lo, uint64_t hi, pw_avl_range_cb cb, void *ctx);
 void pw_avl_print(struct pw_avl *avl);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* PW_AVL_H */
@@ -0,0 +1,17 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright(c) 2022 Darek Stojaczyk for pwmirage.com
+ */
+
+#ifndef PW_CRC_H
+#define PW_CRC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Standard CRC-32 (the one used by zlib and zip). Pass 0 as `crc` for the
+ * first chunk and the previous result for the following ones.
+ */
+uint32_t pw_crc32(uint32_t crc, const void *buf, size_t len);
+
+#endif /* PW_CRC_H */
@@ -17,7 +17,7 @@
 
 #include "csh.h"
 #include "csh_config.h"
-#include "avl.h"
+#include "hashmap.h"
 #include "pw_api.h"
 
 static uint32_t
@@ -187,7 +187,7 @@ struct reset_fn_ctx {
 	struct reset_fn_ctx *next;
 };
 
-static struct pw_avl *g_var_avl;
+static struct pw_hashmap *g_vars;
 static struct csh_cmd *g_cmds;
 static char g_profile[64];
 static pthread_mutex_t g_mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
@@ -225,13 +225,8 @@ static struct csh_var *
 get_var(const char *key)
 {
 	struct csh_var *var;
-	uint32_t hash = djb2(key);
-
-	var = pw_avl_get(g_var_avl, hash);
-	while (var && strcmp(var->key, key) != 0) {
-		var = pw_avl_get_next(g_var_avl, var);
-	}
 
+	var = pw_hashmap_get(g_vars, key);
 	if (var && !var->initialized) {
 		return NULL;
 	}
@@ -644,19 +639,17 @@ cfg_parse_fn(const char *cmd, void *ctx)
 }
 
 static void
-init_var_clean_cb(void *el, void *ctx1, void *ctx2)
+init_var_clean_cb(const char *key, void *data, void *ctx)
 {
-	struct pw_avl_node *node = el;
-	struct csh_var *var = (void *)node->data;
+	struct csh_var *var = data;
 
 	reset_var_val(var);
 }
 
 static void
-init_var_set_saved_cb(void *el, void *ctx1, void *ctx2)
+init_var_set_saved_cb(const char *key, void *data, void *ctx)
 {
-	struct pw_avl_node *node = el;
-	struct csh_var *var = (void *)node->data;
+	struct csh_var *var = data;
 
 	var_reset(var, false);
 }
@@ -677,7 +670,7 @@ csh_init(const char *file)
 
 	if (g_csh_cfg.filename[0] == 0) {
 		/* not every variable can be re-read from the config, so reset everything first */
-		pw_avl_foreach(g_var_avl, init_var_clean_cb, NULL, NULL);
+		pw_hashmap_foreach(g_vars, init_var_clean_cb, NULL);
 	}
 
 	if (file) {
@@ -691,17 +684,16 @@ csh_init(const char *file)
 	csh_cfg_parse(cfg_parse_fn, NULL);
 
 	/* make sure vars don't get saved until they're modified from now on */
-	pw_avl_foreach(g_var_avl, init_var_set_saved_cb, NULL, NULL);
+	pw_hashmap_foreach(g_vars, init_var_set_saved_cb, NULL);
 
 	unlock();
 	return 0;
 }
 
 static void
-save_var_foreach_cb(void *el, void *ctx1, void *ctx2)
+save_var_foreach_cb(const char *key, void *data, void *ctx)
 {
-	struct pw_avl_node *node = el;
-	struct csh_var *var = (void *)node->data;
+	struct csh_var *var = data;
 	char keybuf[128];
 	const char *val;
 
@@ -753,7 +745,7 @@ csh_save(const char *file)
 		snprintf(g_csh_cfg.filename, sizeof(g_csh_cfg.filename), "%s", file);
 	}
 
-	pw_avl_foreach(g_var_avl, save_var_foreach_cb, NULL, NULL);
+	pw_hashmap_foreach(g_vars, save_var_foreach_cb, NULL);
 
 	csh_cfg_save_s(NULL, NULL, true);
 	unlock();
@@ -886,14 +878,10 @@ static void
 csh_register_var(const char *key, struct csh_var tmpvar)
 {
 	struct csh_var *var;
-	uint32_t hash = djb2(key);
+	int rc;
 
 	lock();
-	var = pw_avl_get(g_var_avl, hash);
-	while (var && strcmp(var->key, key) != 0) {
-		var = pw_avl_get_next(g_var_avl, var);
-	}
-
+	var = pw_hashmap_get(g_vars, key);
 	assert(var == NULL || !var->initialized);
 	if (var != NULL) {
 		var->initialized = true;
@@ -901,7 +889,7 @@ csh_register_var(const char *key, struct csh_var tmpvar)
 		return;
 	}
 
-	var = pw_avl_alloc(g_var_avl);
+	var = calloc(1, sizeof(*var));
 	assert(var);
 
 	memcpy(var, &tmpvar, sizeof(*var));
@@ -910,7 +898,12 @@ csh_register_var(const char *key, struct csh_var tmpvar)
 	reset_var_val(var);
 
 	var->initialized = true;
-	pw_avl_insert(g_var_avl, hash, var);
+	/* the key is interned in the var itself */
+	rc = pw_hashmap_set(g_vars, var->key, var);
+	if (rc != 0) {
+		/* out of memory, the var stays unregistered */
+		free(var);
+	}
 	unlock();
 }
 
@@ -954,14 +947,9 @@ void
 csh_register_var_callback(const char *key, csh_set_cb_fn fn)
 {
 	struct csh_var *var;
-	uint32_t hash = djb2(key);
 
 	lock();
-	var = pw_avl_get(g_var_avl, hash);
-	while (var && strcmp(var->key, key) != 0) {
-		var = pw_avl_get_next(g_var_avl, var);
-	}
-
+	var = pw_hashmap_get(g_vars, key);
 	assert(var);
 	assert(!var->cb_fn);
 
@@ -970,10 +958,9 @@ csh_register_var_callback(const char *key, csh_set_cb_fn fn)
 }
 
 static void
-static_preinit_foreach_var_cb(void *el, void *ctx1, void *ctx2)
+static_preinit_foreach_var_cb(const char *key, void *data, void *ctx)
 {
-	struct pw_avl_node *node = el;
-	struct csh_var *var = (void *)node->data;
+	struct csh_var *var = data;
 
 	var->initialized = false;
 	var->cb_fn = NULL;
@@ -1003,11 +990,11 @@ csh_static_preinit(void)
 	}
 	g_reset_fns = NULL;
 
-	if (g_var_avl) {
-		pw_avl_foreach(g_var_avl, static_preinit_foreach_var_cb, NULL, NULL);
+	if (g_vars) {
+		pw_hashmap_foreach(g_vars, static_preinit_foreach_var_cb, NULL);
 	} else {
-		g_var_avl = pw_avl_init(sizeof(struct csh_var));
-		assert(g_var_avl != NULL);
+		g_vars = pw_hashmap_init(256);
+		assert(g_vars != NULL);
 	}
 
 	csh_register_cmd("profile", cmd_profile_fn, NULL);
@@ -37,7 +37,7 @@
 #include <bfd.h>
 
 #include "extlib.h"
-#include "avl.h"
+#include "hashmap.h"
 
 #define CIMGUI_DEFINE_ENUMS_AND_STRUCTS 1
 #include <cimgui.h>
@@ -53,50 +53,23 @@ pid_t fork(void) { return 0; };
 int __cxa_guard_acquire(void *arg) { return 0; };
 void __cxa_guard_release(void *arg) { };
 
-static struct pw_avl *g_mem;
-
-static uint32_t
-djb2(const char *str)
-{
-	uint32_t hash = 5381;
-	unsigned char c;
-
-	while ((c = (unsigned char)*str++)) {
-	    hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
-	}
-
-	return hash;
-}
-
-static struct mem_region *
-_get_mem(uint32_t hash, const char *name)
-{
-    struct mem_region *mem;
-
-	mem = pw_avl_get(g_mem, hash);
-	while (mem && strcmp(mem->name, name) != 0) {
-		mem = pw_avl_get_next(g_mem, mem);
-	}
-
-	return mem;
-}
+static struct pw_hashmap *g_mem;
 
 struct mem_region *
 mem_region_get(const char *name, uint32_t size)
 {
 	struct mem_region *mem;
-    uint32_t hash = djb2(name);
 
     if (!g_mem) {
         return NULL;
     }
 
-	mem = _get_mem(hash, name);
+	mem = pw_hashmap_get(g_mem, name);
     if (mem) {
         return mem;
     }
 
-	mem = pw_avl_alloc(g_mem);
+	mem = calloc(1, sizeof(*mem));
 	if (!mem) {
 		return NULL;
 	}
@@ -107,12 +80,18 @@ mem_region_get(const char *name, uint32_t size)
     if (size) {
         mem->data = calloc(1, size);
         if (!mem->data) {
-            pw_avl_free(g_mem, mem);
+            free(mem);
             return NULL;
         }
     }
 
-    pw_avl_insert(g_mem, hash, mem);
+    /* the name is interned in the region itself */
+    if (pw_hashmap_set(g_mem, mem->name, mem) != 0) {
+        free(mem->data);
+        free(mem);
+        return NULL;
+    }
+
     return mem;
 }
 
@@ -142,14 +121,14 @@ mem_region_get_i32(const char *name)
 void
 mem_region_free(struct mem_region *mem)
 {
-    pw_avl_remove(g_mem, mem);
-    pw_avl_free(g_mem, mem);
+    pw_hashmap_del(g_mem, mem->name);
+    free(mem);
 }
 
 static void __attribute__((constructor))
 extlib_init(void)
 {
-    g_mem = pw_avl_init(sizeof(struct mem_region));
+    g_mem = pw_hashmap_init(64);
     if (!g_mem) {
         /* run to the woods */
     }
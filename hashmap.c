@@ -0,0 +1,369 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright(c) 2022 Darek Stojaczyk for pwmirage.com
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "hashmap.h"
+
+#define HASHMAP_MIN_CAPACITY 16
+
+struct pw_hashmap *
+pw_hashmap_init(size_t capacity)
+{
+	struct pw_hashmap *map;
+	size_t cap = HASHMAP_MIN_CAPACITY;
+
+	while (cap < capacity) {
+		cap *= 2;
+	}
+
+	map = calloc(1, sizeof(*map));
+	if (!map) {
+		return NULL;
+	}
+
+	map->els = calloc(cap, sizeof(*map->els));
+	if (!map->els) {
+		free(map);
+		return NULL;
+	}
+
+	map->capacity = cap;
+	return map;
+}
+
+void
+pw_hashmap_deinit(struct pw_hashmap *map)
+{
+	if (!map) {
+		return;
+	}
+
+	free(map->els);
+	free(map);
+}
+
+uint32_t
+pw_hashmap_hash(const char *key)
+{
+	uint32_t hash = 2166136261u;
+	unsigned char c;
+
+	/* FNV-1a */
+	while ((c = (unsigned char)*key++)) {
+		hash ^= c;
+		hash *= 16777619u;
+	}
+
+	/* murmur3 finalizer, so the low bits we mask with are well mixed */
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6b;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35;
+	hash ^= hash >> 16;
+
+	/* 0 marks an empty slot */
+	return hash ? hash : 1;
+}
+
+static size_t
+probe_dist(struct pw_hashmap *map, uint32_t hash, size_t idx)
+{
+	return (idx - (hash & (map->capacity - 1))) & (map->capacity - 1);
+}
+
+static struct pw_hashmap_el *
+find(struct pw_hashmap *map, const char *key, uint32_t hash)
+{
+	size_t mask = map->capacity - 1;
+	size_t idx = hash & mask;
+	size_t dist = 0;
+
+	while (true) {
+		struct pw_hashmap_el *el = &map->els[idx];
+
+		/* with robin hood ordering we can stop as soon as we see an
+		 * element that's closer to its home slot than we would be */
+		if (!el->hash || probe_dist(map, el->hash, idx) < dist) {
+			return NULL;
+		}
+
+		if (el->hash == hash && (el->key == key || strcmp(el->key, key) == 0)) {
+			return el;
+		}
+
+		idx = (idx + 1) & mask;
+		dist++;
+	}
+}
+
+static void
+insert_el(struct pw_hashmap *map, struct pw_hashmap_el el)
+{
+	size_t mask = map->capacity - 1;
+	size_t idx = el.hash & mask;
+	size_t dist = 0;
+
+	while (true) {
+		struct pw_hashmap_el *cur = &map->els[idx];
+		size_t cur_dist;
+
+		if (!cur->hash) {
+			*cur = el;
+			map->count++;
+			return;
+		}
+
+		/* take the slot from the richer element and keep going with it */
+		cur_dist = probe_dist(map, cur->hash, idx);
+		if (cur_dist < dist) {
+			struct pw_hashmap_el tmp = *cur;
+
+			*cur = el;
+			el = tmp;
+			dist = cur_dist;
+		}
+
+		idx = (idx + 1) & mask;
+		dist++;
+	}
+}
+
+static int
+resize(struct pw_hashmap *map, size_t capacity)
+{
+	struct pw_hashmap_el *old_els = map->els;
+	size_t i, old_capacity = map->capacity;
+
+	map->els = calloc(capacity, sizeof(*map->els));
+	if (!map->els) {
+		map->els = old_els;
+		return -ENOMEM;
+	}
+
+	map->capacity = capacity;
+	map->count = 0;
+	for (i = 0; i < old_capacity; i++) {
+		if (old_els[i].hash) {
+			insert_el(map, old_els[i]);
+		}
+	}
+
+	free(old_els);
+	return 0;
+}
+
+void *
+pw_hashmap_get_hashed(struct pw_hashmap *map, const char *key, uint32_t hash)
+{
+	struct pw_hashmap_el *el = find(map, key, hash);
+
+	return el ? el->data : NULL;
+}
+
+void *
+pw_hashmap_get(struct pw_hashmap *map, const char *key)
+{
+	return pw_hashmap_get_hashed(map, key, pw_hashmap_hash(key));
+}
+
+int
+pw_hashmap_set_hashed(struct pw_hashmap *map, const char *key, uint32_t hash, void *data)
+{
+	struct pw_hashmap_el *el;
+	int rc;
+
+	el = find(map, key, hash);
+	if (el) {
+		el->key = key;
+		el->data = data;
+		return 0;
+	}
+
+	/* keep the load factor under 3/4 */
+	if ((map->count + 1) * 4 > map->capacity * 3) {
+		rc = resize(map, map->capacity * 2);
+		if (rc) {
+			return rc;
+		}
+	}
+
+	insert_el(map, (struct pw_hashmap_el){ .hash = hash, .key = key, .data = data });
+	return 0;
+}
+
+int
+pw_hashmap_set(struct pw_hashmap *map, const char *key, void *data)
+{
+	return pw_hashmap_set_hashed(map, key, pw_hashmap_hash(key), data);
+}
+
+void *
+pw_hashmap_del_hashed(struct pw_hashmap *map, const char *key, uint32_t hash)
+{
+	size_t mask = map->capacity - 1;
+	struct pw_hashmap_el *el;
+	size_t idx, next;
+	void *data;
+
+	el = find(map, key, hash);
+	if (!el) {
+		return NULL;
+	}
+
+	data = el->data;
+	idx = el - map->els;
+
+	/* shift the following elements back, so there's no need for tombstones */
+	while (true) {
+		next = (idx + 1) & mask;
+		if (!map->els[next].hash || probe_dist(map, map->els[next].hash, next) == 0) {
+			break;
+		}
+
+		map->els[idx] = map->els[next];
+		idx = next;
+	}
+
+	memset(&map->els[idx], 0, sizeof(map->els[idx]));
+	map->count--;
+	return data;
+}
+
+void *
+pw_hashmap_del(struct pw_hashmap *map, const char *key)
+{
+	return pw_hashmap_del_hashed(map, key, pw_hashmap_hash(key));
+}
+
+void
+pw_hashmap_foreach(struct pw_hashmap *map, pw_hashmap_foreach_cb cb, void *ctx)
+{
+	size_t i;
+
+	for (i = 0; i < map->capacity; i++) {
+		struct pw_hashmap_el *el = &map->els[i];
+
+		if (el->hash) {
+			cb(el->key, el->data, ctx);
+		}
+	}
+}
+
+#ifdef PW_HASHMAP_TEST
+#include <time.h>
+#include "avl.h"
+
+struct test_el {
+	char key[28];
+	uint32_t val;
+};
+
+static uint32_t
+djb2(const char *str)
+{
+	uint32_t hash = 5381;
+	unsigned char c;
+
+	while ((c = (unsigned char)*str++)) {
+	    hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+	}
+
+	return hash;
+}
+
+static struct test_el *
+avl_get(struct pw_avl *avl, const char *key)
+{
+	struct test_el *el;
+
+	el = pw_avl_get(avl, djb2(key));
+	while (el && strcmp(el->key, key) != 0) {
+		el = pw_avl_get_next(avl, el);
+	}
+
+	return el;
+}
+
+static double
+elapsed_ms(clock_t start)
+{
+	return (double)(clock() - start) * 1000 / CLOCKS_PER_SEC;
+}
+
+static void
+bench(size_t count, size_t lookups)
+{
+	struct pw_hashmap *map = pw_hashmap_init(0);
+	struct pw_avl *avl = pw_avl_init(sizeof(struct test_el));
+	struct test_el *els = calloc(count, sizeof(*els));
+	char (*keys)[28] = calloc(count, sizeof(*keys));
+	clock_t start;
+	double avl_ms, map_ms;
+	size_t i, found = 0;
+	int rc;
+
+	assert(map && avl && els && keys);
+	for (i = 0; i < count; i++) {
+		struct test_el *el = pw_avl_alloc(avl);
+
+		/* csh-like variable names */
+		snprintf(els[i].key, sizeof(els[i].key), "r_some_var_%zu", i);
+		/* lookups use a separate copy of the key, like csh_get_i("...") */
+		memcpy(keys[i], els[i].key, sizeof(keys[i]));
+		els[i].val = i;
+		rc = pw_hashmap_set(map, els[i].key, &els[i]);
+		assert(rc == 0);
+
+		*el = els[i];
+		pw_avl_insert(avl, djb2(el->key), el);
+	}
+	assert(map->count == count);
+
+	/* scattered order, so the tree can't benefit from a warm path */
+	start = clock();
+	for (i = 0; i < lookups; i++) {
+		found += avl_get(avl, keys[(i * 7919) % count]) != NULL;
+	}
+	avl_ms = elapsed_ms(start);
+
+	start = clock();
+	for (i = 0; i < lookups; i++) {
+		found += pw_hashmap_get(map, keys[(i * 7919) % count]) != NULL;
+	}
+	map_ms = elapsed_ms(start);
+	assert(found == 2 * lookups);
+
+	/* remove every other entry and make sure the rest is still reachable */
+	for (i = 0; i < count; i += 2) {
+		struct test_el *el = pw_hashmap_del(map, els[i].key);
+
+		assert(el == &els[i]);
+	}
+	for (i = 0; i < count; i++) {
+		assert(pw_hashmap_get(map, els[i].key) == (i % 2 ? &els[i] : NULL));
+	}
+
+	fprintf(stderr, "%6zu keys: avl %6.2f Mlookups/s, hashmap %6.2f Mlookups/s\n",
+			count, lookups / avl_ms / 1000, lookups / map_ms / 1000);
+
+	pw_hashmap_deinit(map);
+	pw_avl_deinit(avl);
+	free(els);
+	free(keys);
+}
+
+int
+main(void)
+{
+	bench(100, 10000000);
+	bench(1000, 10000000);
+	bench(10000, 10000000);
+	return 0;
+}
+#endif
@@ -0,0 +1,63 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright(c) 2022 Darek Stojaczyk for pwmirage.com
+ */
+
+#ifndef PW_HASHMAP_H
+#define PW_HASHMAP_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+/**
+ * Flat, open-addressing (Robin Hood) string -> pointer map.
+ *
+ * Keys are not copied. They're expected to be interned, i.e. to live inside
+ * the stored element (or any other storage that outlives the entry). This
+ * lets a lookup with the very same key pointer skip the strcmp().
+ */
+
+struct pw_hashmap_el {
+	uint32_t hash; /**< 0 = empty slot */
+	const char *key;
+	void *data;
+};
+
+struct pw_hashmap {
+	size_t capacity; /**< always a power of 2 */
+	size_t count;
+	struct pw_hashmap_el *els;
+};
+
+typedef void (*pw_hashmap_foreach_cb)(const char *key, void *data, void *ctx);
+
+struct pw_hashmap *pw_hashmap_init(size_t capacity);
+void pw_hashmap_deinit(struct pw_hashmap *map);
+uint32_t pw_hashmap_hash(const char *key);
+
+/** \return data stored at the key, NULL if there's none */
+void *pw_hashmap_get(struct pw_hashmap *map, const char *key);
+
+/**
+ * Insert or replace the entry at `key`. `key` must stay valid until it's
+ * removed from the map.
+ *
+ * \return 0 on success, -ENOMEM otherwise
+ */
+int pw_hashmap_set(struct pw_hashmap *map, const char *key, void *data);
+
+/** \return data that was stored at the key, NULL if there was none */
+void *pw_hashmap_del(struct pw_hashmap *map, const char *key);
+
+/**
+ * The same, but with a hash computed by the caller, e.g. a faster one for
+ * long keys of known length. It must be non-zero and the same one must be
+ * used for all operations on the key. Don't mix with the above.
+ */
+void *pw_hashmap_get_hashed(struct pw_hashmap *map, const char *key, uint32_t hash);
+int pw_hashmap_set_hashed(struct pw_hashmap *map, const char *key, uint32_t hash, void *data);
+void *pw_hashmap_del_hashed(struct pw_hashmap *map, const char *key, uint32_t hash);
+
+void pw_hashmap_foreach(struct pw_hashmap *map, pw_hashmap_foreach_cb cb, void *ctx);
+
+#endif /* PW_HASHMAP_H */
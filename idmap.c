@@ -2,6 +2,7 @@
  * Copyright(c) 2020 Darek Stojaczyk for pwmirage.com
  */
 
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,34 +10,108 @@
 #include <assert.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
 
 #include "idmap.h"
 #include "common.h"
 #include "avl.h"
+#include "crc.h"
+#include "rcu.h"
+#if defined(PW_IDMAP_TEST) || defined(PW_IDMAP_STANDALONE)
+/* no windows.h on the test host, nor in the offline tools */
+#define pw_log(...) fprintf(stderr, __VA_ARGS__)
+#else
 #include "pw_api.h"
-
-#define IDMAP_VERSION 3
-
-struct pw_idmap_file_hdr {
-	uint32_t version;
-};
-
-struct pw_idmap_file_entry {
-	uint64_t lid;
-	uint32_t id;
-	uint8_t type;
-};
+#endif
+
+/* mappings are only ever added, so allocate them in big chunks */
+#define IDMAP_POOL_CHUNK_SIZE 1024
+/* the trees are keyed by (lid << IDMAP_TYPE_BITS | type) */
+#define IDMAP_TYPE_BITS 16
+#define IDMAP_TYPE_MASK ((1 << IDMAP_TYPE_BITS) - 1)
+/* the id array is used while at least 1 in IDMAP_ID_ARR_DENSITY slots is set */
+#define IDMAP_ID_ARR_DENSITY 4
+/* optimistic reads before a reader takes the writer lock instead */
+#define IDMAP_READ_RETRIES 16
+/* ...the first few after a short spin, then after yielding the cpu */
+#define IDMAP_READ_SPINS 6
+/* the id array at least doubles when replaced, so one write can't replace it more often */
+#define IDMAP_OLD_MAX 64
+/* async callbacks allocated at once */
+#define IDMAP_ASYNC_CHUNK_SIZE 256
+/* fold the journal into the base file once it's this big... */
+#define IDMAP_JOURNAL_COMPACT_MIN 4096
+/* ...or bigger than 1/N of the base file */
+#define IDMAP_JOURNAL_COMPACT_RATIO 4
+
+struct pw_idmap_async_fn_head;
+union pw_idmap_async_slot;
 
 struct pw_idmap {
 	char *name;
 	long registered_types_cnt;
 	long max_id;
 	int can_set;
+	/* mappings loaded from the file, sorted by lid */
+	struct pw_idmap_file_entry *file_entries;
+	size_t file_entry_cnt;
+	/* indices into file_entries, sorted by id */
+	uint32_t *file_id_idx;
+	/* mappings added at runtime */
 	struct pw_avl *lid_mappings;
-	struct pw_avl *id_mappings;
+	/* elements by (lid, type) */
 	struct pw_avl *by_lid;
+	/* pointer to the element with the lowest type of each lid in by_lid */
+	struct pw_avl *by_lid_low;
+	/* elements with lids too big for the composite key, by lid only */
+	struct pw_avl *by_lid_wide;
+	/* elements by id, chained with id_next(). Covers ids below id_arr_cap */
+	struct pw_idmap_el **id_arr;
+	size_t id_arr_cap;
+	/* pointers to elements by (id, type), for ids beyond the array */
 	struct pw_avl *by_id;
+	/* elements in both of the above */
+	size_t id_el_cnt;
 	bool ignore_dups;
+	/* runtime mappings not written to any file yet */
+	struct pw_idmap_file_entry **unsaved;
+	size_t unsaved_cnt;
+	size_t unsaved_cap;
+	/* of the loaded file, 0 if there's none (or it's v3) */
+	uint64_t base_id;
+	/* journal mode */
+	bool use_journal;
+	bool journal_torn;
+	size_t journal_cnt;
+	/* free async callbacks and their heads, see async_alloc() */
+	union pw_idmap_async_slot *async_free;
+	void *async_chunks;
+	/* see pw_idmap_defer_async() */
+	bool defer_async;
+	struct pw_idmap_async_fn_head *deferred;
+	struct pw_idmap_async_fn_head **deferred_tail;
+	/* see pw_idmap_enable_concurrency() */
+	bool concurrent;
+#ifdef _WIN32
+	CRITICAL_SECTION write_lock;
+#else
+	pthread_mutex_t write_lock;
+#endif
+	/* odd while a writer modifies the indices */
+	uint32_t seq;
+	struct pw_rcu *rcu;
+	/* replaced id arrays and by_id trees, freed once no reader can see them */
+	struct pw_idmap_el **id_arr_old[IDMAP_OLD_MAX];
+	struct pw_avl *by_id_old[IDMAP_OLD_MAX];
+	unsigned id_arr_old_cnt, by_id_old_cnt;
 };
 
 struct pw_idmap_async_fn_el {
@@ -45,17 +120,351 @@ struct pw_idmap_async_fn_el {
 	struct pw_idmap_async_fn_el *next;
 };
 
+/* callbacks waiting for one element */
 struct pw_idmap_async_fn_head {
 	struct pw_idmap_async_fn_el *head;
 	struct pw_idmap_async_fn_el **tail;
+	/* only when deferred, the element that was set */
+	struct pw_idmap_el *el;
+	struct pw_idmap_async_fn_head *next;
+};
+
+union pw_idmap_async_slot {
+	struct pw_idmap_async_fn_el fn_el;
+	struct pw_idmap_async_fn_head head;
+	union pw_idmap_async_slot *next_free;
+};
+
+/* what the lid trees actually store. The public part comes first */
+struct idmap_el {
+	struct pw_idmap_el el;
+	/* next element with the same id, see id_arr_link() */
+	struct pw_idmap_el *id_next;
 };
 
+static inline struct pw_idmap_el **
+id_next(struct pw_idmap_el *el)
+{
+	return &((struct idmap_el *)el)->id_next;
+}
+
+static int
+cmp_entry_lid(const void *a, const void *b)
+{
+	const struct pw_idmap_file_entry *e1 = a, *e2 = b;
+
+	return e1->lid < e2->lid ? -1 : e1->lid > e2->lid;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t v1 = *(const uint64_t *)a, v2 = *(const uint64_t *)b;
+
+	return v1 < v2 ? -1 : v1 > v2;
+}
+
+static int
+build_id_index(struct pw_idmap_file_entry *entries, uint32_t *id_idx, size_t count)
+{
+	uint64_t *id_keys;
+	size_t i;
+
+	id_keys = malloc(count * sizeof(*id_keys));
+	if (!id_keys) {
+		return -ENOMEM;
+	}
+
+	/* sort (id, index) pairs, this keeps same-id entries in lid order */
+	for (i = 0; i < count; i++) {
+		id_keys[i] = (uint64_t)entries[i].id << 32 | i;
+	}
+	qsort(id_keys, count, sizeof(*id_keys), cmp_u64);
+	for (i = 0; i < count; i++) {
+		id_idx[i] = (uint32_t)id_keys[i];
+	}
+
+	free(id_keys);
+	return 0;
+}
+
+static int
+load_v3(struct pw_idmap *map, FILE *fp)
+{
+	struct pw_idmap_file_entry *entries;
+	uint32_t *id_idx;
+	size_t i, fpos, fsize, entry_cnt;
+	bool sorted = true;
+
+	fpos = ftell(fp);
+	fseek(fp, 0, SEEK_END);
+	fsize = ftell(fp);
+	fseek(fp, fpos, SEEK_SET);
+	entry_cnt = (fsize - fpos) / sizeof(struct pw_idmap_file_entry);
+	if (entry_cnt == 0) {
+		return 0;
+	}
+
+	/* the whole file in one go, the entries are used in place */
+	entries = malloc(entry_cnt * sizeof(*entries));
+	id_idx = malloc(entry_cnt * sizeof(*id_idx));
+	if (!entries || !id_idx) {
+		free(entries);
+		free(id_idx);
+		return -ENOMEM;
+	}
+
+	entry_cnt = fread(entries, sizeof(*entries), entry_cnt, fp);
+
+	for (i = 0; i < entry_cnt; i++) {
+		if (i > 0 && entries[i].lid < entries[i - 1].lid) {
+			sorted = false;
+		}
+	}
+
+	if (!sorted) {
+		qsort(entries, entry_cnt, sizeof(*entries), cmp_entry_lid);
+	}
+
+	if (build_id_index(entries, id_idx, entry_cnt) != 0) {
+		free(entries);
+		free(id_idx);
+		return -ENOMEM;
+	}
+
+	map->file_entries = entries;
+	map->file_id_idx = id_idx;
+	map->file_entry_cnt = entry_cnt;
+	return 0;
+}
+
+static int
+load_v4(struct pw_idmap *map, FILE *fp, struct pw_idmap_file_hdr *hdr)
+{
+	struct pw_idmap_file_entry *entries;
+	uint32_t *id_idx;
+	size_t i, fpos, fsize, count = hdr->count;
+	uint32_t crc;
+
+	if (hdr->entry_size != sizeof(*entries)) {
+		return -EINVAL;
+	}
+
+	fpos = ftell(fp);
+	fseek(fp, 0, SEEK_END);
+	fsize = ftell(fp);
+	fseek(fp, fpos, SEEK_SET);
+	if (fsize - fpos != count * (sizeof(*entries) + sizeof(*id_idx))) {
+		return -EINVAL;
+	}
+
+	if (count == 0) {
+		return 0;
+	}
+
+	entries = malloc(count * sizeof(*entries));
+	id_idx = malloc(count * sizeof(*id_idx));
+	if (!entries || !id_idx) {
+		free(entries);
+		free(id_idx);
+		return -ENOMEM;
+	}
+
+	if (fread(entries, sizeof(*entries), count, fp) != count ||
+			fread(id_idx, sizeof(*id_idx), count, fp) != count) {
+		free(entries);
+		free(id_idx);
+		return -EIO;
+	}
+
+	crc = pw_crc32(0, entries, count * sizeof(*entries));
+	crc = pw_crc32(crc, id_idx, count * sizeof(*id_idx));
+	if (crc != hdr->crc) {
+		free(entries);
+		free(id_idx);
+		return -EILSEQ;
+	}
+
+	/* the lookups rely on both orders, don't trust them blindly */
+	for (i = 0; i < count; i++) {
+		if ((i > 0 && entries[i].lid < entries[i - 1].lid) || id_idx[i] >= count ||
+				(i > 0 && entries[id_idx[i]].id < entries[id_idx[i - 1]].id)) {
+			free(entries);
+			free(id_idx);
+			return -EINVAL;
+		}
+	}
+
+	map->file_entries = entries;
+	map->file_id_idx = id_idx;
+	map->file_entry_cnt = count;
+	return 0;
+}
+
+static void
+load_file(struct pw_idmap *map, const char *filename, FILE *fp)
+{
+	struct pw_idmap_file_hdr hdr = {};
+	size_t i;
+	int rc;
+
+	fread(&hdr.version, 1, sizeof(hdr.version), fp);
+
+	if (hdr.version == PW_IDMAP_VERSION_V3) {
+		rc = load_v3(map, fp);
+	} else if (hdr.version == PW_IDMAP_VERSION &&
+			fread(&hdr.entry_size, 1, sizeof(hdr) - sizeof(hdr.version), fp) ==
+			sizeof(hdr) - sizeof(hdr.version)) {
+		rc = load_v4(map, fp, &hdr);
+		if (rc == 0) {
+			map->base_id = hdr.base_id;
+		}
+	} else {
+		rc = -EINVAL;
+	}
+
+	if (rc != 0) {
+		/* pretend it's not even there */
+		pw_log("%s: can't load %s (version %u): %d\n", map->name, filename, hdr.version, rc);
+	}
+
+	for (i = 0; i < map->file_entry_cnt; i++) {
+		if (map->file_entries[i].id > map->max_id) {
+			map->max_id = map->file_entries[i].id;
+		}
+	}
+}
+
+static struct pw_idmap_file_entry *get_lid_mapping(struct pw_idmap *map, long long lid);
+
+static void
+journal_path(char *buf, size_t len, const char *filename)
+{
+	snprintf(buf, len, "%s.journal", filename);
+}
+
+/*
+ * A counter would give the same id to two files saved from the same one,
+ * so mix the entry count with whatever differs between saves and processes.
+ */
+uint64_t
+pw_idmap_new_base_id(uint32_t count)
+{
+	static uint64_t last;
+	uint64_t x = (uint64_t)count << 24 ^ last ^ 0x9e3779b97f4a7c15ULL;
+
+	x ^= (uint64_t)time(NULL) * 0x9e3779b97f4a7c15ULL ^ (uint64_t)clock() << 20;
+	x ^= (uintptr_t)&x;
+#ifdef _WIN32
+	LARGE_INTEGER pc;
+
+	QueryPerformanceCounter(&pc);
+	x ^= (uint64_t)pc.QuadPart << 7 ^ (uint64_t)GetCurrentProcessId() << 40;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	x ^= (uint64_t)ts.tv_nsec << 7 ^ (uint64_t)getpid() << 40;
+#endif
+
+	/* splitmix64 finalizer */
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	last = x ? x : 1;
+	return last;
+}
+
+static uint32_t
+journal_rec_crc(struct pw_idmap_journal_rec *rec)
+{
+	return pw_crc32(0, rec, offsetof(struct pw_idmap_journal_rec, crc));
+}
+
+static void
+replay_journal(struct pw_idmap *map, const char *filename)
+{
+	struct pw_idmap_journal_hdr jhdr;
+	struct pw_idmap_journal_rec rec;
+	struct pw_idmap_file_entry *entry;
+	char path[512];
+	FILE *fp;
+
+	journal_path(path, sizeof(path), filename);
+	fp = fopen(path, "rb");
+	if (!fp) {
+		return;
+	}
+
+	/* left over from another file (or the very first append was torn),
+	 * the next save rewrites the file and removes it */
+	if (fread(&jhdr, 1, sizeof(jhdr), fp) != sizeof(jhdr) ||
+			jhdr.magic != PW_IDMAP_JOURNAL_HDR_MAGIC || jhdr.base_id == 0 ||
+			jhdr.base_id != map->base_id) {
+		pw_log("%s: ignoring a journal that wasn't written for %s\n", map->name, filename);
+		map->journal_torn = true;
+		fclose(fp);
+		return;
+	}
+
+	while (true) {
+		size_t len = fread(&rec, 1, sizeof(rec), fp);
+
+		if (len == 0) {
+			break;
+		}
+
+		/* a crash in the middle of an append leaves a torn record at the
+		 * end. Anything after it can't be trusted, and can't be appended
+		 * to either, so force a compaction on the next save */
+		if (len != sizeof(rec) || rec.magic != PW_IDMAP_JOURNAL_MAGIC ||
+				rec.crc != journal_rec_crc(&rec)) {
+			pw_log("%s: discarding a torn journal record at %zu\n", map->name,
+					map->journal_cnt);
+			map->journal_torn = true;
+			break;
+		}
+
+		map->journal_cnt++;
+
+		/* already folded into the base file, if compaction was interrupted */
+		entry = get_lid_mapping(map, rec.lid);
+		if (entry && entry->id == rec.id) {
+			continue;
+		}
+
+		/* new ids are always above all the others, anything else would
+		 * map an id that's taken to a second lid */
+		if (entry || rec.id <= map->max_id) {
+			pw_log("%s: discarding a conflicting journal record at %zu (lid=0x%" PRIx64
+					", id=%u)\n", map->name, map->journal_cnt - 1, rec.lid, rec.id);
+			map->journal_torn = true;
+			continue;
+		}
+
+		entry = pw_avl_alloc(map->lid_mappings);
+		if (!entry) {
+			break;
+		}
+
+		entry->lid = rec.lid;
+		entry->id = rec.id;
+		entry->type = rec.type;
+		pw_avl_insert(map->lid_mappings, rec.lid, entry);
+
+		if (entry->id > map->max_id) {
+			map->max_id = entry->id;
+		}
+	}
+
+	fclose(fp);
+}
+
 struct pw_idmap *
 pw_idmap_init(const char *name, const char *filename, int can_set)
 {
 	struct pw_idmap *map;
 	FILE *fp;
-	int i;
 
 	map = calloc(1, sizeof(*map));
 	if (!map) {
@@ -69,30 +478,41 @@ pw_idmap_init(const char *name, const char *filename, int can_set)
 	}
 
 	map->can_set = can_set;
+	map->deferred_tail = &map->deferred;
 
-	map->by_lid = pw_avl_init(sizeof(struct pw_idmap_el));
+	map->by_lid = pw_avl_init_pooled(sizeof(struct idmap_el), IDMAP_POOL_CHUNK_SIZE);
 	if (!map->by_lid) {
 		free(map->name);
 		free(map);
 		return NULL;
 	}
 
-	map->by_id = pw_avl_init(sizeof(struct pw_idmap_el *));
-	if (!map->by_id) {
+	map->by_lid_low = pw_avl_init_pooled(sizeof(struct pw_idmap_el *), IDMAP_POOL_CHUNK_SIZE);
+	if (!map->by_lid_low) {
 		free(map->name);
 		free(map);
 		return NULL;
 	}
 
-	map->lid_mappings = pw_avl_init(sizeof(struct pw_idmap_file_entry));
-	if (!map->lid_mappings) {
+	/* not pooled, it's rarely used. The optimistic concurrent reads are
+	 * still safe, but only because elements are never removed, so none
+	 * of its nodes is ever freed */
+	map->by_lid_wide = pw_avl_init(sizeof(struct idmap_el));
+	if (!map->by_lid_wide) {
+		free(map->name);
+		free(map);
+		return NULL;
+	}
+
+	map->by_id = pw_avl_init_pooled(sizeof(struct pw_idmap_el *), IDMAP_POOL_CHUNK_SIZE);
+	if (!map->by_id) {
 		free(map->name);
 		free(map);
 		return NULL;
 	}
 
-	map->id_mappings = pw_avl_init(sizeof(struct pw_idmap_file_entry *));
-	if (!map->id_mappings) {
+	map->lid_mappings = pw_avl_init_pooled(sizeof(struct pw_idmap_file_entry), IDMAP_POOL_CHUNK_SIZE);
+	if (!map->lid_mappings) {
 		free(map->name);
 		free(map);
 		return NULL;
@@ -103,50 +523,83 @@ pw_idmap_init(const char *name, const char *filename, int can_set)
 	}
 
 	fp = fopen(filename, "rb");
-	if (fp == NULL) {
+	if (fp) {
+		load_file(map, filename, fp);
+		fclose(fp);
+	} else {
 		/* we'll create it on pw_idmap_save(), no problem */
-		return map;
 	}
 
-	struct pw_idmap_file_hdr hdr;
-	fread(&hdr, 1, sizeof(hdr), fp);
+	/* mappings saved after the last compaction */
+	replay_journal(map, filename);
+	return map;
+}
 
-	if (hdr.version != IDMAP_VERSION) {
-		/* pretend it's not even there */
-		fclose(fp);
-		return map;
+/* first file entry with given lid */
+static struct pw_idmap_file_entry *
+file_get_lid(struct pw_idmap *map, long long lid)
+{
+	size_t lo = 0, hi = map->file_entry_cnt;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (map->file_entries[mid].lid < (uint64_t)lid) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
 	}
 
-	size_t fpos = ftell(fp);
-	fseek(fp, 0, SEEK_END);
-	size_t fsize = ftell(fp);
-	fseek(fp, fpos, SEEK_SET);
-	int entry_cnt = (fsize - fpos) / sizeof(struct pw_idmap_file_entry);
+	if (lo == map->file_entry_cnt || map->file_entries[lo].lid != (uint64_t)lid) {
+		return NULL;
+	}
 
-	for (i = 0; i < entry_cnt; i++) {
-		struct pw_idmap_file_entry *entry;
-		struct pw_idmap_file_entry **id_entry;
+	return &map->file_entries[lo];
+}
 
-		entry = pw_avl_alloc(map->lid_mappings);
-		assert(entry);
-		id_entry = pw_avl_alloc(map->id_mappings);
-		assert(id_entry);
+/* first file entry with given id and a matching type */
+static struct pw_idmap_file_entry *
+file_get_id(struct pw_idmap *map, long id, long type)
+{
+	size_t lo = 0, hi = map->file_entry_cnt;
+	struct pw_idmap_file_entry *entry;
 
-		*id_entry = entry;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
 
-		fread(entry, 1, sizeof(*entry), fp);
+		if (map->file_entries[map->file_id_idx[mid]].id < (uint32_t)id) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
 
-		//pw_log("%s: lid=0x%llx, id=%u\n", map->name, entry->lid, entry->id);
-		pw_avl_insert(map->lid_mappings, entry->lid, entry);
-		pw_avl_insert(map->id_mappings, entry->id, id_entry);
+	for (; lo < map->file_entry_cnt; lo++) {
+		entry = &map->file_entries[map->file_id_idx[lo]];
+		if (entry->id != (uint32_t)id) {
+			break;
+		}
 
-		if (entry->id > map->max_id) {
-			map->max_id = entry->id;
+		if (!type || !entry->type || entry->type == type) {
+			return entry;
 		}
 	}
 
-	fclose(fp);
-	return map;
+	return NULL;
+}
+
+static struct pw_idmap_file_entry *
+get_lid_mapping(struct pw_idmap *map, long long lid)
+{
+	struct pw_idmap_file_entry *entry;
+
+	entry = file_get_lid(map, lid);
+	if (entry) {
+		return entry;
+	}
+
+	return pw_avl_get(map->lid_mappings, lid);
 }
 
 void
@@ -155,258 +608,2278 @@ pw_idmap_ignore_dups(struct pw_idmap *map)
 	map->ignore_dups = true;
 }
 
+void
+pw_idmap_use_journal(struct pw_idmap *map)
+{
+	map->use_journal = true;
+}
+
+static void write_lock(struct pw_idmap *map);
+static void write_unlock(struct pw_idmap *map);
+
 long
 pw_idmap_register_type(struct pw_idmap *map)
 {
-	return ++map->registered_types_cnt;
+	long type;
+
+	write_lock(map);
+	type = ++map->registered_types_cnt;
+	write_unlock(map);
+	return type;
 }
 
-struct pw_idmap_el *
-_idmap_get(struct pw_idmap *map, long long lid, long type, bool async)
+static bool
+typed_key(long long lid, long type, uint64_t *key)
 {
-	struct pw_idmap_el *el;
-	struct pw_idmap_el **el_p;
-
-	el = pw_avl_get(map->by_lid, lid);
-	while (el && ((!async && el->is_async_fn) || (type && el->type && el->type != type))) {
-		el = pw_avl_get_next(map->by_lid, el);
+	if (lid < 0 || (uint64_t)lid >> (64 - IDMAP_TYPE_BITS) != 0) {
+		return false;
 	}
 
-	if (el || lid >= 0x80000000) {
-		return el;
-	}
+	assert(type >= 0 && type <= IDMAP_TYPE_MASK);
+	*key = (uint64_t)lid << IDMAP_TYPE_BITS | type;
+	return true;
+}
 
-	el_p = pw_avl_get(map->by_id, lid);
-	el = el_p ? *el_p : NULL;
+/* ids always fit */
+static uint64_t
+id_key(long id, long type)
+{
+	return (uint64_t)id << IDMAP_TYPE_BITS | type;
+}
 
-	while (el && (type && el->type && el->type != type)) {
-		el_p = pw_avl_get_next(map->by_id, el_p);
-		el = el_p ? *el_p : NULL;
-	}
-	return el;
+static bool
+type_matches(struct pw_idmap_el *el, long type, bool async)
+{
+	return (async || !el->is_async_fn) && (!type || !el->type || el->type == type);
 }
 
-unsigned
-pw_idmap_get_mapping(struct pw_idmap *map, long long lid, long type)
+/* the old way, walk all elements with the same lid */
+static struct pw_idmap_el *
+get_wide(struct pw_idmap *map, long long lid, long type, bool async)
 {
-	struct pw_idmap_file_entry *entry;
+	struct pw_idmap_el *el;
 
-	entry = pw_avl_get(map->lid_mappings, lid);
-	if (entry) {
-		return entry->id;
+	el = pw_avl_get(map->by_lid_wide, lid);
+	while (el && !type_matches(el, type, async)) {
+		el = pw_avl_get_next(map->by_lid_wide, el);
 	}
 
-	return 0;
-}
-
-struct pw_idmap_el *
-pw_idmap_get(struct pw_idmap *map, long long lid, long type)
-{
-	return _idmap_get(map, lid, type, false);
+	return el;
 }
 
-/* retrieve the item even if it's not set yet. The callback will be fired
- * once pw_idmap_set() hits */
-int
-pw_idmap_get_async(struct pw_idmap *map, long long lid, long type, pw_idmap_async_fn fn, void *fn_ctx)
+/* the first element with the lowest type that matches, see by_lid_low */
+static struct pw_idmap_el *
+get_lowest(struct pw_avl *avl, uint64_t lo, bool async)
 {
+	uint64_t hi = lo | IDMAP_TYPE_MASK, key;
 	struct pw_idmap_el *el;
-	struct pw_idmap_async_fn_el *async_el;
-	struct pw_idmap_async_fn_head *async_head;
 
-	el = pw_avl_get(map->by_lid, lid);
-	while (el && (type && el->type && el->type != type)) {
-		el = pw_avl_get_next(map->by_lid, el);
-	}
+	/* usually the first one, unless it's an async placeholder */
+	while ((el = pw_avl_get_first(avl, lo, hi))) {
+		key = pw_avl_key(el);
+		for (; el; el = pw_avl_get_next(avl, el)) {
+			if (type_matches(el, 0, async)) {
+				return el;
+			}
+		}
 
-	if (el && !el->is_async_fn) {
-		fn(el, fn_ctx);
-		return 0;
+		if (key >= hi) {
+			break;
+		}
+		lo = key + 1;
 	}
 
-	//pw_log("setting async mapping at lid=0x%llx\n", lid);
+	return NULL;
+}
 
-	async_el = calloc(1, sizeof(*async_el));
-	if (!async_el) {
-		return -1;
+static struct pw_idmap_el *
+get_by_lid(struct pw_idmap *map, long long lid, long type, bool async)
+{
+	struct pw_idmap_el *el, **el_p;
+	uint64_t key;
+
+	if (!typed_key(lid, type, &key)) {
+		return get_wide(map, lid, type, async);
 	}
-	async_el->fn = fn;
-	async_el->ctx = fn_ctx;
 
-	if (!el) {
-		el = pw_idmap_set(map, lid, type, NULL);
-		if (!el) {
-			free(async_el);
-			return -1;
+	if (type == 0) {
+		el_p = pw_avl_get(map->by_lid_low, lid);
+		el = el_p ? __atomic_load_n(el_p, __ATOMIC_ACQUIRE) : NULL;
+		if (!el || type_matches(el, 0, async)) {
+			return el;
 		}
-		el->is_async_fn = 1;
+
+		/* an async placeholder, anything with a higher type will do */
+		return get_lowest(map->by_lid, key, async);
 	}
 
-	async_head = el->data;
-	if (!async_head) {
-		async_head = calloc(1, sizeof(*async_head));
-		if (!async_head) {
-			free(async_el);
-			return -1;
+	/* exact type first, then an untyped element */
+	for (el = pw_avl_get(map->by_lid, key); el; el = pw_avl_get_next(map->by_lid, el)) {
+		if (type_matches(el, type, async)) {
+			return el;
 		}
+	}
 
-		async_head->tail = &async_head->head;
-		el->data = async_head;
+	for (el = pw_avl_get(map->by_lid, key & ~(uint64_t)IDMAP_TYPE_MASK); el;
+			el = pw_avl_get_next(map->by_lid, el)) {
+		if (type_matches(el, type, async)) {
+			return el;
+		}
 	}
 
-	/* put it to the end to ensure the call order. everything queued first will
-	 * be called first. */
-	*async_head->tail = async_el;
-	async_head->tail = &async_el->next;
+	return NULL;
+}
 
+static struct pw_idmap_el *
+get_by_id(struct pw_idmap *map, long id, long type)
+{
+	struct pw_idmap_el **el_p;
+	struct pw_avl *by_id;
+	uint64_t key;
+	/* the array is published before its capacity, see id_arr_grow() */
+	size_t cap = __atomic_load_n(&map->id_arr_cap, __ATOMIC_ACQUIRE);
+
+	if (id >= 0 && id < cap) {
+		struct pw_idmap_el **arr = __atomic_load_n(&map->id_arr, __ATOMIC_ACQUIRE);
+		struct pw_idmap_el *el, *untyped = NULL;
+
+		for (el = arr[id]; el; el = *id_next(el)) {
+			if (!type || el->type == type) {
+				return el;
+			}
+
+			if (!el->type && !untyped) {
+				untyped = el;
+			}
+		}
+
+		return untyped;
+	}
+
+	/* replaced in id_arr_grow() */
+	by_id = __atomic_load_n(&map->by_id, __ATOMIC_ACQUIRE);
+	key = id_key(id, type);
+	if (type == 0) {
+		/* the lowest type, same as in the array */
+		el_p = pw_avl_get_first(by_id, key, key | IDMAP_TYPE_MASK);
+	} else {
+		el_p = pw_avl_get(by_id, key);
+		if (!el_p) {
+			el_p = pw_avl_get(by_id, key & ~(uint64_t)IDMAP_TYPE_MASK);
+		}
+	}
+
+	return el_p ? *el_p : NULL;
+}
+
+static void
+id_arr_link(struct pw_idmap *map, struct pw_idmap_el *el)
+{
+	struct pw_idmap_el **tail = &map->id_arr[el->id];
+
+	/* sorted by type like the tree, so type 0 lookups get the lowest one.
+	 * Same types keep the insertion order, like the same-key chains */
+	while (*tail && (*tail)->type <= el->type) {
+		tail = id_next(*tail);
+	}
+
+	*id_next(el) = *tail;
+	*tail = el;
+}
+
+/*
+ * Build a new by_id tree out of `count` elements starting at the cursor,
+ * in linear time. \return NULL on allocation failure.
+ */
+static struct pw_avl *
+by_id_rebuild(struct pw_avl_cursor *cur, size_t count)
+{
+	struct pw_idmap_el **el_p, **new_p;
+	struct pw_avl *by_id;
+	uint64_t *keys;
+	void **data;
+	size_t i = 0;
+
+	by_id = pw_avl_init_pooled(sizeof(struct pw_idmap_el *), IDMAP_POOL_CHUNK_SIZE);
+	keys = malloc((count + 1) * sizeof(*keys));
+	data = malloc((count + 1) * sizeof(*data));
+	if (!by_id || !keys || !data) {
+		goto err;
+	}
+
+	for (el_p = cur->cur ? (void *)cur->cur->data : NULL; el_p; el_p = pw_avl_cursor_next(cur)) {
+		new_p = pw_avl_alloc(by_id);
+		if (!new_p) {
+			goto err;
+		}
+
+		*new_p = *el_p;
+		keys[i] = pw_avl_cursor_key(cur);
+		data[i] = new_p;
+		i++;
+	}
+	assert(i == count);
+
+	if (pw_avl_build_sorted(by_id, keys, data, count) != 0) {
+		goto err;
+	}
+
+	free(keys);
+	free(data);
+	return by_id;
+err:
+	/* the nodes aren't in the tree yet, but they're all freed with it */
+	pw_avl_deinit(by_id);
+	free(keys);
+	free(data);
+	return NULL;
+}
+
+/*
+ * Grow the id array to cover `id`, if it would be dense enough then.
+ * Any elements in the tree that fall into the new range are moved over.
+ */
+static bool
+id_arr_grow(struct pw_idmap *map, long id)
+{
+	struct pw_avl_cursor cur;
+	struct pw_idmap_el **el_p, **arr;
+	struct pw_avl *by_id;
+	size_t cap = map->id_arr_cap ? map->id_arr_cap : 64;
+	size_t moved_cnt = 0;
+
+	while (cap <= id) {
+		cap *= 2;
+	}
+
+	if (cap > (map->id_el_cnt + 1) * IDMAP_ID_ARR_DENSITY) {
+		return false;
+	}
+
+	if (!map->concurrent) {
+		arr = realloc(map->id_arr, cap * sizeof(*arr));
+		if (!arr) {
+			return false;
+		}
+	} else {
+		/* readers may still use the old array, it's freed in write_end() */
+		assert(map->id_arr_old_cnt < IDMAP_OLD_MAX);
+		arr = malloc(cap * sizeof(*arr));
+		if (!arr) {
+			return false;
+		}
+
+		if (map->id_arr) {
+			memcpy(arr, map->id_arr, map->id_arr_cap * sizeof(*arr));
+		}
+		map->id_arr_old[map->id_arr_old_cnt++] = map->id_arr;
+	}
+
+	memset(arr + map->id_arr_cap, 0, (cap - map->id_arr_cap) * sizeof(*arr));
+	__atomic_store_n(&map->id_arr, arr, __ATOMIC_RELEASE);
+	__atomic_store_n(&map->id_arr_cap, cap, __ATOMIC_RELEASE);
+
+	/* the tree is sorted by id, so those are all at the front */
+	for (el_p = pw_avl_cursor_first(map->by_id, &cur); el_p && (*el_p)->id < cap;
+			el_p = pw_avl_cursor_next(&cur)) {
+		id_arr_link(map, *el_p);
+		moved_cnt++;
+	}
+
+	if (moved_cnt == 0) {
+		return true;
+	}
+
+	by_id = by_id_rebuild(&cur, map->by_id->el_count - moved_cnt);
+	if (!by_id) {
+		/* slower, but needs no memory */
+		while (moved_cnt--) {
+			el_p = pw_avl_cursor_first(map->by_id, &cur);
+			pw_avl_remove(map->by_id, el_p);
+			pw_avl_free(map->by_id, el_p);
+		}
+		return true;
+	}
+
+	if (map->concurrent) {
+		/* readers may still walk the old tree, it's freed in write_end() */
+		assert(map->by_id_old_cnt < IDMAP_OLD_MAX);
+		map->by_id_old[map->by_id_old_cnt++] = map->by_id;
+	} else {
+		pw_avl_deinit(map->by_id);
+	}
+	__atomic_store_n(&map->by_id, by_id, __ATOMIC_RELEASE);
+	return true;
+}
+
+static int
+id_index_add(struct pw_idmap *map, struct pw_idmap_el *el)
+{
+	struct pw_idmap_el **el_p;
+
+	if (el->id >= 0 && (el->id < map->id_arr_cap || id_arr_grow(map, el->id))) {
+		id_arr_link(map, el);
+		map->id_el_cnt++;
+		return 0;
+	}
+
+	el_p = pw_avl_alloc(map->by_id);
+	if (!el_p) {
+		return -ENOMEM;
+	}
+
+	*el_p = el;
+	pw_avl_insert(map->by_id, id_key(el->id, el->type), el_p);
+	map->id_el_cnt++;
+	return 0;
+}
+
+struct pw_idmap_el *
+_idmap_get(struct pw_idmap *map, long long lid, long type, bool async)
+{
+	struct pw_idmap_el *el;
+
+	el = get_by_lid(map, lid, type, async);
+	if (el || lid >= 0x80000000) {
+		return el;
+	}
+
+	return get_by_id(map, lid, type);
+}
+
+int
+pw_idmap_enable_concurrency(struct pw_idmap *map)
+{
+	if (map->concurrent) {
+		return 0;
+	}
+
+	map->rcu = pw_rcu_init();
+	if (!map->rcu) {
+		return -ENOMEM;
+	}
+
+#ifdef _WIN32
+	InitializeCriticalSection(&map->write_lock);
+#else
+	pthread_mutex_init(&map->write_lock, NULL);
+#endif
+	map->concurrent = true;
+	return 0;
+}
+
+static void
+write_lock(struct pw_idmap *map)
+{
+	if (!map->concurrent) {
+		return;
+	}
+
+#ifdef _WIN32
+	EnterCriticalSection(&map->write_lock);
+#else
+	pthread_mutex_lock(&map->write_lock);
+#endif
+}
+
+static void
+write_unlock(struct pw_idmap *map)
+{
+	if (!map->concurrent) {
+		return;
+	}
+
+#ifdef _WIN32
+	LeaveCriticalSection(&map->write_lock);
+#else
+	pthread_mutex_unlock(&map->write_lock);
+#endif
+}
+
+/* lock, and make the optimistic readers retry until write_end() */
+static void
+write_begin(struct pw_idmap *map)
+{
+	if (!map->concurrent) {
+		return;
+	}
+
+	write_lock(map);
+	__atomic_store_n(&map->seq, map->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void
+write_end(struct pw_idmap *map)
+{
+	if (!map->concurrent) {
+		return;
+	}
+
+	__atomic_store_n(&map->seq, map->seq + 1, __ATOMIC_RELEASE);
+
+	/* one grace period for everything replaced during the write */
+	if (map->id_arr_old_cnt || map->by_id_old_cnt) {
+		pw_rcu_synchronize(map->rcu);
+		while (map->id_arr_old_cnt) {
+			free(map->id_arr_old[--map->id_arr_old_cnt]);
+		}
+		while (map->by_id_old_cnt) {
+			pw_avl_deinit(map->by_id_old[--map->by_id_old_cnt]);
+		}
+	}
+
+	write_unlock(map);
+}
+
+static void *
+lookup_el(struct pw_idmap *map, long long lid, long type)
+{
+	return _idmap_get(map, lid, type, false);
+}
+
+static void *
+lookup_mapping(struct pw_idmap *map, long long lid, long type)
+{
+	return get_lid_mapping(map, lid);
+}
+
+/* give the writer some time to finish before the next optimistic read */
+static void
+read_backoff(unsigned tries)
+{
+	unsigned i;
+
+	if (tries <= IDMAP_READ_SPINS) {
+		for (i = 0; i < 1u << tries; i++) {
+#if defined(__i386__) || defined(__x86_64__)
+			__builtin_ia32_pause();
+#endif
+		}
+		return;
+	}
+
+#ifdef _WIN32
+	SwitchToThread();
+#else
+	sched_yield();
+#endif
+}
+
+/*
+ * Run the lookup without any lock, and retry if a writer was active in the
+ * meantime. The lookup may see the indices half-modified: everything it can
+ * reach stays allocated (pooled tree nodes are never given back, old id
+ * arrays are kept until the RCU grace period ends), but a rotation briefly
+ * links two tree nodes to each other. The tree lookups cap their descent
+ * and return NULL then, and the sequence check discards that like any other
+ * result seen during a write. No cursors here, they'd need the whole path.
+ * After a few failed attempts fall back to the writer lock, so a busy writer
+ * can't starve the reader.
+ */
+static void *
+concurrent_read(struct pw_idmap *map, void *(*lookup)(struct pw_idmap *, long long, long),
+		long long lid, long type)
+{
+	unsigned tries;
+	uint32_t seq;
+	void *ret;
+	int idx;
+
+	if (!map->concurrent) {
+		return lookup(map, lid, type);
+	}
+
+	idx = pw_rcu_read_lock(map->rcu);
+	for (tries = 0; tries < IDMAP_READ_RETRIES; tries++) {
+		if (tries > 0) {
+			read_backoff(tries);
+		}
+
+		seq = __atomic_load_n(&map->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			continue;
+		}
+
+		ret = lookup(map, lid, type);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&map->seq, __ATOMIC_RELAXED) == seq) {
+			pw_rcu_read_unlock(map->rcu, idx);
+			return ret;
+		}
+	}
+	/* the writer may be waiting for this read section to finish */
+	pw_rcu_read_unlock(map->rcu, idx);
+
+	write_lock(map);
+	ret = lookup(map, lid, type);
+	write_unlock(map);
+	return ret;
+}
+
+unsigned
+pw_idmap_get_mapping(struct pw_idmap *map, long long lid, long type)
+{
+	struct pw_idmap_file_entry *entry;
+
+	entry = concurrent_read(map, lookup_mapping, lid, type);
+	if (entry) {
+		return entry->id;
+	}
+
+	return 0;
+}
+
+struct pw_idmap_el *
+pw_idmap_get(struct pw_idmap *map, long long lid, long type)
+{
+	return concurrent_read(map, lookup_el, lid, type);
+}
+
+/* get a callback or head slot from the per-map free list, refilled in chunks */
+static void *
+async_alloc(struct pw_idmap *map)
+{
+	union pw_idmap_async_slot *slot;
+
+	if (!map->async_free) {
+		void **chunk;
+		size_t i;
+
+		/* first pointer links the chunks, the slots follow */
+		chunk = malloc(sizeof(union pw_idmap_async_slot) * (IDMAP_ASYNC_CHUNK_SIZE + 1));
+		if (!chunk) {
+			return NULL;
+		}
+
+		*chunk = map->async_chunks;
+		map->async_chunks = chunk;
+
+		slot = (union pw_idmap_async_slot *)chunk + 1;
+		for (i = 0; i < IDMAP_ASYNC_CHUNK_SIZE - 1; i++) {
+			slot[i].next_free = &slot[i + 1];
+		}
+		slot[i].next_free = NULL;
+		map->async_free = slot;
+	}
+
+	slot = map->async_free;
+	map->async_free = slot->next_free;
+	memset(slot, 0, sizeof(*slot));
+	return slot;
+}
+
+static void
+async_free(struct pw_idmap *map, void *ptr)
+{
+	union pw_idmap_async_slot *slot = ptr;
+
+	slot->next_free = map->async_free;
+	map->async_free = slot;
+}
+
+static struct pw_idmap_el *idmap_set(struct pw_idmap *map, long long lid, long type, void *data);
+
+/* retrieve the item even if it's not set yet. The callback will be fired
+ * once pw_idmap_set() hits */
+int
+pw_idmap_get_async(struct pw_idmap *map, long long lid, long type, pw_idmap_async_fn fn, void *fn_ctx)
+{
+	struct pw_idmap_el *el;
+	struct pw_idmap_async_fn_el *async_el;
+	struct pw_idmap_async_fn_head *async_head;
+
+	write_begin(map);
+	el = get_by_lid(map, lid, type, true);
+	if (el && !el->is_async_fn) {
+		write_end(map);
+		fn(el, fn_ctx);
+		return 0;
+	}
+
+	//pw_log("setting async mapping at lid=0x%llx\n", lid);
+
+	async_el = async_alloc(map);
+	if (!async_el) {
+		write_end(map);
+		return -1;
+	}
+	async_el->fn = fn;
+	async_el->ctx = fn_ctx;
+
+	if (!el) {
+		el = idmap_set(map, lid, type, NULL);
+		if (!el) {
+			async_free(map, async_el);
+			write_end(map);
+			return -1;
+		}
+		el->is_async_fn = 1;
+	}
+
+	async_head = el->data;
+	if (!async_head) {
+		async_head = async_alloc(map);
+		if (!async_head) {
+			async_free(map, async_el);
+			write_end(map);
+			return -1;
+		}
+
+		async_head->tail = &async_head->head;
+		el->data = async_head;
+	}
+
+	/* put it to the end to ensure the call order. everything queued first will
+	 * be called first. */
+	*async_head->tail = async_el;
+	async_head->tail = &async_el->next;
+
+	write_end(map);
+	return 0;
+}
+
+/* call and release all callbacks of the head, and the head itself */
+static void
+call_async_arr(struct pw_idmap *map, struct pw_idmap_async_fn_head *async, struct pw_idmap_el *node)
+{
+	struct pw_idmap_async_fn_el *async_el, *tmp;
+
+	async_el = async->head;
+	async_free(map, async);
+
+	while (async_el) {
+		async_el->fn(node, async_el->ctx);
+		tmp = async_el;
+		async_el = async_el->next;
+		async_free(map, tmp);
+	}
+}
+
+void
+pw_idmap_defer_async(struct pw_idmap *map, bool defer)
+{
+	write_lock(map);
+	map->defer_async = defer;
+	write_unlock(map);
+}
+
+size_t
+pw_idmap_drain_async(struct pw_idmap *map)
+{
+	struct pw_idmap_async_fn_head *list, *async, *next;
+	struct pw_idmap_async_fn_el *async_el, *tmp;
+	size_t cnt = 0;
+
+	/* the callbacks may set more elements, those are appended to the
+	 * list and drained in this same loop */
+	while (true) {
+		write_lock(map);
+		list = map->deferred;
+		map->deferred = NULL;
+		map->deferred_tail = &map->deferred;
+		write_unlock(map);
+
+		if (!list) {
+			break;
+		}
+
+		/* call without the lock, the callbacks may use the map */
+		for (async = list; async; async = async->next) {
+			for (async_el = async->head; async_el; async_el = async_el->next) {
+				async_el->fn(async->el, async_el->ctx);
+			}
+			cnt++;
+		}
+
+		write_lock(map);
+		for (async = list; async; async = next) {
+			next = async->next;
+			async_el = async->head;
+			while (async_el) {
+				tmp = async_el;
+				async_el = async_el->next;
+				async_free(map, tmp);
+			}
+			async_free(map, async);
+		}
+		write_unlock(map);
+	}
+
+	return cnt;
+}
+
+/* point by_lid_low at `el` if it has the lowest type of its lid so far */
+static int
+lowest_update(struct pw_idmap *map, long long lid, struct pw_idmap_el *el)
+{
+	struct pw_idmap_el **low_p;
+
+	low_p = pw_avl_get(map->by_lid_low, lid);
+	if (low_p) {
+		/* the same type keeps the first one, like the same-key chains */
+		if (el->type < (*low_p)->type) {
+			__atomic_store_n(low_p, el, __ATOMIC_RELEASE);
+		}
+		return 0;
+	}
+
+	low_p = pw_avl_alloc(map->by_lid_low);
+	if (!low_p) {
+		return -ENOMEM;
+	}
+
+	*low_p = el;
+	pw_avl_insert(map->by_lid_low, lid, low_p);
+	return 0;
+}
+
+/* set the element, `el` is the result of _idmap_get(map, lid, type, true) */
+static struct pw_idmap_el *
+set_el(struct pw_idmap *map, struct pw_idmap_el *el, long long lid, long type, void *data)
+{
+	uint64_t key;
+	bool typed;
+
+	if (el && !el->is_async_fn) {
+		if (map->ignore_dups) {
+			return NULL;
+		}
+
+		pw_log("Conflict at lid=0x%x, type=%d (el->type=%d, el->id=%d)\n", lid, type, el->type, el->id);
+		assert(false);
+		return NULL;
+	}
+
+	if (el) {
+		struct pw_idmap_async_fn_head *async_head = el->data;
+
+		el->is_async_fn = 0;
+		el->data = data;
+
+		/* with concurrency the callbacks can't be called under the
+		 * writer lock, so they're queued and drained afterwards */
+		if (map->defer_async || map->concurrent) {
+			async_head->el = el;
+			async_head->next = NULL;
+			*map->deferred_tail = async_head;
+			map->deferred_tail = &async_head->next;
+			return el;
+		}
+
+		call_async_arr(map, async_head, el);
+		return el;
+	}
+
+	if (lid < 0x80000000) {
+		struct pw_idmap_file_entry *entry;
+
+		entry = file_get_id(map, lid, type);
+		if (entry) {
+			lid = entry->lid;
+		}
+	}
+
+	typed = typed_key(lid, type, &key);
+	if (typed) {
+		el = pw_avl_alloc(map->by_lid);
+		if (!el) {
+			pw_log("pw_avl_alloc() failed\n");
+			return NULL;
+		}
+		pw_avl_insert(map->by_lid, key, el);
+	} else {
+		el = pw_avl_alloc(map->by_lid_wide);
+		if (!el) {
+			pw_log("pw_avl_alloc() failed\n");
+			return NULL;
+		}
+		pw_avl_insert(map->by_lid_wide, lid, el);
+	}
+
+	el->lid = lid;
+	el->type = type;
+	el->data = data;
+
+	if (typed && lowest_update(map, lid, el) != 0) {
+		pw_log("lowest_update() failed\n");
+		return NULL;
+	}
+
+	if (lid < 0x80000000) {
+		el->id = lid;
+	} else {
+		struct pw_idmap_file_entry *entry;
+
+		entry = get_lid_mapping(map, lid);
+		if (entry) {
+			el->id = entry->id;
+		} else {
+
+			if (!map->can_set) {
+				pw_log("Unexpected lid=0x%x\n", lid);
+				assert(false);
+				return NULL;
+			}
+
+			el->id = map->max_id + 1;
+
+			entry = pw_avl_alloc(map->lid_mappings);
+			assert(entry);
+			entry->lid = el->lid;
+			entry->id = el->id;
+			entry->type = el->type;
+
+			pw_avl_insert(map->lid_mappings, lid, entry);
+
+			if (map->unsaved_cnt == map->unsaved_cap) {
+				size_t cap = map->unsaved_cap ? map->unsaved_cap * 2 : 64;
+				void *tmp = realloc(map->unsaved, cap * sizeof(*map->unsaved));
+
+				if (tmp) {
+					map->unsaved = tmp;
+					map->unsaved_cap = cap;
+				}
+			}
+
+			if (map->unsaved_cnt < map->unsaved_cap) {
+				map->unsaved[map->unsaved_cnt++] = entry;
+			} else {
+				/* it can't be journaled now, make the next save a full one.
+				 * That writes all of lid_mappings, this one included */
+				map->journal_torn = true;
+			}
+		}
+	}
+
+	if (el->id > map->max_id) {
+		assert(el->id <= 0x80000000);
+		map->max_id = el->id;
+	}
+
+	if (id_index_add(map, el) != 0) {
+		pw_log("id_index_add() failed\n");
+		return NULL;
+	}
+
+	return el;
+}
+
+static struct pw_idmap_el *
+idmap_set(struct pw_idmap *map, long long lid, long type, void *data)
+{
+	return set_el(map, _idmap_get(map, lid, type, true), lid, type, data);
+}
+
+/* fire the callbacks that set_el() queued because of the concurrency */
+static void
+drain_concurrent(struct pw_idmap *map)
+{
+	if (map->concurrent && !map->defer_async) {
+		pw_idmap_drain_async(map);
+	}
+}
+
+struct pw_idmap_el *
+pw_idmap_set(struct pw_idmap *map, long long lid, long type, void *data)
+{
+	struct pw_idmap_el *el;
+
+	write_begin(map);
+	el = idmap_set(map, lid, type, data);
+	write_end(map);
+
+	drain_concurrent(map);
+	return el;
+}
+
+struct batch_key {
+	uint64_t key;
+	size_t idx;
+};
+
+/*
+ * LSD radix sort by key, a few times faster than qsort() for big batches.
+ * It's stable, so requests with equal keys keep the batch order. Bytes
+ * that are the same in all keys (most of the high ones) are skipped.
+ */
+static void
+radix_sort(struct batch_key *keys, struct batch_key *tmp, size_t count)
+{
+	uint64_t all_or = 0, all_and = UINT64_MAX;
+	size_t i, shift;
+
+	for (i = 0; i < count; i++) {
+		all_or |= keys[i].key;
+		all_and &= keys[i].key;
+	}
+
+	for (shift = 0; shift < 64; shift += 8) {
+		size_t offs[256] = {}, sum = 0;
+
+		if ((((all_or ^ all_and) >> shift) & 0xff) == 0) {
+			continue;
+		}
+
+		for (i = 0; i < count; i++) {
+			offs[(keys[i].key >> shift) & 0xff]++;
+		}
+
+		for (i = 0; i < 256; i++) {
+			size_t cnt = offs[i];
+
+			offs[i] = sum;
+			sum += cnt;
+		}
+
+		for (i = 0; i < count; i++) {
+			tmp[offs[(keys[i].key >> shift) & 0xff]++] = keys[i];
+		}
+
+		memcpy(keys, tmp, count * sizeof(*keys));
+	}
+}
+
+/*
+ * Resolve the by_lid part of the lookups in one forward pass over the tree.
+ * The cursor only moves forward, and for nearby keys a few steps are
+ * cheaper than a new descent from the root.
+ */
+static void
+merge_get(struct pw_idmap *map, struct batch_key *keys, size_t count,
+		struct pw_idmap_req *reqs)
+{
+	struct pw_avl_cursor cur, lid_start;
+	struct pw_idmap_el *el = NULL;
+	uint64_t lid_lo = UINT64_MAX;
+	size_t i, steps;
+
+	for (i = 0; i < count; i++) {
+		struct pw_idmap_req *req = &reqs[keys[i].idx];
+		uint64_t lo = keys[i].key & ~(uint64_t)IDMAP_TYPE_MASK;
+		struct pw_idmap_el *untyped = NULL;
+
+		if (lo != lid_lo) {
+			/* next lid, move forward */
+			steps = 0;
+			while (el && pw_avl_cursor_key(&cur) < lo && steps++ < 16) {
+				el = pw_avl_cursor_next(&cur);
+			}
+
+			if (!el || pw_avl_cursor_key(&cur) < lo) {
+				el = pw_avl_cursor_lower_bound(map->by_lid, &cur, lo);
+			}
+
+			lid_lo = lo;
+			lid_start = cur;
+		} else {
+			/* same lid as before, scan its range again */
+			cur = lid_start;
+			el = cur.cur ? (void *)cur.cur->data : NULL;
+		}
+
+		req->el = NULL;
+		while (el && (pw_avl_cursor_key(&cur) | IDMAP_TYPE_MASK) == (lo | IDMAP_TYPE_MASK)) {
+			long el_type = pw_avl_cursor_key(&cur) & IDMAP_TYPE_MASK;
+
+			if (type_matches(el, req->type, false)) {
+				if (!req->type || el_type == req->type) {
+					req->el = el;
+					break;
+				}
+
+				if (el_type == 0 && !untyped) {
+					untyped = el;
+				}
+			}
+			el = pw_avl_cursor_next(&cur);
+		}
+
+		if (!req->el) {
+			req->el = untyped;
+		}
+	}
+}
+
+/* sort the batch by (lid, type), and handle the requests that can't be merged */
+static struct batch_key *
+sort_batch(struct pw_idmap_req *reqs, size_t count, size_t *sorted_cnt)
+{
+	struct batch_key *keys;
+	size_t i, n = 0;
+
+	/* the second half is scratch space for the sort */
+	keys = malloc((2 * count + 1) * sizeof(*keys));
+	if (!keys) {
+		return NULL;
+	}
+
+	for (i = 0; i < count; i++) {
+		uint64_t key;
+
+		if (reqs[i].lid >= 0x80000000 && typed_key(reqs[i].lid, reqs[i].type, &key)) {
+			keys[n].key = key;
+			keys[n].idx = i;
+			n++;
+		}
+	}
+
+	radix_sort(keys, keys + count, n);
+	*sorted_cnt = n;
+	return keys;
+}
+
+static size_t
+get_many(struct pw_idmap *map, struct pw_idmap_req *reqs, size_t count)
+{
+	struct batch_key *keys;
+	size_t i, sorted_cnt, found = 0;
+
+	keys = sort_batch(reqs, count, &sorted_cnt);
+	if (!keys) {
+		/* still correct, just slower */
+		sorted_cnt = 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		reqs[i].el = NULL;
+	}
+	merge_get(map, keys, sorted_cnt, reqs);
+
+	for (i = 0; i < count; i++) {
+		struct pw_idmap_req *req = &reqs[i];
+		uint64_t key;
+
+		if (!req->el && (req->lid < 0x80000000 || !typed_key(req->lid, req->type, &key))) {
+			req->el = _idmap_get(map, req->lid, req->type, false);
+		}
+
+		found += req->el != NULL;
+	}
+
+	free(keys);
+	return found;
+}
+
+size_t
+pw_idmap_get_many(struct pw_idmap *map, struct pw_idmap_req *reqs, size_t count)
+{
+	size_t found;
+
+	/* too long for an optimistic read, it would keep retrying */
+	write_lock(map);
+	found = get_many(map, reqs, count);
+	write_unlock(map);
+	return found;
+}
+
+/*
+ * No merged lookups here: the inserts dominate, and requests that end up
+ * at the same lid (or an id the file maps to it) have to see each other.
+ */
+static size_t
+set_many(struct pw_idmap *map, struct pw_idmap_req *reqs, size_t count)
+{
+	bool defer = map->defer_async;
+	size_t i, set = 0;
+
+	/* the callbacks may use the map, let them see the whole batch */
+	map->defer_async = true;
+	for (i = 0; i < count; i++) {
+		struct pw_idmap_req *req = &reqs[i];
+
+		req->el = idmap_set(map, req->lid, req->type, req->data);
+		set += req->el != NULL;
+	}
+	map->defer_async = defer;
+
+	return set;
+}
+
+size_t
+pw_idmap_set_many(struct pw_idmap *map, struct pw_idmap_req *reqs, size_t count)
+{
+	size_t set;
+
+	write_begin(map);
+	set = set_many(map, reqs, count);
+	write_end(map);
+
+	/* everything set_many() queued, unless the caller defers it as well */
+	if (!map->defer_async) {
+		pw_idmap_drain_async(map);
+	}
+	return set;
+}
+
+static int
+replace_file(const char *tmp_path, const char *path)
+{
+#ifdef _WIN32
+	if (!MoveFileExA(tmp_path, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+		return -EIO;
+	}
+#else
+	if (rename(tmp_path, path) != 0) {
+		return -errno;
+	}
+#endif
+	return 0;
+}
+
+/* make sure the data reaches the disk before a rename makes it visible */
+static int
+sync_file(FILE *fp)
+{
+	if (fflush(fp) != 0) {
+		return -EIO;
+	}
+
+#ifdef _WIN32
+	if (_commit(_fileno(fp)) != 0) {
+		return -EIO;
+	}
+#else
+	if (fsync(fileno(fp)) != 0) {
+		return -errno;
+	}
+#endif
+	return 0;
+}
+
+/* write all mappings into a new base file, then atomically replace the old one */
+static int
+save_base(struct pw_idmap *map, const char *filename)
+{
+	struct pw_idmap_file_entry *entry, *file_entry, *file_end, *entries;
+	struct pw_idmap_file_hdr hdr = {};
+	struct pw_avl_cursor cur;
+	size_t count = 0;
+	uint32_t *id_idx;
+	char tmp_path[512];
+	FILE *fp;
+	int rc = 0;
+
+	entries = malloc((map->file_entry_cnt + map->lid_mappings->el_count + 1) * sizeof(*entries));
+	id_idx = malloc((map->file_entry_cnt + map->lid_mappings->el_count + 1) * sizeof(*id_idx));
+	if (!entries || !id_idx) {
+		free(entries);
+		free(id_idx);
+		return -ENOMEM;
+	}
+
+	/* merge the loaded entries with the runtime ones, so the file
+	 * stays sorted by lid and can be used as is on the next load */
+	file_entry = map->file_entries;
+	file_end = map->file_entries + map->file_entry_cnt;
+	entry = pw_avl_cursor_first(map->lid_mappings, &cur);
+	while (entry || file_entry != file_end) {
+		if (!entry || (file_entry != file_end && file_entry->lid <= entry->lid)) {
+			entries[count] = *file_entry++;
+		} else {
+			entries[count] = *entry;
+			entry = pw_avl_cursor_next(&cur);
+		}
+		memset(entries[count]._reserved, 0, sizeof(entries[count]._reserved));
+		count++;
+	}
+
+	rc = build_id_index(entries, id_idx, count);
+	if (rc != 0) {
+		goto out;
+	}
+
+	hdr.version = PW_IDMAP_VERSION;
+	hdr.entry_size = sizeof(*entries);
+	hdr.count = count;
+	hdr.crc = pw_crc32(0, entries, count * sizeof(*entries));
+	hdr.crc = pw_crc32(hdr.crc, id_idx, count * sizeof(*id_idx));
+	hdr.base_id = pw_idmap_new_base_id(count);
+
+	/* never leave a half-written base file behind */
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", filename);
+	fp = fopen(tmp_path, "wb");
+	if (fp == NULL) {
+		pw_log("Cant open %s\n", tmp_path);
+		rc = -errno;
+		goto out;
+	}
+
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+			fwrite(entries, sizeof(*entries), count, fp) != count ||
+			fwrite(id_idx, sizeof(*id_idx), count, fp) != count) {
+		pw_log("Failed to write %s\n", tmp_path);
+		rc = -EIO;
+	}
+
+	/* or a power loss could leave an empty file after the rename */
+	if (rc == 0) {
+		rc = sync_file(fp);
+	}
+
+	if (fclose(fp) != 0 && rc == 0) {
+		rc = -EIO;
+	}
+
+	if (rc == 0) {
+		rc = replace_file(tmp_path, filename);
+	}
+
+	if (rc != 0) {
+		remove(tmp_path);
+	} else {
+		map->base_id = hdr.base_id;
+	}
+out:
+	free(entries);
+	free(id_idx);
+	return rc;
+}
+
+static int
+append_journal(struct pw_idmap *map, const char *filename)
+{
+	struct pw_idmap_journal_hdr jhdr = {};
+	struct pw_idmap_journal_rec rec = {};
+	char path[512];
+	size_t i;
+	FILE *fp;
+	int rc = 0;
+
+	journal_path(path, sizeof(path), filename);
+	fp = fopen(path, "ab");
+	if (!fp) {
+		pw_log("Cant open %s\n", path);
+		return -errno;
+	}
+
+	if (fseek(fp, 0, SEEK_END) != 0) {
+		rc = -EIO;
+	} else if (ftell(fp) == 0) {
+		jhdr.magic = PW_IDMAP_JOURNAL_HDR_MAGIC;
+		jhdr.base_id = map->base_id;
+		if (fwrite(&jhdr, sizeof(jhdr), 1, fp) != 1) {
+			rc = -EIO;
+		}
+	}
+
+	for (i = 0; i < map->unsaved_cnt && rc == 0; i++) {
+		struct pw_idmap_file_entry *entry = map->unsaved[i];
+
+		rec.magic = PW_IDMAP_JOURNAL_MAGIC;
+		rec.id = entry->id;
+		rec.lid = entry->lid;
+		rec.type = entry->type;
+		rec.crc = journal_rec_crc(&rec);
+		if (fwrite(&rec, sizeof(rec), 1, fp) != 1) {
+			rc = -EIO;
+			break;
+		}
+	}
+
+	if (fclose(fp) != 0 && rc == 0) {
+		rc = -EIO;
+	}
+
+	if (rc != 0) {
+		/* we don't know how much got written, start over */
+		map->journal_torn = true;
+		return rc;
+	}
+
+	map->journal_cnt += map->unsaved_cnt;
+	return 0;
+}
+
+static int
+save(struct pw_idmap *map, const char *filename)
+{
+	size_t compact_at;
+	char path[512];
+	int rc;
+
+	assert(map->can_set);
+
+	compact_at = map->file_entry_cnt / IDMAP_JOURNAL_COMPACT_RATIO;
+	if (compact_at < IDMAP_JOURNAL_COMPACT_MIN) {
+		compact_at = IDMAP_JOURNAL_COMPACT_MIN;
+	}
+
+	/* a journal needs a v4 base file to point to */
+	if (map->use_journal && !map->journal_torn && map->base_id != 0 &&
+			map->journal_cnt + map->unsaved_cnt <= compact_at) {
+		if (map->unsaved_cnt == 0) {
+			return 0;
+		}
+
+		rc = append_journal(map, filename);
+		if (rc == 0) {
+			map->unsaved_cnt = 0;
+			return 0;
+		}
+		/* fallback to a full save */
+	}
+
+	rc = save_base(map, filename);
+	if (rc != 0) {
+		return rc;
+	}
+
+	/* the journal is folded into the base now. If we crash before removing
+	 * it, the replay will just skip the records that are already there */
+	journal_path(path, sizeof(path), filename);
+	remove(path);
+	map->journal_cnt = 0;
+	map->journal_torn = false;
+	map->unsaved_cnt = 0;
 	return 0;
 }
 
+int
+pw_idmap_save(struct pw_idmap *map, const char *filename)
+{
+	int rc;
+
+	/* readers don't look at anything the save modifies */
+	write_lock(map);
+	rc = save(map, filename);
+	write_unlock(map);
+	return rc;
+}
+
+#ifdef PW_IDMAP_TEST
+#include <time.h>
+
+static double
+elapsed_ms(clock_t start)
+{
+	return (double)(clock() - start) * 1000 / CLOCKS_PER_SEC;
+}
+
+static uint64_t
+test_lid(size_t i)
+{
+	/* sparse, like real lids */
+	return 0x80000000ULL + i * 37 + (i % 5);
+}
+
+/* an in-memory map with the given number of types registered */
+static struct pw_idmap *
+test_map(const char *name, size_t types)
+{
+	struct pw_idmap *map = pw_idmap_init(name, NULL, true);
+	size_t i;
+
+	assert(map);
+	for (i = 0; i < types; i++) {
+		pw_idmap_register_type(map);
+	}
+	return map;
+}
+
+/* what pw_idmap_init() used to do: one fread and two tree inserts per entry */
+static double
+bench_tree_load(const char *path, size_t count)
+{
+	struct pw_avl *lids = pw_avl_init_pooled(sizeof(struct pw_idmap_file_entry), IDMAP_POOL_CHUNK_SIZE);
+	struct pw_avl *ids = pw_avl_init_pooled(sizeof(struct pw_idmap_file_entry *), IDMAP_POOL_CHUNK_SIZE);
+	uint32_t version;
+	clock_t start = clock();
+	FILE *fp = fopen(path, "rb");
+	size_t i;
+
+	fread(&version, 1, sizeof(version), fp);
+	for (i = 0; i < count; i++) {
+		struct pw_idmap_file_entry *entry = pw_avl_alloc(lids);
+		struct pw_idmap_file_entry **id_ref = pw_avl_alloc(ids);
+
+		fread(entry, 1, sizeof(*entry), fp);
+		*id_ref = entry;
+		pw_avl_insert(lids, entry->lid, entry);
+		pw_avl_insert(ids, entry->id, id_ref);
+	}
+	fclose(fp);
+
+	double ms = elapsed_ms(start);
+	pw_avl_deinit(lids);
+	pw_avl_deinit(ids);
+	return ms;
+}
+
+/* many types registered for the same lids, the case that used to be linear */
 static void
-call_async_arr(struct pw_idmap_async_fn_head *async, struct pw_idmap_el *node)
+bench_types(void)
 {
-	struct pw_idmap_async_fn_el *async_el, *tmp;
+	size_t i, lid_cnt = 20000, types = 16, lookups = 2000000, found = 0;
+	struct pw_idmap *map = test_map("types", types);
+	struct pw_avl *chains = pw_avl_init_pooled(sizeof(struct pw_idmap_el), IDMAP_POOL_CHUNK_SIZE);
+	double chain_ms, typed_ms, wildcard_ms;
+	clock_t start;
+
+	for (i = 0; i < lid_cnt * types; i++) {
+		long long lid = test_lid(i / types);
+		long type = 1 + i % types;
+		struct pw_idmap_el *el;
+
+		el = pw_idmap_set(map, lid, type, (void *)(uintptr_t)type);
+		assert(el);
+
+		/* the previous layout: one chain of all types per lid */
+		el = pw_avl_alloc(chains);
+		el->lid = lid;
+		el->type = type;
+		pw_avl_insert(chains, lid, el);
+	}
 
-	async_el = async->head;
-	while (async_el) {
-		async_el->fn(node, async_el->ctx);
-		tmp = async_el;
-		async_el = async_el->next;
-		free(tmp);
+	start = clock();
+	for (i = 0; i < lookups; i++) {
+		long long lid = test_lid((i * 7919) % lid_cnt);
+		long type = 1 + (i * 31) % types;
+		struct pw_idmap_el *el = pw_avl_get(chains, lid);
+
+		while (el && el->type != type) {
+			el = pw_avl_get_next(chains, el);
+		}
+		found += el != NULL;
+	}
+	chain_ms = elapsed_ms(start);
+
+	start = clock();
+	for (i = 0; i < lookups; i++) {
+		long long lid = test_lid((i * 7919) % lid_cnt);
+		long type = 1 + (i * 31) % types;
+		struct pw_idmap_el *el = pw_idmap_get(map, lid, type);
+
+		assert(el && el->lid == lid && el->data == (void *)(uintptr_t)type);
+		found++;
+	}
+	typed_ms = elapsed_ms(start);
+
+	start = clock();
+	for (i = 0; i < lookups; i++) {
+		found += pw_idmap_get(map, test_lid((i * 7919) % lid_cnt), 0) != NULL;
 	}
+	wildcard_ms = elapsed_ms(start);
+	assert(found == 3 * lookups);
+
+	/* ids resolve the same way, typed and untyped */
+	struct pw_idmap_el *el = pw_idmap_get(map, test_lid(5), 7);
+	assert(pw_idmap_get(map, el->id, 7) == el);
+	assert(pw_idmap_get(map, el->id, 0)->id == el->id);
+
+	fprintf(stderr, "%zu lids x %zu types: chain walk %.2f ms, typed get %.2f ms, type 0 get %.2f ms\n",
+			lid_cnt, types, chain_ms, typed_ms, wildcard_ms);
+	pw_avl_deinit(chains);
 }
 
-struct pw_idmap_el *
-pw_idmap_set(struct pw_idmap *map, long long lid, long type, void *data)
+static void
+test_type0_cb(struct pw_idmap_el *el, void *ctx)
 {
-	struct pw_idmap_el *el, *tmp;
+	*(bool *)ctx = true;
+}
 
-	el = _idmap_get(map, lid, type, true);
-	if (el && !el->is_async_fn) {
-		if (map->ignore_dups) {
-			return NULL;
+/* type 0 lookups return the lowest type, whatever the insertion order */
+static void
+test_type0(void)
+{
+	struct pw_idmap *map = pw_idmap_init("type0", NULL, true);
+	struct pw_idmap_el *el, *low;
+	long types[8], order[] = { 5, 2, 7, 1, 3, 6, 4 };
+	size_t i, j, lid_cnt = 2000;
+	bool called = false;
+	int rc;
+
+	for (i = 0; i < 8; i++) {
+		types[i] = pw_idmap_register_type(map);
+	}
+
+	/* plenty of neighbours, so the tree shape varies around each lid */
+	for (i = 0; i < lid_cnt; i++) {
+		for (j = 0; j < 7; j++) {
+			long type = types[order[(i + j) % 7]];
+
+			el = pw_idmap_set(map, test_lid(i), type, (void *)(uintptr_t)type);
+			assert(el);
 		}
+	}
 
-		pw_log("Conflict at lid=0x%x, type=%d (el->type=%d, el->id=%d)\n", lid, type, el->type, el->id);
-		assert(false);
-		return NULL;
+	for (i = 0; i < lid_cnt; i++) {
+		low = pw_idmap_get(map, test_lid(i), 0);
+		assert(low && low->type == types[1]);
+		assert(pw_idmap_get(map, low->id, 0) == low);
 	}
 
-	if (el) {
-		struct pw_idmap_async_fn_head *async_head = el->data;
+	/* the same for ids that live in the tree rather than the array */
+	for (j = 0; j < 7; j++) {
+		el = pw_idmap_set(map, 100 * lid_cnt, types[order[j]], NULL);
+		assert(el);
+	}
+	assert(map->by_id->el_count == 7);
+	low = pw_idmap_get(map, 100 * lid_cnt, 0);
+	assert(low && low->type == types[1]);
+
+	/* an async placeholder with the lowest type is skipped until it's set */
+	rc = pw_idmap_get_async(map, test_lid(lid_cnt), types[0], test_type0_cb, &called);
+	assert(rc == 0);
+	el = pw_idmap_set(map, test_lid(lid_cnt), types[2], NULL);
+	low = pw_idmap_get(map, test_lid(lid_cnt), 0);
+	assert(el && low == el);
+	el = pw_idmap_set(map, test_lid(lid_cnt), types[0], NULL);
+	low = pw_idmap_get(map, test_lid(lid_cnt), 0);
+	assert(el && called && low == el);
+}
 
-		el->is_async_fn = 0;
-		el->data = data;
+static void
+test_async_order_cb(struct pw_idmap_el *el, void *ctx)
+{
+	long *order = ctx;
 
-		call_async_arr(async_head, el);
-		free(async_head);
-		return el;
+	/* callbacks must come in the batch order, which is lid-descending here */
+	assert(*order == 0 || el->lid < *order);
+	*order = el->lid;
+}
+
+static void
+bench_batch(void)
+{
+	size_t i, count = 200000, types = 4;
+	struct pw_idmap *per_item = test_map("per_item", types);
+	struct pw_idmap *batch = test_map("batch", types);
+	struct pw_idmap *per_item_conc = test_map("per_item_conc", types);
+	struct pw_idmap *batch_conc = test_map("batch_conc", types);
+	struct pw_idmap_req *reqs;
+	struct pw_idmap_el *el;
+	double set_ms, set_many_ms, get_ms, get_many_ms, conc_set_ms, conc_set_many_ms;
+	long order = 0;
+	clock_t start;
+	size_t n;
+	int rc;
+
+	reqs = calloc(count, sizeof(*reqs));
+	assert(reqs);
+	for (i = 0; i < count; i++) {
+		/* shuffled, like a batch of freshly loaded records would be */
+		n = (i * 7919) % count;
+		reqs[i].lid = test_lid(n / types);
+		reqs[i].type = 1 + n % types;
+		reqs[i].data = (void *)(uintptr_t)n;
 	}
 
-	el = pw_avl_alloc(map->by_lid);
-	if (!el) {
-		pw_log("pw_avl_alloc() failed\n");
-		return NULL;
+	start = clock();
+	for (i = 0; i < count; i++) {
+		el = pw_idmap_set(per_item, reqs[i].lid, reqs[i].type, reqs[i].data);
+		assert(el);
+	}
+	set_ms = elapsed_ms(start);
+
+	start = clock();
+	n = pw_idmap_set_many(batch, reqs, count);
+	set_many_ms = elapsed_ms(start);
+	assert(n == count);
+
+	/* with concurrency each pw_idmap_set() is a whole write section */
+	rc = pw_idmap_enable_concurrency(per_item_conc);
+	assert(rc == 0);
+	rc = pw_idmap_enable_concurrency(batch_conc);
+	assert(rc == 0);
+
+	start = clock();
+	for (i = 0; i < count; i++) {
+		el = pw_idmap_set(per_item_conc, reqs[i].lid, reqs[i].type, reqs[i].data);
+		assert(el);
+	}
+	conc_set_ms = elapsed_ms(start);
+
+	start = clock();
+	n = pw_idmap_set_many(batch_conc, reqs, count);
+	conc_set_many_ms = elapsed_ms(start);
+	assert(n == count);
+
+	/* look up in a different order than inserted, the elements are pooled in
+	 * the insertion order and that would make the per-item lookups cache-hot */
+	for (i = 0; i < count; i++) {
+		n = (i * 104729) % count;
+		reqs[i].lid = test_lid(n / types);
+		reqs[i].type = 1 + n % types;
+		reqs[i].data = (void *)(uintptr_t)n;
 	}
 
-	if (lid < 0x80000000) {
-		struct pw_idmap_file_entry **entry_p;
-		struct pw_idmap_file_entry *entry;
+	start = clock();
+	for (i = 0; i < count; i++) {
+		el = pw_idmap_get(per_item, reqs[i].lid, reqs[i].type);
+		assert(el->data == reqs[i].data);
+	}
+	get_ms = elapsed_ms(start);
+
+	start = clock();
+	n = pw_idmap_get_many(batch, reqs, count);
+	get_many_ms = elapsed_ms(start);
+	assert(n == count);
+
+	for (i = 0; i < count; i++) {
+		assert(reqs[i].el->data == reqs[i].data && reqs[i].el->lid == reqs[i].lid);
+		el = pw_idmap_get(batch, reqs[i].el->id, reqs[i].type);
+		assert(el == reqs[i].el);
+	}
+
+	/* type 0 resolves like pw_idmap_get(), then a missing lid and an id */
+	reqs[0].lid = test_lid(1);
+	reqs[0].type = 0;
+	reqs[1].lid = test_lid(count);
+	reqs[1].type = 1;
+	reqs[2].lid = reqs[0].el->id;
+	reqs[2].type = 0;
+	n = pw_idmap_get_many(batch, reqs, 3);
+	assert(n == 2);
+	el = pw_idmap_get(batch, test_lid(1), 0);
+	assert(reqs[0].el == el && !reqs[1].el && reqs[2].el);
+
+	/* pending async callbacks fire after the batch, in its order */
+	for (i = 0; i < 100; i++) {
+		reqs[i].lid = test_lid(count + 100 - i);
+		reqs[i].type = 1;
+		reqs[i].data = NULL;
+		rc = pw_idmap_get_async(batch, reqs[i].lid, 1, test_async_order_cb, &order);
+		assert(rc == 0);
+	}
+	n = pw_idmap_set_many(batch, reqs, 100);
+	assert(n == 100);
+	assert(order == test_lid(count + 1));
+
+	fprintf(stderr, "%zu shuffled reqs: set %.2f ms, set_many %.2f ms, get %.2f ms, get_many %.2f ms\n",
+			count, set_ms, set_many_ms, get_ms, get_many_ms);
+	fprintf(stderr, "%zu shuffled reqs, concurrent: set %.2f ms (%.2f Msets/s), "
+			"set_many %.2f ms (%.2f Msets/s)\n", count, conc_set_ms, count / conc_set_ms / 1000,
+			conc_set_many_ms, count / conc_set_many_ms / 1000);
+	free(reqs);
+}
+
+struct test_batch_ctx {
+	struct pw_idmap *map;
+	bool called;
+};
+
+static void
+test_batch_cb(struct pw_idmap_el *el, void *ctx)
+{
+	struct test_batch_ctx *bctx = ctx;
+	struct pw_idmap_el *last;
+
+	/* fired once the whole batch is in */
+	last = pw_idmap_get(bctx->map, test_lid(3), 1);
+	assert(last);
+	bctx->called = true;
+}
+
+/* requests that end up at the same lid see each other, like with pw_idmap_set() */
+static void
+test_set_many_conflicts(const char *path)
+{
+	struct test_batch_ctx bctx = {};
+	struct pw_idmap_req reqs[6] = {};
+	uint32_t version = PW_IDMAP_VERSION_V3;
+	struct pw_idmap *map;
+	size_t i, n;
+	FILE *fp;
+	int rc;
+
+	/* id 1 + i is lid i */
+	fp = fopen(path, "wb");
+	assert(fp);
+	fwrite(&version, 1, sizeof(version), fp);
+	for (i = 0; i < 4; i++) {
+		struct pw_idmap_file_entry entry = {};
+
+		entry.lid = test_lid(i);
+		entry.id = 1 + i;
+		entry.type = 1;
+		fwrite(&entry, 1, sizeof(entry), fp);
+	}
+	fclose(fp);
+
+	map = pw_idmap_init("conflicts", path, true);
+	assert(map && map->file_entry_cnt == 4);
+	pw_idmap_register_type(map);
+	pw_idmap_ignore_dups(map);
+	bctx.map = map;
+
+	/* an id and its lid */
+	reqs[0].lid = 1;
+	reqs[0].type = 1;
+	reqs[1].lid = test_lid(0);
+	reqs[1].type = 1;
+	/* a lid with a type, then with type 0 */
+	reqs[2].lid = test_lid(1);
+	reqs[2].type = 1;
+	reqs[3].lid = test_lid(1);
+	reqs[3].type = 0;
+	/* a pending callback, and the last request it checks for */
+	reqs[4].lid = test_lid(2);
+	reqs[4].type = 1;
+	rc = pw_idmap_get_async(map, test_lid(2), 1, test_batch_cb, &bctx);
+	assert(rc == 0);
+	reqs[5].lid = test_lid(3);
+	reqs[5].type = 1;
+
+	n = pw_idmap_set_many(map, reqs, 6);
+	assert(n == 4 && bctx.called);
+	assert(reqs[0].el && reqs[0].el->lid == test_lid(0) && !reqs[1].el);
+	assert(reqs[2].el && !reqs[3].el);
+	assert(reqs[4].el && reqs[5].el);
+	assert(map->by_lid->el_count == 4);
+	remove(path);
+}
+
+static void
+test_async_count_cb(struct pw_idmap_el *el, void *ctx)
+{
+	size_t *cnt = ctx;
+
+	assert(el->data == (void *)(uintptr_t)el->lid);
+	(*cnt)++;
+}
+
+/* pw_idmap_set() from within a callback, while draining */
+static void
+test_async_nested_cb(struct pw_idmap_el *el, void *ctx)
+{
+	struct pw_idmap *map = ctx;
+	long long lid = test_lid((uintptr_t)el->data) + 0x10000000;
+
+	el = pw_idmap_set(map, lid, 0, (void *)(uintptr_t)lid);
+	assert(el);
+}
+
+static void
+bench_async(void)
+{
+	size_t i, j, count = 100000, waiters = 3, called, drained;
+	double immediate_ms = 0, deferred_ms = 0;
+	struct pw_idmap_el *el;
+	struct pw_idmap *map;
+	clock_t start;
+	int rc;
+
+	for (j = 0; j < 2; j++) {
+		bool defer = j == 1;
 
-		entry_p = pw_avl_get(map->id_mappings, lid);
-		entry = entry_p ? *entry_p : NULL;
+		map = pw_idmap_init(defer ? "async_deferred" : "async", NULL, true);
+		pw_idmap_defer_async(map, defer);
+		called = 0;
 
-		while (entry && (type && entry->type && entry->type != type)) {
-			entry_p = pw_avl_get_next(map->by_id, entry_p);
-			entry = entry_p ? *entry_p : NULL;
+		start = clock();
+		for (i = 0; i < count * waiters; i++) {
+			rc = pw_idmap_get_async(map, test_lid(i % count), 0, test_async_count_cb, &called);
+			assert(rc == 0);
 		}
+		for (i = 0; i < count; i++) {
+			el = pw_idmap_set(map, test_lid(i), 0, (void *)(uintptr_t)test_lid(i));
+			assert(el);
+		}
+		assert(called == (defer ? 0 : count * waiters));
+		drained = pw_idmap_drain_async(map);
+		assert(drained == (defer ? count : 0));
+		assert(called == count * waiters);
 
-		if (entry) {
-			el->id = entry->id;
-			lid = entry->lid;
+		if (defer) {
+			deferred_ms = elapsed_ms(start);
+		} else {
+			immediate_ms = elapsed_ms(start);
+		}
+
+		/* second round re-uses the freed callbacks */
+		for (i = 0; i < 10; i++) {
+			long long lid = test_lid(i) + 0x10000000;
+
+			rc = pw_idmap_get_async(map, test_lid(count + i), 0, test_async_nested_cb, map);
+			assert(rc == 0);
+			rc = pw_idmap_get_async(map, lid, 0, test_async_count_cb, &called);
+			assert(rc == 0);
 		}
+		for (i = 0; i < 10; i++) {
+			pw_idmap_set(map, test_lid(count + i), 0, (void *)(uintptr_t)i);
+		}
+		pw_idmap_drain_async(map);
+		assert(called == count * waiters + 10);
 	}
 
-	el->lid = lid;
-	el->type = type;
-	el->data = data;
-	pw_avl_insert(map->by_lid, lid, el);
+	fprintf(stderr, "%zu lids x %zu async waiters: immediate %.2f ms, deferred + drain %.2f ms\n",
+			count, waiters, immediate_ms, deferred_ms);
+}
 
-	if (lid < 0x80000000) {
-		el->id = lid;
-	} else {
-		struct pw_idmap_file_entry *entry;
+/* ids below 1 in IDMAP_ID_ARR_DENSITY density stay in the tree until the array catches up */
+static void
+test_id_density(bool concurrent)
+{
+	struct pw_idmap *map = pw_idmap_init("density", NULL, true);
+	struct pw_idmap_el *el, *near, *far, *far2;
+	size_t i, cap, count = 1000;
+	long t1, t2;
+	int rc;
+
+	if (concurrent) {
+		rc = pw_idmap_enable_concurrency(map);
+		assert(rc == 0);
+	}
+	t1 = pw_idmap_register_type(map);
+	t2 = pw_idmap_register_type(map);
 
-		entry = pw_avl_get(map->lid_mappings, lid);
-		if (entry) {
-			el->id = entry->id;
-		} else {
+	for (i = 0; i < count; i++) {
+		el = pw_idmap_set(map, test_lid(i), t1, NULL);
+		assert(el && el->id == i + 1);
+	}
+	cap = map->id_arr_cap;
+	assert(cap > count && map->by_id->el_count == 0);
+
+	/* single outliers go to the tree, and the array doesn't grow for them */
+	near = pw_idmap_set(map, 8 * count, t2, NULL);
+	far = pw_idmap_set(map, 1000 * count, t2, NULL);
+	far2 = pw_idmap_set(map, 1000 * count, t1, NULL);
+	assert(near && far && far2);
+	assert(map->id_arr_cap == cap && map->by_id->el_count == 3);
+	assert(pw_idmap_get(map, 8 * count, t2) == near);
+	assert(pw_idmap_get(map, 1000 * count, 0) == far2);
+	assert(pw_idmap_get(map, 1000 * count, t2) == far);
+
+	/* an id right past the array still dense enough grows it instead */
+	el = pw_idmap_set(map, cap, t1, NULL);
+	assert(el && map->id_arr_cap == 2 * cap && map->by_id->el_count == 3);
+
+	/* once the array gets dense enough to cover the near outlier, it's moved
+	 * there, and the tree is rebuilt with just the far ones */
+	for (i = count + 1; map->by_id->el_count == 3; i++) {
+		/* explicit ids, new lids would get ids past the far outlier */
+		el = pw_idmap_set(map, i, t2, NULL);
+		assert(el);
+	}
+	assert(map->id_arr_cap > 8 * count && map->by_id->el_count == 2);
+	assert(map->id_el_cnt * IDMAP_ID_ARR_DENSITY >= map->id_arr_cap);
+	assert(pw_idmap_get(map, 8 * count, 0) == near);
+	assert(pw_idmap_get(map, 8 * count, t2) == near);
+	assert(pw_idmap_get(map, 1000 * count, 0) == far2);
+	assert(pw_idmap_get(map, 1000 * count, t2) == far);
+	for (i = 0; i < count; i++) {
+		el = pw_idmap_get(map, i + 1, t1);
+		assert(el && el->lid == test_lid(i));
+	}
+}
 
-			if (!map->can_set) {
-				pw_log("Unexpected lid=0x%x\n", lid);
-				assert(false);
-				return NULL;
-			}
+/* elements set by lid get sequential ids, so they all end up in the id array */
+static void
+bench_ids(void)
+{
+	struct pw_idmap *map = test_map("ids", 2);
+	struct pw_avl *tree = pw_avl_init_pooled(sizeof(struct pw_idmap_el *), IDMAP_POOL_CHUNK_SIZE);
+	size_t i, count = 200000, lookups = 2000000;
+	struct pw_idmap_el *el;
+	double tree_ms, arr_ms;
+	clock_t start;
 
-			el->id = map->max_id + 1;
+	for (i = 0; i < count; i++) {
+		struct pw_idmap_el **el_p;
 
-			entry = pw_avl_alloc(map->lid_mappings);
-			assert(entry);
-			entry->lid = el->lid;
-			entry->id = el->id;
-			entry->type = el->type;
+		el = pw_idmap_set(map, test_lid((i * 7919) % count), 1 + i % 2, NULL);
+		assert(el && el->id == i + 1);
 
-			pw_avl_insert(map->lid_mappings, lid, entry);
+		/* the previous layout: pointers in a tree keyed by (id, type) */
+		el_p = pw_avl_alloc(tree);
+		*el_p = el;
+		pw_avl_insert(tree, id_key(el->id, el->type), el_p);
+	}
+	assert(map->id_arr_cap > count && map->by_id->el_count == 0);
+
+	start = clock();
+	for (i = 0; i < lookups; i++) {
+		long id = 1 + (i * 104729) % count;
+		struct pw_idmap_el **el_p = pw_avl_get(tree, id_key(id, 1 + (id - 1) % 2));
+
+		assert(el_p && (*el_p)->id == id);
+	}
+	tree_ms = elapsed_ms(start);
+
+	start = clock();
+	for (i = 0; i < lookups; i++) {
+		long id = 1 + (i * 104729) % count;
+
+		el = get_by_id(map, id, 1 + (id - 1) % 2);
+		assert(el && el->id == id);
+	}
+	arr_ms = elapsed_ms(start);
+
+	/* untyped, and a type that doesn't exist */
+	assert(get_by_id(map, 5, 0)->id == 5 && !get_by_id(map, 5, 2));
+	assert(!get_by_id(map, count + 1, 0) && !get_by_id(map, -1, 0));
+
+	/* a far away id goes to the tree, and moves to the array once it's dense enough */
+	el = pw_idmap_set(map, 5 * count, 1, NULL);
+	assert(el && map->by_id->el_count == 1);
+	assert(get_by_id(map, 5 * count, 1)->lid == 5 * count);
+	for (i = count; map->by_id->el_count > 0; i++) {
+		el = pw_idmap_set(map, test_lid(i), 1, NULL);
+		assert(el);
+	}
+	assert(map->id_arr_cap > 5 * count && i < 3 * count);
+	assert(get_by_id(map, 5 * count, 0)->lid == 5 * count);
+
+	fprintf(stderr, "%zu ids: tree lookup %.2f ms, array lookup %.2f ms\n",
+			count, tree_ms, arr_ms);
+	pw_avl_deinit(tree);
+}
+
+static double
+wall_ms(void)
+{
+	struct timespec ts;
+
+	/* clock() is process CPU time on Linux, useless for multiple threads */
+	timespec_get(&ts, TIME_UTC);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+struct stress_ctx {
+	struct pw_idmap *map;
+	/* lids [0, published) are set */
+	size_t published;
+	bool stop;
+	size_t async_called;
+};
+
+struct stress_reader {
+	pthread_t thread;
+	struct stress_ctx *ctx;
+	uint64_t seed;
+	size_t reads;
+};
+
+static void *
+stress_reader_fn(void *arg)
+{
+	struct stress_reader *r = arg;
+	struct stress_ctx *ctx = r->ctx;
+	uint64_t rnd = r->seed;
+
+	while (!__atomic_load_n(&ctx->stop, __ATOMIC_ACQUIRE)) {
+		size_t i, n = __atomic_load_n(&ctx->published, __ATOMIC_ACQUIRE);
+		struct pw_idmap_el *el, *low, *by_id;
+		unsigned id;
+
+		if (n == 0) {
+			continue;
 		}
+
+		rnd = rnd * 6364136223846793005ULL + 1442695040888963407ULL;
+		i = (rnd >> 33) % n;
+
+		el = pw_idmap_get(ctx->map, test_lid(i), 1 + i % 2);
+		assert(el && el->lid == test_lid(i) && el->data == (void *)(uintptr_t)(i + 1));
+		/* some lids got a lower type later, see stress_concurrent() */
+		low = pw_idmap_get(ctx->map, test_lid(i), 0);
+		assert(low && low->id == el->id && low->type == (i % 8 == 1 ? 1 : el->type));
+		by_id = pw_idmap_get(ctx->map, el->id, 0);
+		id = pw_idmap_get_mapping(ctx->map, test_lid(i), 0);
+		assert(by_id == low && id == el->id);
+		__atomic_store_n(&r->reads, r->reads + 4, __ATOMIC_RELAXED);
 	}
 
-	if (el->id > map->max_id) {
-		assert(el->id <= 0x80000000);
-		map->max_id = el->id;
+	return NULL;
+}
+
+static void
+stress_async_cb(struct pw_idmap_el *el, void *ctx)
+{
+	struct stress_ctx *sctx = ctx;
+
+	assert(el->data != NULL);
+	__atomic_fetch_add(&sctx->async_called, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * One writer adding mappings, several readers. The ids either grow the id
+ * array, or with `id_tree` start far up so they all go to the by_id tree.
+ */
+static void
+stress_concurrent(unsigned nreaders, size_t count, bool id_tree)
+{
+	struct stress_ctx ctx = {};
+	struct stress_reader readers[8] = {};
+	size_t i, reads_writing = 0, reads = 0, async_cnt = 0;
+	double start, write_ms, read_ms;
+	struct pw_idmap_el *el;
+	unsigned r;
+	int rc;
+
+	assert(nreaders <= 8);
+	ctx.map = pw_idmap_init("stress", NULL, true);
+	rc = pw_idmap_enable_concurrency(ctx.map);
+	assert(rc == 0);
+	pw_idmap_register_type(ctx.map);
+	pw_idmap_register_type(ctx.map);
+	if (id_tree) {
+		/* the next ids are assigned above this one */
+		el = pw_idmap_set(ctx.map, 0x40000000, 1, NULL);
+		assert(el);
 	}
 
-	tmp = pw_avl_alloc(map->by_id);
-	if (!tmp) {
-		pw_log("pw_avl_alloc() failed\n");
-		return NULL;
+	for (r = 0; r < nreaders; r++) {
+		readers[r].ctx = &ctx;
+		readers[r].seed = r + 1;
+		pthread_create(&readers[r].thread, NULL, stress_reader_fn, &readers[r]);
 	}
 
-	*(struct pw_idmap_el **)tmp = el;
-	pw_avl_insert(map->by_id, el->id, tmp);
+	start = wall_ms();
+	for (i = 0; i < count; i++) {
+		if (i % 1000 == 0 && i + 500 < count) {
+			/* fired from pw_idmap_set() 500 lids later */
+			rc = pw_idmap_get_async(ctx.map, test_lid(i + 500), 1 + (i + 500) % 2,
+					stress_async_cb, &ctx);
+			assert(rc == 0);
+			async_cnt++;
+		}
+
+		el = pw_idmap_set(ctx.map, test_lid(i), 1 + i % 2, (void *)(uintptr_t)(i + 1));
+		assert(el);
+		if (i % 8 == 1) {
+			/* a lower type, it replaces the lowest one of the lid */
+			el = pw_idmap_set(ctx.map, test_lid(i), 1, (void *)(uintptr_t)(i + 1));
+			assert(el);
+		}
+		__atomic_store_n(&ctx.published, i + 1, __ATOMIC_RELEASE);
+	}
+	write_ms = wall_ms() - start;
+	assert(ctx.async_called == async_cnt);
+	assert(!id_tree || ctx.map->by_id->el_count > count);
 
-	return el;
+	/* and some reads with no writer */
+	for (r = 0; r < nreaders; r++) {
+		reads_writing += __atomic_load_n(&readers[r].reads, __ATOMIC_RELAXED);
+	}
+	start = wall_ms();
+	while (wall_ms() - start < 200) {
+		sched_yield();
+	}
+	__atomic_store_n(&ctx.stop, true, __ATOMIC_RELEASE);
+
+	for (r = 0; r < nreaders; r++) {
+		pthread_join(readers[r].thread, NULL);
+		reads += readers[r].reads;
+	}
+	read_ms = wall_ms() - start;
+	reads -= reads_writing;
+
+	fprintf(stderr, "stress %u readers%s: %zu sets in %.2f ms, %.2f Mreads/s while writing, "
+			"%.2f Mreads/s with no writer\n", nreaders, id_tree ? " (id tree)" : "",
+			count, write_ms, reads_writing / write_ms / 1000, reads / read_ms / 1000);
 }
 
 static void
-idmap_save_cb(void *_node, void *ctx1, void *ctx2)
+test_journal(const char *path)
 {
-	struct pw_avl_node *node = _node;
-	struct pw_idmap_file_entry *entry = (void *)node->data;
-	FILE *fp = ctx1;
-	struct pw_idmap *map = ctx2;
+	struct pw_idmap_journal_rec rec = {};
+	struct pw_idmap *map;
+	uint64_t base_id;
+	char jpath[512];
+	clock_t start;
+	double full_ms, journal_ms;
+	size_t i, base_cnt = 100000;
+	FILE *fp;
+	int rc;
+
+	remove(path);
+	journal_path(jpath, sizeof(jpath), path);
+	remove(jpath);
 
-	//pw_log("%s: lid=0x%llx, id=%u\n", map->name, entry->lid, entry->id);
-	fwrite(entry, 1, sizeof(*entry), fp);
+	map = pw_idmap_init("journal", path, true);
+	for (i = 0; i < base_cnt; i++) {
+		pw_idmap_set(map, test_lid(i), 1, NULL);
+	}
+	start = clock();
+	rc = pw_idmap_save(map, path);
+	assert(rc == 0);
+	full_ms = elapsed_ms(start);
+
+	/* a few new mappings at a time only touch the journal */
+	map = pw_idmap_init("journal", path, true);
+	pw_idmap_use_journal(map);
+	start = clock();
+	for (i = base_cnt; i < base_cnt + 100; i++) {
+		pw_idmap_set(map, test_lid(i), 1, NULL);
+		rc = pw_idmap_save(map, path);
+		assert(rc == 0);
+	}
+	journal_ms = elapsed_ms(start) / 100;
+	assert(map->journal_cnt == 100);
+
+	map = pw_idmap_init("journal", path, true);
+	assert(map->file_entry_cnt == base_cnt && map->journal_cnt == 100);
+	for (i = 0; i < base_cnt + 100; i++) {
+		assert(pw_idmap_get_mapping(map, test_lid(i), 0) == i + 1);
+	}
+
+	/* a torn record at the end is dropped, and forces a compaction */
+	fp = fopen(jpath, "ab");
+	fwrite("torn", 1, 4, fp);
+	fclose(fp);
+	map = pw_idmap_init("journal", path, true);
+	pw_idmap_use_journal(map);
+	assert(map->journal_torn && pw_idmap_get_mapping(map, test_lid(base_cnt + 99), 0) == base_cnt + 100);
+	pw_idmap_set(map, test_lid(base_cnt + 100), 1, NULL);
+	rc = pw_idmap_save(map, path);
+	assert(rc == 0);
+	fp = fopen(jpath, "rb");
+	assert(fp == NULL);
+
+	map = pw_idmap_init("journal", path, true);
+	assert(map->file_entry_cnt == base_cnt + 101 && map->journal_cnt == 0);
+	assert(pw_idmap_get_mapping(map, test_lid(base_cnt + 100), 0) == base_cnt + 101);
+
+	/* a record that maps a taken id to another lid is dropped, the rest is kept */
+	pw_idmap_use_journal(map);
+	pw_idmap_set(map, test_lid(base_cnt + 101), 1, NULL);
+	rc = pw_idmap_save(map, path);
+	assert(rc == 0);
+	fp = fopen(jpath, "ab");
+	rec.magic = PW_IDMAP_JOURNAL_MAGIC;
+	rec.type = 1;
+	rec.id = 1;
+	rec.lid = test_lid(base_cnt + 200);
+	rec.crc = journal_rec_crc(&rec);
+	fwrite(&rec, sizeof(rec), 1, fp);
+	rec.id = base_cnt + 103;
+	rec.lid = test_lid(base_cnt + 201);
+	rec.crc = journal_rec_crc(&rec);
+	fwrite(&rec, sizeof(rec), 1, fp);
+	fclose(fp);
+	map = pw_idmap_init("journal", path, true);
+	assert(map->journal_torn && pw_idmap_get_mapping(map, test_lid(base_cnt + 101), 0) == base_cnt + 102);
+	assert(pw_idmap_get_mapping(map, test_lid(base_cnt + 200), 0) == 0);
+	assert(pw_idmap_get_mapping(map, test_lid(base_cnt + 201), 0) == base_cnt + 103);
+
+	/* a journal of another base file isn't applied at all */
+	fp = fopen(jpath, "r+b");
+	fseek(fp, offsetof(struct pw_idmap_journal_hdr, base_id), SEEK_SET);
+	base_id = map->base_id ^ 1;
+	fwrite(&base_id, sizeof(base_id), 1, fp);
+	fclose(fp);
+	map = pw_idmap_init("journal", path, true);
+	pw_idmap_use_journal(map);
+	assert(map->journal_torn && map->journal_cnt == 0);
+	assert(pw_idmap_get_mapping(map, test_lid(base_cnt + 101), 0) == 0);
+
+	/* and the next save replaces it with a new base file */
+	pw_idmap_set(map, test_lid(base_cnt + 101), 1, NULL);
+	rc = pw_idmap_save(map, path);
+	assert(rc == 0);
+	fp = fopen(jpath, "rb");
+	assert(fp == NULL);
+	map = pw_idmap_init("journal", path, true);
+	assert(map->base_id != 0 && map->base_id != (base_id ^ 1));
+	assert(pw_idmap_get_mapping(map, test_lid(base_cnt + 101), 0) == base_cnt + 102);
+
+	fprintf(stderr, "%zu entries: full save %.2f ms, journaled save of 1 mapping %.3f ms\n",
+			base_cnt, full_ms, journal_ms);
+	remove(path);
 }
 
 int
-pw_idmap_save(struct pw_idmap *map, const char *filename)
+main(int argc, char **argv)
 {
+	const char *path = argc > 1 ? argv[1] : "idmap_test.imap";
+	size_t i, count = 500000, lookups = 2000000;
+	uint32_t version = PW_IDMAP_VERSION_V3;
+	struct pw_idmap_el *el;
+	struct pw_idmap *map;
+	double tree_ms, load_ms, v4_load_ms, lookup_ms;
+	clock_t start;
 	FILE *fp;
+	int rc;
+
+	fp = fopen(path, "wb");
+	assert(fp);
+	fwrite(&version, 1, sizeof(version), fp);
+	for (i = 0; i < count; i++) {
+		struct pw_idmap_file_entry entry = {};
+
+		entry.lid = test_lid(i);
+		/* ids are assigned in lid order, but not contiguous */
+		entry.id = 1 + (i * 7919) % count;
+		entry.type = 1 + i % 3;
+		fwrite(&entry, 1, sizeof(entry), fp);
+	}
+	fclose(fp);
 
-	assert(map->can_set);
+	tree_ms = bench_tree_load(path, count);
 
-	fp = fopen(filename, "wb");
-	if (fp == NULL) {
-		pw_log("Cant open %s\n", filename);
-		return -errno;
+	start = clock();
+	map = pw_idmap_init("test", path, true);
+	load_ms = elapsed_ms(start);
+	assert(map && map->file_entry_cnt == count);
+
+	start = clock();
+	for (i = 0; i < lookups; i++) {
+		size_t n = (i * 104729) % count;
+		unsigned id = pw_idmap_get_mapping(map, test_lid(n), 0);
+
+		assert(id == 1 + (n * 7919) % count);
+	}
+	lookup_ms = elapsed_ms(start);
+
+	/* id -> lid resolution through the id index */
+	for (i = 0; i < 1000; i++) {
+		size_t n = (i * 104729) % count;
+
+		el = pw_idmap_set(map, 1 + (n * 7919) % count, 0, NULL);
+		assert(el && el->lid == test_lid(n));
+	}
+
+	/* runtime additions are merged back in lid order, and saved as v4 */
+	el = pw_idmap_set(map, test_lid(count) + 1, 1, NULL);
+	assert(el && el->id == count + 1);
+	el = pw_idmap_set(map, 0x80000000ULL + 1, 1, NULL);
+	assert(el && el->id == count + 2);
+	rc = pw_idmap_save(map, path);
+	assert(rc == 0);
+
+	start = clock();
+	map = pw_idmap_init("test2", path, false);
+	v4_load_ms = elapsed_ms(start);
+	assert(map->file_entry_cnt == count + 2);
+	assert(pw_idmap_get_mapping(map, 0x80000000ULL + 1, 0) == count + 2);
+	for (i = 1; i < map->file_entry_cnt; i++) {
+		assert(map->file_entries[i - 1].lid <= map->file_entries[i].lid);
 	}
+	for (i = 0; i < 1000; i++) {
+		size_t n = (i * 104729) % count;
 
-	struct pw_idmap_file_hdr hdr;
-	hdr.version = IDMAP_VERSION;
-	fwrite(&hdr, 1, sizeof(hdr), fp);
+		assert(pw_idmap_get_mapping(map, test_lid(n), 0) == 1 + (n * 7919) % count);
+		el = pw_idmap_set(map, 1 + (n * 7919) % count, 0, NULL);
+		assert(el && el->lid == test_lid(n));
+	}
 
-	pw_avl_foreach(map->lid_mappings, idmap_save_cb, fp, map);
+	/* a corrupted file is ignored as a whole */
+	fp = fopen(path, "r+b");
+	fseek(fp, -1, SEEK_END);
+	fputc(0xff, fp);
 	fclose(fp);
+	map = pw_idmap_init("test3", path, false);
+	assert(map->file_entry_cnt == 0);
+
+	test_set_many_conflicts(path);
+	test_journal(path);
+	test_type0();
+	bench_types();
+	bench_batch();
+	bench_async();
+	test_id_density(false);
+	test_id_density(true);
+	bench_ids();
+	stress_concurrent(1, 300000, false);
+	stress_concurrent(4, 300000, false);
+	stress_concurrent(4, 300000, true);
+
+	fprintf(stderr, "%zu entries: per-entry tree load %.2f ms, v3 array load %.2f ms, "
+			"v4 load %.2f ms, %.2f Mlookups/s\n",
+			count, tree_ms, load_ms, v4_load_ms, lookups / lookup_ms / 1000);
+	remove(path);
 	return 0;
 }
+#endif
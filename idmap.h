@@ -5,9 +5,71 @@
 #ifndef PW_IDMAP_H
 #define PW_IDMAP_H
 
+#include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <inttypes.h>
 
+/*
+ * On-disk format, also used by the offline tools (imaptool/).
+ * v3 files are just the version followed by entries in any order.
+ */
+#define PW_IDMAP_VERSION 4
+#define PW_IDMAP_VERSION_V3 3
+#define PW_IDMAP_JOURNAL_MAGIC 0x4a4d4449
+#define PW_IDMAP_JOURNAL_HDR_MAGIC 0x484a4d49
+
+/**
+ * v4 file layout:
+ *  - struct pw_idmap_file_hdr
+ *  - struct pw_idmap_file_entry[count], sorted by lid
+ *  - uint32_t[count], indices of the above entries sorted by id
+ */
+struct pw_idmap_file_hdr {
+	uint32_t version;
+	/* since v4 */
+	uint32_t entry_size;
+	uint32_t count;
+	uint32_t crc; /**< pw_crc32() of the entries and the id index */
+	/**
+	 * Random for each save and never 0. It tells which file <filename>.journal
+	 * was written for, so a journal that's left over after the file was
+	 * replaced isn't applied on top of different mappings.
+	 */
+	uint64_t base_id;
+};
+
+/* same size and layout as the compiler-padded v3 entry */
+struct pw_idmap_file_entry {
+	uint64_t lid;
+	uint32_t id;
+	uint8_t type;
+	uint8_t _reserved[3];
+};
+
+/*
+ * <filename>.journal is a struct pw_idmap_journal_hdr followed by records
+ * of the mappings added after the file was written, see pw_idmap_use_journal().
+ * Only v4 files have a base_id, so only those can have a journal.
+ */
+struct pw_idmap_journal_hdr {
+	uint32_t magic;
+	uint32_t _reserved;
+	uint64_t base_id; /**< the same as in struct pw_idmap_file_hdr */
+};
+
+struct pw_idmap_journal_rec {
+	uint32_t magic;
+	uint32_t id;
+	uint64_t lid;
+	uint8_t type;
+	uint8_t _reserved[3];
+	uint32_t crc; /**< pw_crc32() of all the above */
+};
+
+/** a new base_id for a file that's about to be written */
+uint64_t pw_idmap_new_base_id(uint32_t count);
+
 struct pw_idmap_el {
 	long long lid;
 	long id;
@@ -19,15 +81,64 @@ struct pw_idmap_el {
 	void *next;
 };
 
+/** one request of pw_idmap_get_many() / pw_idmap_set_many() */
+struct pw_idmap_req {
+	long long lid;
+	long type;
+	void *data; /**< only for pw_idmap_set_many() */
+	struct pw_idmap_el *el; /**< result, NULL if not found / couldn't set */
+};
+
 typedef void (*pw_idmap_async_fn)(struct pw_idmap_el *node, void *ctx);
 
 struct pw_idmap *pw_idmap_init(const char *name, const char *filename, int can_set);
 void pw_idmap_ignore_dups(struct pw_idmap *map);
+/**
+ * Make pw_idmap_save() append just the new mappings to <filename>.journal,
+ * instead of rewriting the whole file. The journal is folded back into
+ * the file once it grows big enough. pw_idmap_init() replays the journal
+ * if it was written for the loaded file. Any other journal is ignored, and
+ * the next save rewrites the whole file.
+ */
+void pw_idmap_use_journal(struct pw_idmap *map);
+/**
+ * Allow pw_idmap_get() and pw_idmap_get_mapping() to be called from any
+ * thread while other threads modify the map. Those reads take no locks,
+ * they back off and retry if a writer got in the way. All the other calls
+ * are serialized with a writer lock, except for the setup ones:
+ * pw_idmap_ignore_dups(), pw_idmap_use_journal() and this one, which must
+ * be called before the map is shared between threads. Async callbacks are
+ * fired after the lock is released, from whichever thread happened to set
+ * the element (or calls pw_idmap_drain_async() if they're deferred).
+ */
+int pw_idmap_enable_concurrency(struct pw_idmap *map);
 long pw_idmap_register_type(struct pw_idmap *map);
 struct pw_idmap_el *pw_idmap_get(struct pw_idmap *map, long long lid, long type);
 unsigned pw_idmap_get_mapping(struct pw_idmap *map, long long lid, long type);
 int pw_idmap_get_async(struct pw_idmap *map, long long lid, long type, pw_idmap_async_fn fn, void *fn_ctx);
 struct pw_idmap_el *pw_idmap_set(struct pw_idmap *map, long long lid, long type, void *data);
+/**
+ * With defer set, pw_idmap_set() no longer calls the pending async
+ * callbacks of the element right away. It queues them instead, and
+ * they're all called (in the order the elements were set) from the
+ * next pw_idmap_drain_async(). Meant for bulk loads, e.g. drain once
+ * after a whole batch of pw_idmap_set().
+ */
+void pw_idmap_defer_async(struct pw_idmap *map, bool defer);
+/** \return number of elements whose callbacks were called */
+size_t pw_idmap_drain_async(struct pw_idmap *map);
 int pw_idmap_save(struct pw_idmap *map, const char *filename);
 
+/**
+ * Same as calling pw_idmap_get() / pw_idmap_set() for each request.
+ * pw_idmap_get_many() sorts the batch once and looks it up in a single pass
+ * over the map. pw_idmap_set_many() applies the requests in the batch order
+ * as a single write, and fires any pending async callbacks (in that order
+ * too) once the whole batch is in.
+ *
+ * \return number of requests with a non-NULL el
+ */
+size_t pw_idmap_get_many(struct pw_idmap *map, struct pw_idmap_req *reqs, size_t count);
+size_t pw_idmap_set_many(struct pw_idmap *map, struct pw_idmap_req *reqs, size_t count);
+
 #endif /* PW_IDMAP_H */
@@ -0,0 +1,1145 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright(c) 2022 Darek Stojaczyk for pwmirage.com
+ */
+
+/*
+ * Offline tool for .imap files, meant for the build servers:
+ *
+ *   imaptool dump [-j] <file>
+ *   imaptool check <file>
+ *   imaptool merge -o <out> [-p first|last] [-s] [-J] <file>...
+ *   imaptool compact -o <out> [-k <lids.txt>] [-J] <file>
+ *   imaptool convert -o <out> -v 3|4 <file>
+ *
+ * Everything but check streams through the files. Anything that needs a
+ * different order is sorted externally: sorted runs of at most -m MB are
+ * spilled to temporary files in -t <dir> and merged back, so the files
+ * can be far larger than the RAM.
+ *
+ * The output gets a new base_id, so any <out>.journal left there is removed.
+ */
+
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "idmap.h"
+#include "crc.h"
+
+#define DEFAULT_MEM_MB 256
+/* runs merged at once, more are merged in several passes */
+#define XSORT_MAX_FANIN 64
+/* external sorts that may hold their buffers at the same time */
+#define XSORT_MAX_ACTIVE 4
+#define COPY_BUF_SIZE 65536
+
+static size_t g_mem_bytes = (size_t)DEFAULT_MEM_MB << 20;
+static const char *g_tmpdir;
+static bool g_verbose;
+
+static void __attribute__((noreturn, format(printf, 1, 2)))
+fatal(const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+	exit(1);
+}
+
+static void *
+xmalloc(size_t size)
+{
+	void *ptr = malloc(size ? size : 1);
+
+	if (!ptr) {
+		fatal("out of memory (%zu bytes)\n", size);
+	}
+	return ptr;
+}
+
+static void
+xwrite(FILE *fp, const void *buf, size_t size)
+{
+	if (size && fwrite(buf, size, 1, fp) != 1) {
+		fatal("write failed: %s\n", strerror(errno));
+	}
+}
+
+static bool
+xread(FILE *fp, void *buf, size_t size)
+{
+	return fread(buf, size, 1, fp) == 1;
+}
+
+/* anonymous temporary file, gone once closed */
+static FILE *
+tmp_open(void)
+{
+	char path[4096];
+	FILE *fp;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/imaptool.XXXXXX", g_tmpdir);
+	fd = mkstemp(path);
+	if (fd < 0) {
+		fatal("can't create a temporary file in %s: %s\n", g_tmpdir, strerror(errno));
+	}
+	unlink(path);
+
+	fp = fdopen(fd, "w+b");
+	if (!fp) {
+		fatal("fdopen: %s\n", strerror(errno));
+	}
+	return fp;
+}
+
+static void
+tmp_rewind(FILE *fp)
+{
+	if (fflush(fp) != 0 || fseek(fp, 0, SEEK_SET) != 0) {
+		fatal("temporary file: %s\n", strerror(errno));
+	}
+}
+
+/*
+ * External sort of fixed-size records. Records are buffered up to the
+ * memory limit, then sorted and written out as a run. Reading merges the
+ * runs with a heap, or just walks the buffer if everything fit in memory.
+ * The comparator must be a total order, qsort() isn't stable.
+ */
+typedef int (*xsort_cmp)(const void *a, const void *b);
+
+struct xsort {
+	size_t rec_size;
+	xsort_cmp cmp;
+	char *buf;
+	size_t buf_cap;
+	size_t buf_cnt;
+	FILE **runs;
+	size_t run_cnt;
+	size_t run_cap;
+	uint64_t total;
+	/* reading */
+	bool in_memory;
+	size_t mem_pos;
+	char *recs;
+	size_t *heap;
+	size_t heap_cnt;
+};
+
+static void
+xsort_init(struct xsort *xs, size_t rec_size, xsort_cmp cmp)
+{
+	memset(xs, 0, sizeof(*xs));
+	xs->rec_size = rec_size;
+	xs->cmp = cmp;
+	xs->buf_cap = g_mem_bytes / XSORT_MAX_ACTIVE / rec_size;
+	if (xs->buf_cap < 1024) {
+		xs->buf_cap = 1024;
+	}
+	xs->buf = xmalloc(xs->buf_cap * rec_size);
+}
+
+static void
+xsort_push_run(struct xsort *xs, FILE *fp)
+{
+	if (xs->run_cnt == xs->run_cap) {
+		xs->run_cap = xs->run_cap ? xs->run_cap * 2 : 16;
+		xs->runs = realloc(xs->runs, xs->run_cap * sizeof(*xs->runs));
+		if (!xs->runs) {
+			fatal("out of memory\n");
+		}
+	}
+	xs->runs[xs->run_cnt++] = fp;
+}
+
+static void
+xsort_flush(struct xsort *xs)
+{
+	FILE *fp;
+
+	if (xs->buf_cnt == 0) {
+		return;
+	}
+
+	qsort(xs->buf, xs->buf_cnt, xs->rec_size, xs->cmp);
+	fp = tmp_open();
+	xwrite(fp, xs->buf, xs->buf_cnt * xs->rec_size);
+	tmp_rewind(fp);
+	xsort_push_run(xs, fp);
+	xs->buf_cnt = 0;
+}
+
+static void
+xsort_add(struct xsort *xs, const void *rec)
+{
+	if (xs->buf_cnt == xs->buf_cap) {
+		xsort_flush(xs);
+	}
+
+	memcpy(xs->buf + xs->buf_cnt * xs->rec_size, rec, xs->rec_size);
+	xs->buf_cnt++;
+	xs->total++;
+}
+
+static bool
+heap_less(struct xsort *xs, size_t a, size_t b)
+{
+	int rc = xs->cmp(xs->recs + a * xs->rec_size, xs->recs + b * xs->rec_size);
+
+	/* same records from different runs, keep the run order */
+	return rc < 0 || (rc == 0 && a < b);
+}
+
+static void
+heap_down(struct xsort *xs, size_t i)
+{
+	while (true) {
+		size_t l = 2 * i + 1, r = l + 1, min = i, tmp;
+
+		if (l < xs->heap_cnt && heap_less(xs, xs->heap[l], xs->heap[min])) {
+			min = l;
+		}
+		if (r < xs->heap_cnt && heap_less(xs, xs->heap[r], xs->heap[min])) {
+			min = r;
+		}
+		if (min == i) {
+			break;
+		}
+
+		tmp = xs->heap[i];
+		xs->heap[i] = xs->heap[min];
+		xs->heap[min] = tmp;
+		i = min;
+	}
+}
+
+/* start merging runs[first, first + cnt) */
+static void
+merge_start(struct xsort *xs, size_t first, size_t cnt)
+{
+	size_t i;
+
+	xs->recs = xmalloc(cnt * xs->rec_size);
+	xs->heap = xmalloc(cnt * sizeof(*xs->heap));
+	xs->heap_cnt = 0;
+
+	for (i = 0; i < cnt; i++) {
+		if (xread(xs->runs[first + i], xs->recs + i * xs->rec_size, xs->rec_size)) {
+			xs->heap[xs->heap_cnt++] = i;
+		}
+	}
+
+	for (i = xs->heap_cnt; i > 0; i--) {
+		heap_down(xs, i - 1);
+	}
+}
+
+static bool
+merge_next(struct xsort *xs, size_t first, void *rec)
+{
+	size_t top;
+
+	if (xs->heap_cnt == 0) {
+		return false;
+	}
+
+	top = xs->heap[0];
+	memcpy(rec, xs->recs + top * xs->rec_size, xs->rec_size);
+
+	if (!xread(xs->runs[first + top], xs->recs + top * xs->rec_size, xs->rec_size)) {
+		xs->heap[0] = xs->heap[--xs->heap_cnt];
+	}
+	heap_down(xs, 0);
+	return true;
+}
+
+static void
+merge_end(struct xsort *xs)
+{
+	free(xs->recs);
+	free(xs->heap);
+	xs->recs = NULL;
+	xs->heap = NULL;
+}
+
+/* no more records, prepare for reading */
+static void
+xsort_finish(struct xsort *xs)
+{
+	if (xs->run_cnt == 0) {
+		qsort(xs->buf, xs->buf_cnt, xs->rec_size, xs->cmp);
+		xs->in_memory = true;
+		return;
+	}
+
+	xsort_flush(xs);
+	free(xs->buf);
+	xs->buf = NULL;
+
+	/* too many runs to merge at once, merge the oldest ones into bigger runs */
+	if (g_verbose && xs->run_cnt > XSORT_MAX_FANIN) {
+		fprintf(stderr, "merging %zu runs in several passes\n", xs->run_cnt);
+	}
+	while (xs->run_cnt > XSORT_MAX_FANIN) {
+		char *rec = xmalloc(xs->rec_size);
+		FILE *fp = tmp_open();
+		size_t i;
+
+		merge_start(xs, 0, XSORT_MAX_FANIN);
+		while (merge_next(xs, 0, rec)) {
+			xwrite(fp, rec, xs->rec_size);
+		}
+		merge_end(xs);
+		free(rec);
+
+		for (i = 0; i < XSORT_MAX_FANIN; i++) {
+			fclose(xs->runs[i]);
+		}
+		memmove(xs->runs, xs->runs + XSORT_MAX_FANIN,
+				(xs->run_cnt - XSORT_MAX_FANIN) * sizeof(*xs->runs));
+		xs->run_cnt -= XSORT_MAX_FANIN;
+
+		tmp_rewind(fp);
+		xsort_push_run(xs, fp);
+	}
+
+	merge_start(xs, 0, xs->run_cnt);
+}
+
+static bool
+xsort_next(struct xsort *xs, void *rec)
+{
+	if (xs->in_memory) {
+		if (xs->mem_pos == xs->buf_cnt) {
+			return false;
+		}
+		memcpy(rec, xs->buf + xs->mem_pos++ * xs->rec_size, xs->rec_size);
+		return true;
+	}
+
+	return merge_next(xs, 0, rec);
+}
+
+static void
+xsort_free(struct xsort *xs)
+{
+	size_t i;
+
+	for (i = 0; i < xs->run_cnt; i++) {
+		fclose(xs->runs[i]);
+	}
+	free(xs->runs);
+	free(xs->buf);
+	merge_end(xs);
+}
+
+/* streaming reader of a base file or its journal */
+struct imap_in {
+	const char *path;
+	FILE *fp;
+	bool journal;
+	uint32_t version;
+	uint64_t count;
+	uint64_t read;
+	uint32_t crc;
+	uint32_t hdr_crc;
+	uint64_t base_id; /* v4 only */
+	bool torn;
+};
+
+static int
+in_open(struct imap_in *in, const char *path)
+{
+	struct pw_idmap_file_hdr hdr = {};
+	long size;
+
+	memset(in, 0, sizeof(*in));
+	in->path = path;
+	in->fp = fopen(path, "rb");
+	if (!in->fp) {
+		return -errno;
+	}
+
+	fseek(in->fp, 0, SEEK_END);
+	size = ftell(in->fp);
+	fseek(in->fp, 0, SEEK_SET);
+
+	if (!xread(in->fp, &hdr.version, sizeof(hdr.version))) {
+		fclose(in->fp);
+		return -EINVAL;
+	}
+
+	in->version = hdr.version;
+	if (hdr.version == PW_IDMAP_VERSION_V3) {
+		in->count = (size - sizeof(hdr.version)) / sizeof(struct pw_idmap_file_entry);
+		return 0;
+	}
+
+	if (hdr.version != PW_IDMAP_VERSION ||
+			!xread(in->fp, &hdr.entry_size, sizeof(hdr) - sizeof(hdr.version)) ||
+			hdr.entry_size != sizeof(struct pw_idmap_file_entry) ||
+			size != sizeof(hdr) + (uint64_t)hdr.count *
+				(sizeof(struct pw_idmap_file_entry) + sizeof(uint32_t))) {
+		fclose(in->fp);
+		return -EINVAL;
+	}
+
+	in->count = hdr.count;
+	in->hdr_crc = hdr.crc;
+	in->base_id = hdr.base_id;
+	return 0;
+}
+
+/*
+ * The journal is optional, -ENOENT if there's none. Same as the loader,
+ * it only applies to the base file with the same base_id, -ESTALE if not.
+ */
+static int
+in_open_journal(struct imap_in *in, uint64_t base_id, const char *base_path, char *path,
+		size_t path_len)
+{
+	struct pw_idmap_journal_hdr jhdr;
+
+	memset(in, 0, sizeof(*in));
+	snprintf(path, path_len, "%s.journal", base_path);
+	in->path = path;
+	in->journal = true;
+	in->fp = fopen(path, "rb");
+	if (!in->fp) {
+		return -errno;
+	}
+
+	if (!xread(in->fp, &jhdr, sizeof(jhdr)) || jhdr.magic != PW_IDMAP_JOURNAL_HDR_MAGIC ||
+			jhdr.base_id == 0 || jhdr.base_id != base_id) {
+		fclose(in->fp);
+		return -ESTALE;
+	}
+	in->base_id = base_id;
+	return 0;
+}
+
+static bool
+in_next(struct imap_in *in, struct pw_idmap_file_entry *entry)
+{
+	memset(entry, 0, sizeof(*entry));
+
+	if (in->journal) {
+		struct pw_idmap_journal_rec rec;
+		size_t len;
+
+		if (in->torn || (len = fread(&rec, 1, sizeof(rec), in->fp)) == 0) {
+			return false;
+		}
+
+		/* same as the loader, stop at the first torn record */
+		if (len != sizeof(rec) || rec.magic != PW_IDMAP_JOURNAL_MAGIC ||
+				rec.crc != pw_crc32(0, &rec, offsetof(struct pw_idmap_journal_rec, crc))) {
+			in->torn = true;
+			return false;
+		}
+
+		entry->lid = rec.lid;
+		entry->id = rec.id;
+		entry->type = rec.type;
+		in->read++;
+		return true;
+	}
+
+	if (in->read == in->count || !xread(in->fp, entry, sizeof(*entry))) {
+		return false;
+	}
+
+	in->crc = pw_crc32(in->crc, entry, sizeof(*entry));
+	in->read++;
+	return true;
+}
+
+/* for v4 files, finish the checksum and return -EILSEQ if it doesn't match */
+static int
+in_close(struct imap_in *in)
+{
+	int rc = 0;
+
+	if (!in->journal && in->version == PW_IDMAP_VERSION) {
+		char *buf = xmalloc(COPY_BUF_SIZE);
+		uint64_t left = in->count * sizeof(uint32_t);
+
+		/* whatever wasn't read yet, then the id index */
+		while (in->read < in->count) {
+			struct pw_idmap_file_entry entry;
+
+			if (!in_next(in, &entry)) {
+				rc = -EIO;
+				break;
+			}
+		}
+
+		while (rc == 0 && left > 0) {
+			size_t len = left < COPY_BUF_SIZE ? left : COPY_BUF_SIZE;
+
+			if (!xread(in->fp, buf, len)) {
+				rc = -EIO;
+				break;
+			}
+			in->crc = pw_crc32(in->crc, buf, len);
+			left -= len;
+		}
+
+		if (rc == 0 && in->crc != in->hdr_crc) {
+			rc = -EILSEQ;
+		}
+		free(buf);
+	}
+
+	fclose(in->fp);
+	return rc;
+}
+
+static int
+cmd_dump(int argc, char **argv, bool journal)
+{
+	struct pw_idmap_file_entry entry;
+	struct imap_in in;
+	char jpath[4096];
+	uint64_t base_id;
+	int rc;
+
+	if (argc != 1) {
+		fatal("usage: imaptool dump [-j] <file>\n");
+	}
+
+	rc = in_open(&in, argv[0]);
+	if (rc != 0) {
+		fatal("%s: can't open: %s\n", argv[0], strerror(-rc));
+	}
+
+	printf("# %s: version %u, %" PRIu64 " entries", in.path, in.version, in.count);
+	if (in.version == PW_IDMAP_VERSION) {
+		printf(", base id 0x%016" PRIx64, in.base_id);
+	}
+	printf("\n");
+	base_id = in.base_id;
+	while (in_next(&in, &entry)) {
+		printf("0x%" PRIx64 " %u %u\n", entry.lid, entry.id, entry.type);
+	}
+
+	rc = in_close(&in);
+	if (rc == -EILSEQ) {
+		printf("# checksum mismatch\n");
+		return 1;
+	} else if (rc != 0) {
+		printf("# truncated\n");
+		return 1;
+	}
+
+	if (!journal) {
+		return 0;
+	}
+
+	rc = in_open_journal(&in, base_id, argv[0], jpath, sizeof(jpath));
+	if (rc == -ESTALE) {
+		printf("# %s: written for another file, ignored\n", jpath);
+	} else if (rc == 0) {
+		printf("# %s\n", in.path);
+		while (in_next(&in, &entry)) {
+			printf("0x%" PRIx64 " %u %u\n", entry.lid, entry.id, entry.type);
+		}
+		if (in.torn) {
+			printf("# torn record after %" PRIu64 " records\n", in.read);
+		}
+		in_close(&in);
+	}
+
+	return 0;
+}
+
+/* load with the same code as the game does, and compare with the stream */
+static int
+cmd_check(int argc, char **argv)
+{
+	struct pw_idmap_file_entry entry;
+	struct pw_idmap *map;
+	struct imap_in in;
+	uint64_t mismatches = 0;
+	int rc;
+
+	if (argc != 1) {
+		fatal("usage: imaptool check <file>\n");
+	}
+
+	rc = in_open(&in, argv[0]);
+	if (rc != 0) {
+		fatal("%s: can't open: %s\n", argv[0], strerror(-rc));
+	}
+
+	map = pw_idmap_init("check", argv[0], false);
+	if (!map) {
+		fatal("pw_idmap_init() failed\n");
+	}
+
+	while (in_next(&in, &entry)) {
+		unsigned id = pw_idmap_get_mapping(map, entry.lid, 0);
+
+		if (id != entry.id) {
+			if (g_verbose || mismatches < 10) {
+				fprintf(stderr, "lid 0x%" PRIx64 ": %u in the file, %u loaded\n",
+						entry.lid, entry.id, id);
+			}
+			mismatches++;
+		}
+	}
+
+	rc = in_close(&in);
+	if (rc != 0) {
+		fprintf(stderr, "%s: %s\n", argv[0], rc == -EILSEQ ? "checksum mismatch" : "truncated");
+		return 1;
+	}
+
+	printf("%s: version %u, %" PRIu64 " entries, %" PRIu64 " mismatches\n",
+			argv[0], in.version, in.count, mismatches);
+	return mismatches ? 1 : 0;
+}
+
+struct merge_opts {
+	bool prefer_last;
+	bool strict;
+	bool journals;
+	const char *keep_path;
+	const char *out;
+	uint32_t out_version;
+};
+
+/* pass 1, entries by lid. The first of the same lids wins */
+struct lid_rec {
+	struct pw_idmap_file_entry entry;
+	uint32_t prio;
+	uint32_t _pad;
+	uint64_t seq;
+};
+
+static int
+cmp_lid_rec(const void *a, const void *b)
+{
+	const struct lid_rec *r1 = a, *r2 = b;
+
+	if (r1->entry.lid != r2->entry.lid) {
+		return r1->entry.lid < r2->entry.lid ? -1 : 1;
+	}
+	if (r1->prio != r2->prio) {
+		return r1->prio < r2->prio ? -1 : 1;
+	}
+	return r1->seq < r2->seq ? -1 : r1->seq > r2->seq;
+}
+
+/* pass 2, the winners by id, to find id collisions */
+struct id_rec {
+	uint32_t id;
+	uint32_t prio;
+	uint64_t pos;
+	uint8_t type;
+	uint8_t _pad[7];
+};
+
+static int
+cmp_id_rec(const void *a, const void *b)
+{
+	const struct id_rec *r1 = a, *r2 = b;
+
+	if (r1->id != r2->id) {
+		return r1->id < r2->id ? -1 : 1;
+	}
+	if (r1->prio != r2->prio) {
+		return r1->prio < r2->prio ? -1 : 1;
+	}
+	return r1->pos < r2->pos ? -1 : r1->pos > r2->pos;
+}
+
+/* pass 3, new ids for the collisions, by position in the output */
+struct renum_rec {
+	uint64_t pos;
+	uint32_t id;
+	uint32_t _pad;
+};
+
+static int
+cmp_renum_rec(const void *a, const void *b)
+{
+	const struct renum_rec *r1 = a, *r2 = b;
+
+	return r1->pos < r2->pos ? -1 : r1->pos > r2->pos;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t v1 = *(const uint64_t *)a, v2 = *(const uint64_t *)b;
+
+	return v1 < v2 ? -1 : v1 > v2;
+}
+
+static void
+add_input(struct xsort *by_lid, const char *path, uint32_t prio, const struct merge_opts *opts,
+		uint64_t *seq)
+{
+	struct lid_rec rec = {};
+	struct imap_in in;
+	char jpath[4096];
+	uint64_t base_id;
+	int rc;
+
+	rc = in_open(&in, path);
+	if (rc != 0) {
+		fatal("%s: can't open: %s\n", path, strerror(-rc));
+	}
+
+	rec.prio = prio * 2;
+	base_id = in.base_id;
+	while (in_next(&in, &rec.entry)) {
+		rec.seq = (*seq)++;
+		xsort_add(by_lid, &rec);
+	}
+
+	rc = in_close(&in);
+	if (rc != 0) {
+		fatal("%s: %s\n", path, rc == -EILSEQ ? "checksum mismatch" : "truncated");
+	}
+
+	if (!opts->journals) {
+		return;
+	}
+
+	rc = in_open_journal(&in, base_id, path, jpath, sizeof(jpath));
+	if (rc == -ESTALE) {
+		fprintf(stderr, "%s: ignoring, it was written for another file\n", jpath);
+	}
+	if (rc != 0) {
+		return;
+	}
+
+	/* right after its base file, which wins any conflicts like in the loader */
+	rec.prio = prio * 2 + 1;
+	while (in_next(&in, &rec.entry)) {
+		rec.seq = (*seq)++;
+		xsort_add(by_lid, &rec);
+	}
+	if (in.torn) {
+		fprintf(stderr, "%s: ignoring a torn record after %" PRIu64 " records\n",
+				jpath, in.read);
+	}
+	in_close(&in);
+}
+
+static void
+load_keep_list(struct xsort *keep, const char *path)
+{
+	char line[256];
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		fatal("%s: can't open: %s\n", path, strerror(errno));
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		char *end;
+		uint64_t lid = strtoull(line, &end, 0);
+
+		if (end == line) {
+			continue;
+		}
+		xsort_add(keep, &lid);
+	}
+
+	fclose(fp);
+}
+
+static void
+copy_u32s(FILE *out, FILE *in, uint32_t *crc)
+{
+	char *buf = xmalloc(COPY_BUF_SIZE);
+	size_t len;
+
+	tmp_rewind(in);
+	while ((len = fread(buf, 1, COPY_BUF_SIZE, in)) > 0) {
+		*crc = pw_crc32(*crc, buf, len);
+		xwrite(out, buf, len);
+	}
+
+	free(buf);
+}
+
+/* write positions of the same id in lid order, like build_id_index() */
+static void
+flush_id_group(FILE *fp, uint64_t *group, size_t cnt)
+{
+	size_t i;
+
+	qsort(group, cnt, sizeof(*group), cmp_u64);
+	for (i = 0; i < cnt; i++) {
+		uint32_t pos = group[i];
+
+		xwrite(fp, &pos, sizeof(pos));
+	}
+}
+
+/*
+ * Merge, compact and convert are all the same pipeline:
+ * 1. all input entries are sorted by (lid, input priority) and deduplicated,
+ *    the winners are written in lid order to a temporary file,
+ * 2. the winners are sorted by id, and any id used by more than one lid
+ *    (of overlapping types) is given a new id above all the others,
+ * 3. the winners are streamed into the output, with the new ids applied,
+ *    followed by the id index for v4.
+ */
+static int
+merge_files(char **inputs, size_t input_cnt, const struct merge_opts *opts)
+{
+	struct xsort by_lid, by_id, renum, keep;
+	struct lid_rec lrec;
+	struct id_rec irec;
+	struct renum_rec rrec;
+	struct pw_idmap_file_hdr hdr = {};
+	FILE *winners, *idx_kept, *idx_renum, *out;
+	uint64_t seq = 0, pos, keep_lid = 0;
+	uint64_t dup_cnt = 0, conflict_cnt = 0, dropped_cnt = 0, renum_cnt = 0;
+	uint64_t *group = NULL;
+	size_t group_cnt = 0, group_cap = 0, i;
+	uint32_t max_id = 0, group_id = 0;
+	uint8_t types[256 / 8];
+	bool has_keep = false, untyped = false, have_rrec;
+	char out_tmp[4096];
+
+	xsort_init(&by_lid, sizeof(struct lid_rec), cmp_lid_rec);
+	for (i = 0; i < input_cnt; i++) {
+		size_t prio = opts->prefer_last ? input_cnt - 1 - i : i;
+
+		add_input(&by_lid, inputs[i], prio, opts, &seq);
+	}
+	xsort_finish(&by_lid);
+
+	if (opts->keep_path) {
+		xsort_init(&keep, sizeof(uint64_t), cmp_u64);
+		load_keep_list(&keep, opts->keep_path);
+		xsort_finish(&keep);
+		has_keep = xsort_next(&keep, &keep_lid);
+	}
+
+	/* 1. */
+	winners = tmp_open();
+	xsort_init(&by_id, sizeof(struct id_rec), cmp_id_rec);
+	pos = 0;
+	if (xsort_next(&by_lid, &lrec)) {
+		struct lid_rec win = lrec;
+
+		while (true) {
+			bool more = xsort_next(&by_lid, &lrec);
+
+			if (more && lrec.entry.lid == win.entry.lid) {
+				if (lrec.entry.id != win.entry.id || lrec.entry.type != win.entry.type) {
+					if (opts->strict) {
+						fatal("lid 0x%" PRIx64 " is mapped to both %u and %u\n",
+								win.entry.lid, win.entry.id, lrec.entry.id);
+					}
+					if (g_verbose) {
+						fprintf(stderr, "lid 0x%" PRIx64 ": keeping id %u, dropping %u\n",
+								win.entry.lid, win.entry.id, lrec.entry.id);
+					}
+					conflict_cnt++;
+				} else {
+					dup_cnt++;
+				}
+				continue;
+			}
+
+			/* win is the final entry for its lid */
+			while (opts->keep_path && has_keep && keep_lid < win.entry.lid) {
+				has_keep = xsort_next(&keep, &keep_lid);
+			}
+
+			if (opts->keep_path && (!has_keep || keep_lid != win.entry.lid)) {
+				dropped_cnt++;
+			} else {
+				memset(win.entry._reserved, 0, sizeof(win.entry._reserved));
+				xwrite(winners, &win.entry, sizeof(win.entry));
+
+				memset(&irec, 0, sizeof(irec));
+				irec.id = win.entry.id;
+				irec.type = win.entry.type;
+				irec.prio = win.prio;
+				irec.pos = pos++;
+				xsort_add(&by_id, &irec);
+
+				if (win.entry.id > max_id) {
+					max_id = win.entry.id;
+				}
+			}
+
+			if (!more) {
+				break;
+			}
+			win = lrec;
+		}
+	}
+	xsort_free(&by_lid);
+	if (opts->keep_path) {
+		xsort_free(&keep);
+	}
+
+	if (pos > UINT32_MAX) {
+		fatal("too many entries for one file (%" PRIu64 ")\n", pos);
+	}
+
+	/* 2. */
+	xsort_finish(&by_id);
+	xsort_init(&renum, sizeof(struct renum_rec), cmp_renum_rec);
+	idx_kept = tmp_open();
+	idx_renum = tmp_open();
+	while (xsort_next(&by_id, &irec)) {
+		bool collides;
+
+		if (group_cnt == 0 || irec.id != group_id) {
+			flush_id_group(idx_kept, group, group_cnt);
+			group_cnt = 0;
+			group_id = irec.id;
+			untyped = false;
+			memset(types, 0, sizeof(types));
+		}
+
+		/* same as the lookups, type 0 matches any type */
+		collides = group_cnt > 0 && (untyped || irec.type == 0 ||
+				(types[irec.type / 8] & (1 << (irec.type % 8))));
+
+		if (collides) {
+			uint32_t new_pos = irec.pos;
+
+			if (opts->strict) {
+				fatal("id %u is used by more than one lid\n", irec.id);
+			}
+
+			memset(&rrec, 0, sizeof(rrec));
+			rrec.pos = irec.pos;
+			rrec.id = ++max_id;
+			xsort_add(&renum, &rrec);
+			/* the new ids are above all others, in this order */
+			xwrite(idx_renum, &new_pos, sizeof(new_pos));
+			if (g_verbose) {
+				fprintf(stderr, "id %u is taken, entry %" PRIu64 " gets id %u\n",
+						irec.id, irec.pos, rrec.id);
+			}
+			renum_cnt++;
+			continue;
+		}
+
+		if (irec.type == 0) {
+			untyped = true;
+		}
+		types[irec.type / 8] |= 1 << (irec.type % 8);
+
+		if (group_cnt == group_cap) {
+			group_cap = group_cap ? group_cap * 2 : 16;
+			group = realloc(group, group_cap * sizeof(*group));
+			if (!group) {
+				fatal("out of memory\n");
+			}
+		}
+		group[group_cnt++] = irec.pos;
+	}
+	flush_id_group(idx_kept, group, group_cnt);
+	xsort_free(&by_id);
+	free(group);
+	xsort_finish(&renum);
+
+	/* 3. */
+	snprintf(out_tmp, sizeof(out_tmp), "%s.tmp", opts->out);
+	out = fopen(out_tmp, "wb");
+	if (!out) {
+		fatal("%s: can't create: %s\n", out_tmp, strerror(errno));
+	}
+
+	hdr.version = opts->out_version;
+	hdr.entry_size = sizeof(struct pw_idmap_file_entry);
+	hdr.count = pos;
+	hdr.base_id = pw_idmap_new_base_id(hdr.count);
+	if (opts->out_version == PW_IDMAP_VERSION) {
+		/* the checksum is filled in at the end */
+		xwrite(out, &hdr, sizeof(hdr));
+	} else {
+		xwrite(out, &hdr.version, sizeof(hdr.version));
+	}
+
+	tmp_rewind(winners);
+	have_rrec = xsort_next(&renum, &rrec);
+	for (pos = 0; pos < hdr.count; pos++) {
+		struct pw_idmap_file_entry entry;
+
+		if (!xread(winners, &entry, sizeof(entry))) {
+			fatal("temporary file: short read\n");
+		}
+
+		if (have_rrec && rrec.pos == pos) {
+			entry.id = rrec.id;
+			have_rrec = xsort_next(&renum, &rrec);
+		}
+
+		hdr.crc = pw_crc32(hdr.crc, &entry, sizeof(entry));
+		xwrite(out, &entry, sizeof(entry));
+	}
+	xsort_free(&renum);
+	fclose(winners);
+
+	if (opts->out_version == PW_IDMAP_VERSION) {
+		copy_u32s(out, idx_kept, &hdr.crc);
+		copy_u32s(out, idx_renum, &hdr.crc);
+		if (fseek(out, 0, SEEK_SET) != 0) {
+			fatal("%s: %s\n", out_tmp, strerror(errno));
+		}
+		xwrite(out, &hdr, sizeof(hdr));
+	}
+	fclose(idx_kept);
+	fclose(idx_renum);
+
+	if (fclose(out) != 0) {
+		fatal("%s: %s\n", out_tmp, strerror(errno));
+	}
+	if (rename(out_tmp, opts->out) != 0) {
+		fatal("can't rename %s to %s: %s\n", out_tmp, opts->out, strerror(errno));
+	}
+
+	/* a journal of the replaced file has a different base_id now, it would
+	 * only be ignored. Any of its records that were wanted are in the output */
+	snprintf(out_tmp, sizeof(out_tmp), "%s.journal", opts->out);
+	if (remove(out_tmp) == 0) {
+		fprintf(stderr, "%s: removed, it was written for the replaced file\n", out_tmp);
+	}
+
+	fprintf(stderr, "%s: %" PRIu64 " entries read, %u written (v%u), %" PRIu64 " duplicates, "
+			"%" PRIu64 " lid conflicts, %" PRIu64 " renumbered ids, %" PRIu64 " not kept\n",
+			opts->out, seq, hdr.count, opts->out_version, dup_cnt, conflict_cnt,
+			renum_cnt, dropped_cnt);
+	return 0;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"usage: imaptool <command> [options] <file>...\n"
+		"  dump [-j] <file>                 print all entries (-j: and the journal)\n"
+		"  check <file>                     load the file like the game does and compare\n"
+		"  merge -o <out> <file>...         merge files, the first one wins any conflicts\n"
+		"      -p first|last                which file wins the conflicts\n"
+		"      -s                           fail on any conflict instead\n"
+		"  compact -o <out> <file>          fold the journal in, drop duplicates\n"
+		"      -k <lids.txt>                also drop any lid not listed in the file\n"
+		"  convert -o <out> -v 3|4 <file>   write in the given format version\n"
+		"common options:\n"
+		"  -J                               ignore the journals\n"
+		"  -m <MB>                          memory for sorting, %d by default\n"
+		"  -t <dir>                         directory for temporary files\n"
+		"  -V                               verbose\n", DEFAULT_MEM_MB);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct merge_opts opts = {};
+	const char *cmd;
+	bool journal = false;
+	int opt;
+
+	if (argc < 2) {
+		usage();
+	}
+
+	cmd = argv[1];
+	argc--;
+	argv++;
+
+	opts.journals = true;
+	opts.out_version = PW_IDMAP_VERSION;
+	g_tmpdir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+
+	while ((opt = getopt(argc, argv, "o:p:sk:v:m:t:jJV")) != -1) {
+		switch (opt) {
+		case 'o':
+			opts.out = optarg;
+			break;
+		case 'p':
+			if (strcmp(optarg, "first") != 0 && strcmp(optarg, "last") != 0) {
+				usage();
+			}
+			opts.prefer_last = strcmp(optarg, "last") == 0;
+			break;
+		case 's':
+			opts.strict = true;
+			break;
+		case 'k':
+			opts.keep_path = optarg;
+			break;
+		case 'v':
+			opts.out_version = atoi(optarg);
+			if (opts.out_version != PW_IDMAP_VERSION &&
+					opts.out_version != PW_IDMAP_VERSION_V3) {
+				usage();
+			}
+			break;
+		case 'm':
+			g_mem_bytes = (size_t)atoi(optarg) << 20;
+			if (g_mem_bytes == 0) {
+				usage();
+			}
+			break;
+		case 't':
+			g_tmpdir = optarg;
+			break;
+		case 'j':
+			journal = true;
+			break;
+		case 'J':
+			opts.journals = false;
+			break;
+		case 'V':
+			g_verbose = true;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (strcmp(cmd, "dump") == 0) {
+		return cmd_dump(argc, argv, journal);
+	} else if (strcmp(cmd, "check") == 0) {
+		return cmd_check(argc, argv);
+	}
+
+	if (!opts.out || argc < 1) {
+		usage();
+	}
+
+	if (strcmp(cmd, "merge") == 0) {
+		return merge_files(argv, argc, &opts);
+	} else if (strcmp(cmd, "compact") == 0 || strcmp(cmd, "convert") == 0) {
+		if (argc != 1) {
+			usage();
+		}
+		return merge_files(argv, 1, &opts);
+	}
+
+	usage();
+	return 1;
+}
@@ -0,0 +1,152 @@
+#!/bin/bash
+# Runs imaptool on the files in test/ and compares the results.
+# The fixtures are text (lid id type per line), turned into .imap files here.
+
+cd "$(dirname "$0")"
+make -s || exit 1
+
+TOOL=$PWD/build/imaptool
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+fails=0
+
+# a v3 file: the version, then struct pw_idmap_file_entry[]
+imap_v3() {
+    perl -e 'print pack("V", 3);
+        while (<>) {
+            s/#.*//;
+            my ($lid, $id, $type) = split;
+            next unless defined $type;
+            print pack("Q<VCx3", hex($lid), $id, $type);
+        }' "$1" > "$2"
+}
+
+# struct pw_idmap_journal_hdr with the base_id of the given v4 file,
+# then struct pw_idmap_journal_rec[], with the crc of each
+imap_journal() {
+    perl -MCompress::Zlib -e '
+        open(my $base, "<:raw", shift) or die;
+        read($base, my $hdr, 24) == 24 or die;
+        print pack("VV", 0x484a4d49, 0), substr($hdr, 16, 8);
+        while (<>) {
+            s/#.*//;
+            my ($lid, $id, $type) = split;
+            next unless defined $type;
+            my $rec = pack("VVQ<Cx3", 0x4a4d4449, $id, hex($lid), $type);
+            print $rec, pack("V", crc32($rec));
+        }' "$3" "$1" > "$2"
+}
+
+not() {
+    ! "$@"
+}
+
+entries() {
+    "$TOOL" dump "$@" | grep -v '^#'
+}
+
+expect() {
+    local name=$1
+    shift
+
+    if "$@" > "$DIR/out" 2> "$DIR/err" && diff -u "test/$name" "$DIR/out"; then
+        echo "ok $name"
+    else
+        echo "FAIL $name"
+        cat "$DIR/err"
+        fails=$((fails + 1))
+    fi
+}
+
+check() {
+    local name=$1
+    shift
+
+    if "$@" > "$DIR/err" 2>&1; then
+        echo "ok $name"
+    else
+        echo "FAIL $name"
+        cat "$DIR/err"
+        fails=$((fails + 1))
+    fi
+}
+
+# only a v4 file can have a journal
+imap_v3 test/a.txt "$DIR/a3.imap"
+"$TOOL" convert -v 4 -o "$DIR/a.imap" "$DIR/a3.imap" 2> /dev/null
+imap_journal test/a.journal.txt "$DIR/a.imap.journal" "$DIR/a.imap"
+imap_v3 test/b.txt "$DIR/b.imap"
+
+"$TOOL" merge -o "$DIR/merge.imap" "$DIR/a.imap" "$DIR/b.imap" 2> /dev/null
+expect merge.expected entries "$DIR/merge.imap"
+check merge-check "$TOOL" check "$DIR/merge.imap"
+
+"$TOOL" merge -p last -o "$DIR/last.imap" "$DIR/a.imap" "$DIR/b.imap" 2> /dev/null
+expect merge_last.expected entries "$DIR/last.imap"
+check merge-last-check "$TOOL" check "$DIR/last.imap"
+
+check merge-strict not "$TOOL" merge -s -o "$DIR/strict.imap" "$DIR/a.imap" "$DIR/b.imap"
+check merge-strict-no-output test ! -e "$DIR/strict.imap"
+
+"$TOOL" compact -k test/keep.txt -o "$DIR/keep.imap" "$DIR/a.imap" 2> /dev/null
+expect compact_keep.expected entries "$DIR/keep.imap"
+
+"$TOOL" compact -J -o "$DIR/nojournal.imap" "$DIR/a.imap" 2> /dev/null
+expect compact_nojournal.expected entries "$DIR/nojournal.imap"
+
+# v4 -> v3 -> v4 gives the same file, except for the base_id
+"$TOOL" convert -v 3 -o "$DIR/v3.imap" "$DIR/merge.imap" 2> /dev/null
+"$TOOL" convert -v 4 -o "$DIR/v4.imap" "$DIR/v3.imap" 2> /dev/null
+expect merge.expected entries "$DIR/v3.imap"
+check convert-round-trip cmp -i 24 "$DIR/merge.imap" "$DIR/v4.imap"
+check convert-base-id not cmp -s "$DIR/merge.imap" "$DIR/v4.imap"
+
+# a journal written for another base file is ignored, like the loader does
+"$TOOL" convert -J -v 4 -o "$DIR/other.imap" "$DIR/a.imap" 2> /dev/null
+cp "$DIR/a.imap.journal" "$DIR/other.imap.journal"
+check dump-stale grep -q 'written for another file' <("$TOOL" dump -j "$DIR/other.imap")
+"$TOOL" compact -o "$DIR/other2.imap" "$DIR/other.imap" 2> /dev/null
+expect compact_nojournal.expected entries "$DIR/other2.imap"
+
+# a torn journal record is ignored, like the loader does
+printf 'torn' >> "$DIR/a.imap.journal"
+check dump-torn grep -q '^# torn record after 2 records' <("$TOOL" dump -j "$DIR/a.imap")
+"$TOOL" compact -k test/keep.txt -o "$DIR/keep.imap" "$DIR/a.imap" 2> /dev/null
+expect compact_keep.expected entries "$DIR/keep.imap"
+
+# a flipped byte in a v4 file is caught by the crc
+cp "$DIR/merge.imap" "$DIR/bad.imap"
+printf '\x7f' | dd of="$DIR/bad.imap" bs=1 seek=28 conv=notrunc 2> /dev/null
+check dump-crc not "$TOOL" dump "$DIR/bad.imap"
+check merge-crc not "$TOOL" merge -o "$DIR/bad2.imap" "$DIR/bad.imap"
+
+# overwriting a base file removes its journal, it's folded in or unwanted
+cp "$DIR/a.imap" "$DIR/c.imap"
+cp "$DIR/a.imap.journal" "$DIR/c.imap.journal"
+"$TOOL" compact -k test/keep.txt -o "$DIR/c.imap" "$DIR/c.imap" 2> /dev/null
+expect compact_keep.expected entries "$DIR/c.imap"
+check compact-in-place-journal test ! -e "$DIR/c.imap.journal"
+cp "$DIR/a.imap" "$DIR/c.imap"
+cp "$DIR/a.imap.journal" "$DIR/c.imap.journal"
+"$TOOL" convert -J -v 4 -o "$DIR/c.imap" "$DIR/c.imap" 2> /dev/null
+expect compact_nojournal.expected entries -j "$DIR/c.imap"
+check convert-in-place-journal test ! -e "$DIR/c.imap.journal"
+
+# enough entries for more sorted runs with -m 1 than are merged at once
+# (XSORT_MAX_FANIN), so it takes several passes. And to renumber a lot
+perl -e 'for my $i (0 .. 799999) {
+        printf "0x%x %u %u\n", 0x80000000 + ($i * 7919) % 750000, ($i * 104729) % 600000 + 1, $i % 3;
+    }' > "$DIR/big.txt"
+imap_v3 "$DIR/big.txt" "$DIR/big.imap"
+"$TOOL" merge -o "$DIR/big1.imap" "$DIR/big.imap" "$DIR/merge.imap" 2> /dev/null
+"$TOOL" merge -V -m 1 -t "$DIR" -o "$DIR/big2.imap" "$DIR/big.imap" "$DIR/merge.imap" \
+    2> "$DIR/big2.err"
+check big-passes grep -q 'in several passes' "$DIR/big2.err"
+check big-runs cmp -i 24 "$DIR/big1.imap" "$DIR/big2.imap"
+check big-check "$TOOL" check "$DIR/big1.imap"
+
+if [[ $fails -ne 0 ]]; then
+    echo "$fails failed"
+    exit 1
+fi
+echo "imaptool ok"
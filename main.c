@@ -379,6 +379,20 @@ static wchar_t *g_proc_type_name[] = {
 	L"Unrepairable"
 };
 
+static int g_item_desc_cache_kb;
+CSH_REGISTER_VAR_I("item_desc_cache_kb", &g_item_desc_cache_kb, 2048);
+CSH_REGISTER_VAR_CALLBACK("item_desc_cache_kb")(void)
+{
+	pw_item_desc_set_wstr_budget((size_t)g_item_desc_cache_kb * 1024);
+}
+
+static bool g_item_desc_prewarm;
+CSH_REGISTER_VAR_B("item_desc_prewarm", &g_item_desc_prewarm, true);
+
+/* less memory for a slower startup, only read at startup */
+static bool g_item_desc_dedup;
+CSH_REGISTER_VAR_B("item_desc_dedup", &g_item_desc_dedup, false);
+
 static void __fastcall
 hooked_item_add_ext_desc(void *item)
 {
@@ -388,12 +402,17 @@ hooked_item_add_ext_desc(void *item)
 	bool sep_printed = false;
 
 	entry = pw_item_desc_get(id);
-	if (entry && *(wchar_t *)entry->aux != 0) {
-		if (!sep_printed) {
-			pw_item_desc_add_wstr(item + 0x44, L"\r\r");
-			//sep_printed = true;
+	if (entry && entry->len > 0) {
+		/* copied by the game right away, so it can be evicted later */
+		const wchar_t *wstr = pw_item_desc_get_wstr(entry);
+
+		if (wstr) {
+			if (!sep_printed) {
+				pw_item_desc_add_wstr(item + 0x44, L"\r\r");
+				//sep_printed = true;
+			}
+			pw_item_desc_add_wstr(item + 0x44, (wchar_t *)wstr);
 		}
-		pw_item_desc_add_wstr(item + 0x44, entry->aux);
 	} else if (!entry) {
 		pw_item_add_ext_desc(item);
 	}
@@ -495,31 +514,6 @@ hooked_fseek(FILE *fp, int32_t off, int32_t mode)
 	return _fseeki64(fp, loff, mode);
 }
 
-static void
-item_desc_avl_wchar_fn(void *el, void *ctx1, void *ctx2)
-{
-	struct pw_avl_node *node = el;
-	struct pw_item_desc_entry *entry = (void *)node->data;
-	wchar_t *wstr;
-	size_t i, max_chars = entry->len * 1 + 16;
-
-	wstr = entry->aux = malloc(max_chars * sizeof(wchar_t));
-	if (!wstr) {
-		assert(false);
-		return;
-	}
-
-	snwprintf((wchar_t *)entry->aux, max_chars + 1, L"%S", entry->desc);
-	while (*wstr) {
-		if (*wstr == '\\' && *(wstr + 1) == 'n') {
-			*wstr = '\r';
-			*(wstr + 1) = '\n';
-			*wstr++;
-		}
-		*wstr++;
-	}
-}
-
 static int g_pending_skill_id;
 static unsigned char g_skill_pvp_mask;
 static int g_skill_target_id;
@@ -626,6 +620,11 @@ hooked_get_recipe_to_display(void *this, int unk1, char unk2)
 		return NULL;
 	}
 
+	/* its tooltip is likely to be shown next */
+	if (g_item_desc_prewarm) {
+		pw_item_desc_prewarm(&tgt_id, 1);
+	}
+
 	return recipe;
 }
 
@@ -873,6 +872,7 @@ init_hooks(void)
 	g_game_thr_queue = ring_buffer_sp_sc_new(32);
 	assert(g_game_thr_queue != NULL);
 
+	pw_item_desc_set_dedup(g_item_desc_dedup);
 	rc = pw_item_desc_load("..\\patcher\\item_desc.data");
 	if (rc != 0) {
 		MessageBox(NULL, "Failed to load item description from patcher/item_desc.data",
@@ -880,7 +880,8 @@ init_hooks(void)
 		return rc;
 	}
 
-	pw_avl_foreach(g_pw_item_desc_avl, item_desc_avl_wchar_fn, NULL, NULL);
+	/* the wide strings are converted lazily, see hooked_item_add_ext_desc() */
+	pw_item_desc_set_wstr_budget((size_t)g_item_desc_cache_kb * 1024);
 
 	g_elements_map = pw_idmap_init("elements", "..\\patcher\\elements.imap", false);
 	if (!g_elements_map) {
@@ -6,22 +6,174 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
 #include <errno.h>
+#include <wchar.h>
+#include <time.h>
+#include <zlib.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
 
 #include "avl.h"
+#include "crc.h"
+#include "hashmap.h"
 #include "pw_item_desc.h"
 
+#define ITEM_DESC_MAGIC 0x7ab30e1f
+#define ITEM_DESC_VERSION 1
+#define ITEM_DESC_VERSION_Z 2
+#define ITEM_DESC_POOL_CHUNK_SIZE 1024
+#define ITEM_DESC_ARENA_CHUNK_SIZE (64 * 1024)
+#define ITEM_DESC_WSTR_DEF_BUDGET (2 * 1024 * 1024)
+#define ITEM_DESC_PREWARM_QUEUE_SIZE 256
+/* uncompressed size a block is closed at, bigger descriptions get their own */
+#define ITEM_DESC_BLOCK_SIZE 4096
+#define ITEM_DESC_BLOCK_MAX_SIZE (16 * 1024 * 1024)
+#define ITEM_DESC_BLOCK_CACHE_SIZE 16
+/* direct index, a top-level array of leaves with 1024 entries each */
+#define ITEM_DESC_DIR_LEAF_BITS 10
+#define ITEM_DESC_DIR_LEAF_SIZE (1u << ITEM_DESC_DIR_LEAF_BITS)
+/* bigger ids are only in the tree */
+#define ITEM_DESC_DIR_MAX_ID (1u << 24)
+#define ITEM_DESC_TAIL_MAGIC 0x9d4c2e72
+#define ITEM_DESC_JOURNAL_MAGIC 0x6a5e1d0d
+#define ITEM_DESC_JOURNAL_REC_MAGIC 0x72ec0d1a
+/* rewrite the whole file once the journal is this big... */
+#define ITEM_DESC_JOURNAL_COMPACT_MIN (64 * 1024)
+/* ...or bigger than 1/N of the file */
+#define ITEM_DESC_JOURNAL_COMPACT_RATIO 4
+/* stdio buffer of a full save, the entries are written a few bytes at a time */
+#define ITEM_DESC_SAVE_BUF_SIZE (1024 * 1024)
+
+/* strings of pw_item_desc_set() and struct pw_item_desc_str, bump-allocated
+ * and never freed one by one */
+struct item_desc_arena_chunk {
+	struct item_desc_arena_chunk *next;
+	size_t size;
+	size_t used;
+	char data[0];
+};
+
+/* decompressed block, see block_get() */
+struct item_desc_block_slot {
+	char *buf; /* NULL if unused */
+	size_t cap;
+	uint32_t block;
+	uint32_t last_use;
+};
+
+/* UTF-16 form of a description, cached on first use */
+struct pw_item_desc_wstr {
+	/* LRU list, the most recently used first */
+	struct pw_item_desc_wstr *prev;
+	struct pw_item_desc_wstr *next;
+	struct pw_item_desc_str *owner;
+	size_t size;
+	wchar_t str[0];
+};
+
+/* description text, shared by all the entries with identical one */
+struct pw_item_desc_str {
+	uint32_t refcnt;
+	uint32_t len;
+	uint32_t hash; /* see str_hash(), 0 if not in g_state.strs */
+	/* NULL if it's still in a compressed block */
+	char *desc;
+	uint32_t zblock;
+	uint32_t zoff;
+	union {
+		struct pw_item_desc_wstr *wstr; /* see pw_item_desc_get_wstr() */
+		struct pw_item_desc_str *next_free; /* once unused */
+	};
+	/* already written by the save with this number, at the given place */
+	uint32_t save_gen;
+	uint32_t save_block;
+	uint32_t save_off;
+};
+
 static struct pw_item_desc_state {
 	char *filename;
 	struct pw_avl *avl;
-} g_state;
+	/* the whole file as loaded, the strings point into it. Freed if they
+	 * were copied out instead, see compact_raw() */
+	char *file_buf;
+	struct item_desc_arena_chunk *arena;
+	/* all the strings that aren't in a compressed block, by their text */
+	struct pw_hashmap *strs;
+	struct pw_item_desc_str *str_free;
+	uint32_t save_gen;
+	/* every entry with id < dir_cnt * ITEM_DESC_DIR_LEAF_SIZE is in there,
+	 * so the tree is only searched for bigger (or negative) ids */
+	struct pw_item_desc_entry ***dir;
+	uint32_t dir_cnt;
+	/* the above stopped being complete, e.g. after an allocation failure */
+	bool dir_disabled;
+	/* format of the next save, initially the same as loaded */
+	bool compressed;
+	/* see pw_item_desc_set_dedup() */
+	bool dedup;
+	/* only for compressed files, all the blocks stay compressed in
+	 * file_buf and just the recently used are decompressed */
+	struct pw_item_desc_zblock *zblocks;
+	uint32_t zblock_cnt;
+	struct item_desc_block_slot block_cache[ITEM_DESC_BLOCK_CACHE_SIZE];
+	uint32_t block_tick;
 
-struct pw_avl *g_pw_item_desc_avl;
+	/* taken by the pre-warm thread, and by anything that modifies the
+	 * tree or the wstr cache while that thread may be running */
+#ifdef _WIN32
+	CRITICAL_SECTION lock;
+#else
+	pthread_mutex_t lock;
+#endif
+	struct pw_item_desc_wstr *lru_head;
+	struct pw_item_desc_wstr *lru_tail;
+	size_t wstr_bytes;
+	size_t wstr_budget;
+	uint32_t prewarm_ids[ITEM_DESC_PREWARM_QUEUE_SIZE];
+	unsigned prewarm_cnt;
+	/* there's something queued, or being converted right now */
+	bool prewarm_running;
+	/* the worker is started once and then waits for more ids */
+	bool prewarm_started;
+	bool prewarm_quit;
+#ifdef _WIN32
+	HANDLE prewarm_thr;
+	HANDLE prewarm_event;
+#else
+	pthread_t prewarm_thr;
+	pthread_cond_t prewarm_cond;
+#endif
 
-static const char *g_empty_str = "";
+	/* the file on disk plus the journal are what was loaded (or last
+	 * saved), so the next save can just append to the journal. Otherwise
+	 * it rewrites the whole file */
+	bool can_append;
+	bool base_compressed;
+	uint64_t base_id; /* see struct pw_item_desc_tail, 0 if there's none */
+	size_t base_size;
+	size_t journal_size;
+	/* ids set since the last save, possibly repeated */
+	int *dirty;
+	size_t dirty_cnt;
+	size_t dirty_cap;
+} g_state = {
+	.wstr_budget = ITEM_DESC_WSTR_DEF_BUDGET,
+};
 
-#define ITEM_DESC_MAGIC 0x7ab30e1f
-#define ITEM_DESC_VERSION 1
+struct pw_avl *g_pw_item_desc_avl;
+
+/* not refcounted, never freed */
+static struct pw_item_desc_str g_empty_str = {
+	.refcnt = 1,
+	.desc = "",
+};
 
 struct pw_item_desc_hdr {
 	uint32_t magic;
@@ -35,163 +187,2589 @@ struct pw_item_desc_file_entry {
 	char desc[0];
 };
 
-int
-pw_item_desc_load(const char *filepath)
+/*
+ * Compressed file layout (ITEM_DESC_VERSION_Z):
+ *  - struct pw_item_desc_hdr
+ *  - struct pw_item_desc_zhdr
+ *  - zlib-compressed blocks, each one a few null-terminated descriptions
+ *    concatenated together, in id order
+ *  - struct pw_item_desc_zentry[count], sorted by id
+ *  - struct pw_item_desc_zblock[block_cnt]
+ */
+struct pw_item_desc_zhdr {
+	uint32_t block_cnt;
+	uint32_t index_off;
+	uint32_t blocks_off;
+	uint32_t _reserved;
+};
+
+struct pw_item_desc_zentry {
+	uint32_t id;
+	uint32_t len;
+	uint32_t block;
+	uint32_t off; /**< within the decompressed block */
+};
+
+struct pw_item_desc_zblock {
+	uint32_t file_off;
+	uint32_t zsize;
+	uint32_t size; /**< decompressed */
+};
+
+/*
+ * At the very end of both formats, ignored by older versions. It tells
+ * which file <filename>.journal was written for, so a journal that's left
+ * over after the file was replaced (by a crash right after a save, or by
+ * the patcher) isn't applied on top of different data. base_id is random
+ * for each save and never 0, a file without the tail has no journal.
+ */
+struct pw_item_desc_tail {
+	uint32_t magic;
+	uint32_t reserved;
+	uint64_t base_id;
+};
+
+/*
+ * <filename>.journal is a struct pw_item_desc_journal_hdr followed by
+ * records of the pw_item_desc_set() calls made after the file was written.
+ */
+struct pw_item_desc_journal_hdr {
+	uint32_t magic;
+	uint32_t reserved;
+	uint64_t base_id; /**< the same as in struct pw_item_desc_tail */
+};
+
+struct pw_item_desc_journal_rec {
+	uint32_t magic;
+	uint32_t id;
+	uint32_t len;
+	uint32_t crc; /**< pw_crc32() of the above, then the description */
+	/* followed by the null-terminated description */
+};
+
+static int replay_journal(void);
+
+static char *
+arena_alloc(size_t size)
 {
-	struct pw_item_desc_hdr hdr;
-	struct pw_item_desc_entry *entry;
-	int i, rc = 0;
+	struct item_desc_arena_chunk *chunk = g_state.arena;
+	char *ret;
 
-	g_state.filename = strdup(filepath);
-	if (!g_state.filename) {
-		return -ENOMEM;
+	if (!chunk || chunk->size - chunk->used < size) {
+		size_t chunk_size = size > ITEM_DESC_ARENA_CHUNK_SIZE ? size : ITEM_DESC_ARENA_CHUNK_SIZE;
+
+		chunk = malloc(sizeof(*chunk) + chunk_size);
+		if (!chunk) {
+			return NULL;
+		}
+
+		chunk->size = chunk_size;
+		chunk->used = 0;
+		chunk->next = g_state.arena;
+		g_state.arena = chunk;
 	}
 
-	g_state.avl = g_pw_item_desc_avl = pw_avl_init(sizeof(struct pw_item_desc_entry));
-	if (!g_state.avl) {
-		free(g_state.filename);
-		return -ENOMEM;
+	ret = chunk->data + chunk->used;
+	chunk->used += size;
+	return ret;
+}
+
+static struct pw_item_desc_str *
+str_alloc(void)
+{
+	struct item_desc_arena_chunk *chunk = g_state.arena;
+	struct pw_item_desc_str *str = g_state.str_free;
+
+	if (str) {
+		g_state.str_free = str->next_free;
+		return str;
 	}
 
-	FILE *fp = fopen(filepath, "rb");
-	if (!fp) {
-		/* no problem, we'll create this file later */
-		return 0;
+	/* the strings in between are unaligned, chunk->data itself is */
+	if (chunk) {
+		chunk->used = (chunk->used + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+		if (chunk->used > chunk->size) {
+			chunk->used = chunk->size;
+		}
 	}
 
-	fread(&hdr, sizeof(hdr), 1, fp);
+	return (void *)arena_alloc(sizeof(*str));
+}
 
-	if (hdr.magic != ITEM_DESC_MAGIC) {
-		/* fail because we don't want to override this file later on */
-		rc = -EIO;
-		goto out;
+/*
+ * Content hash for g_state.strs. The descriptions are a few hundred bytes
+ * each, so hash 8 of them at a time, pw_hashmap_hash() goes byte by byte.
+ */
+static uint32_t
+str_hash(const char *desc, size_t len)
+{
+	uint64_t h = len * 0x9e3779b97f4a7c15ull, w;
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&w, desc + i, 8);
+		h = (h ^ w) * 0xff51afd7ed558ccdull;
+		h ^= h >> 29;
 	}
 
-	if (hdr.ver != ITEM_DESC_VERSION) {
-		rc = 0;
-		goto out;
+	w = 0;
+	memcpy(&w, desc + i, len - i);
+	h = (h ^ w) * 0xc4ceb9fe1a85ec53ull;
+	h ^= h >> 32;
+
+	/* 0 marks an empty slot */
+	return (uint32_t)h ? (uint32_t)h : 1;
+}
+
+/* with hash = 0 it's not found by lookups, i.e. not shared any further */
+static struct pw_item_desc_str *
+str_new(char *desc, uint32_t len, uint32_t hash)
+{
+	struct pw_item_desc_str *str = str_alloc();
+
+	if (!str) {
+		return NULL;
 	}
 
-	for (i = 0; i < hdr.count; i++) {
+	memset(str, 0, sizeof(*str));
+	str->refcnt = 1;
+	str->len = len;
+	str->desc = desc;
+	/* if that fails it's just not shared */
+	if (hash && pw_hashmap_set_hashed(g_state.strs, desc, hash, str) == 0) {
+		str->hash = hash;
+	}
+
+	return str;
+}
+
+static int
+read_file(FILE *fp, char **buf_p, size_t *size_p)
+{
+	long size;
+	char *buf;
+
+	if (fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < 0 ||
+			fseek(fp, 0, SEEK_SET) != 0) {
+		return -EIO;
+	}
+
+	buf = malloc(size ? size : 1);
+	if (!buf) {
+		return -ENOMEM;
+	}
+
+	if (size && fread(buf, size, 1, fp) != 1) {
+		free(buf);
+		return -EIO;
+	}
+
+	*buf_p = buf;
+	*size_p = size;
+	return 0;
+}
+
+static int
+parse_raw(char *buf, size_t size, uint32_t count, uint64_t *keys, void **entries, int *parsed,
+		size_t *dup_bytes)
+{
+	struct pw_item_desc_entry *entry;
+	struct pw_item_desc_str *str;
+	size_t off = sizeof(struct pw_item_desc_hdr);
+	uint32_t hash;
+	int i;
+
+	for (i = 0; i < count; i++) {
 		struct pw_item_desc_file_entry file_entry;
 
-		entry = pw_avl_alloc(g_state.avl);
+		if (size - off < sizeof(file_entry)) {
+			return -EIO;
+		}
+
+		/* the entries are packed, so not necessarily aligned */
+		memcpy(&file_entry, buf + off, sizeof(file_entry));
+		off += sizeof(file_entry);
+
+		/* expect it to be null-terminated */
+		if (size - off < (size_t)file_entry.len + 1 || buf[off + file_entry.len] != 0) {
+			return -EIO;
+		}
+
+		if (g_state.dedup) {
+			/* the len of old files can include trimmed newlines, so those
+			 * don't match the same text saved later on */
+			hash = str_hash(buf + off, file_entry.len);
+			str = pw_hashmap_get_hashed(g_state.strs, buf + off, hash);
+			if (str && str->len == file_entry.len) {
+				str->refcnt++;
+				*dup_bytes += file_entry.len + 1;
+			} else {
+				str = str_new(buf + off, file_entry.len, str ? 0 : hash);
+			}
+		} else {
+			str = str_new(buf + off, file_entry.len, 0);
+		}
+
+		entry = str ? pw_avl_alloc(g_state.avl) : NULL;
 		if (!entry) {
-			rc = -ENOMEM;
-			goto out;
+			return -ENOMEM;
 		}
 
-		fread(&file_entry, sizeof(file_entry), 1, fp);
 		entry->id = file_entry.id;
 		entry->len = file_entry.len;
-		entry->desc = malloc(entry->len + 1);
-		if (!entry->desc) {
-			rc = -ENOMEM;
-			goto out;
-		}
+		entry->str = str;
+		off += file_entry.len + 1;
 
-		/* expect it to be null-terminated */
-		fread(entry->desc, entry->len + 1, 1, fp);
-		pw_avl_insert(g_state.avl, entry->id, entry);
+		keys[i] = entry->id;
+		entries[i] = entry;
+		*parsed = i + 1;
 	}
 
-	rc = 0;
-out:
-	fclose(fp);
-	return rc;
+	return 0;
 }
 
-struct pw_item_desc_entry *
-pw_item_desc_get(int id)
+static int
+str_loc_cmp(struct pw_item_desc_str *str, uint32_t block, uint32_t off)
 {
-	struct pw_item_desc_entry *entry;
+	if (str->zblock != block) {
+		return str->zblock < block ? -1 : 1;
+	}
+	return str->zoff < off ? -1 : str->zoff > off;
+}
+
+/* entries with identical text point to the same place in a block */
+static struct pw_item_desc_str *
+parse_z_str(struct pw_item_desc_str **strs, uint32_t *str_cnt, struct pw_item_desc_zentry *zentry)
+{
+	struct pw_item_desc_str *str;
+	uint32_t lo = 0, hi = *str_cnt;
+	/* files we write have the new places in increasing order, so strs
+	 * stays sorted. Anything else is just not shared */
+	bool append = hi == 0 || str_loc_cmp(strs[hi - 1], zentry->block, zentry->off) < 0;
 
-	entry = pw_avl_get(g_state.avl, id);
-	while (entry && entry->id != id) {
-		entry = pw_avl_get_next(g_state.avl, entry);
+	while (!append && lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		int cmp = str_loc_cmp(strs[mid], zentry->block, zentry->off);
+
+		if (cmp == 0) {
+			if (strs[mid]->len != zentry->len) {
+				break;
+			}
+			strs[mid]->refcnt++;
+			return strs[mid];
+		}
+
+		if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
 	}
 
-	return entry;
+	str = str_new(NULL, zentry->len, 0);
+	if (!str) {
+		return NULL;
+	}
+
+	str->zblock = zentry->block;
+	str->zoff = zentry->off;
+	if (append) {
+		strs[(*str_cnt)++] = str;
+	}
+	return str;
 }
 
-int
-pw_item_desc_set(int id, const char *desc)
+static int
+parse_z(char *buf, size_t size, uint32_t count, uint64_t *keys, void **entries, int *parsed)
 {
+	struct pw_item_desc_zhdr zhdr;
+	struct pw_item_desc_zentry zentry;
 	struct pw_item_desc_entry *entry;
+	struct pw_item_desc_str *str, **strs;
+	size_t off = sizeof(struct pw_item_desc_hdr);
+	uint32_t i, str_cnt = 0;
+	int rc = 0;
 
-	entry = pw_item_desc_get(id);
-	if (!entry) {
-		entry = pw_avl_alloc(g_state.avl);
-		if (!entry) {
-			return -ENOMEM;
-		}
+	if (size - off < sizeof(zhdr)) {
+		return -EIO;
+	}
+	memcpy(&zhdr, buf + off, sizeof(zhdr));
 
-		entry->id = id;
+	if (zhdr.index_off > size || (size - zhdr.index_off) / sizeof(zentry) < count ||
+			zhdr.blocks_off > size || (size - zhdr.blocks_off) /
+				sizeof(struct pw_item_desc_zblock) < zhdr.block_cnt) {
+		return -EIO;
+	}
 
-		pw_avl_insert(g_state.avl, id, entry);
-	} else {
-		if (entry->desc != g_empty_str) {
-			free(entry->desc);
+	g_state.zblocks = malloc(zhdr.block_cnt * sizeof(*g_state.zblocks) + 1);
+	if (!g_state.zblocks) {
+		return -ENOMEM;
+	}
+	memcpy(g_state.zblocks, buf + zhdr.blocks_off, zhdr.block_cnt * sizeof(*g_state.zblocks));
+	g_state.zblock_cnt = zhdr.block_cnt;
+
+	for (i = 0; i < zhdr.block_cnt; i++) {
+		struct pw_item_desc_zblock *zblock = &g_state.zblocks[i];
+
+		if (zblock->file_off > size || size - zblock->file_off < zblock->zsize ||
+				zblock->size == 0 || zblock->size > ITEM_DESC_BLOCK_MAX_SIZE) {
+			return -EIO;
 		}
 	}
 
-	if (!desc) {
-		entry->desc = (char *)g_empty_str;
-		entry->len = 0;
-	} else {
-		int i;
+	strs = malloc(count * sizeof(*strs) + 1);
+	if (!strs) {
+		return -ENOMEM;
+	}
 
-		entry->len = strlen(desc);
-		entry->desc = strdup(desc);
-		if (!entry->desc) {
-			entry->desc = (char *)g_empty_str;
-			return -ENOMEM;
+	for (i = 0; i < count; i++) {
+		memcpy(&zentry, buf + zhdr.index_off + i * sizeof(zentry), sizeof(zentry));
+
+		/* the terminator is checked once decompressed */
+		if (zentry.block >= zhdr.block_cnt || zentry.off >= g_state.zblocks[zentry.block].size ||
+				g_state.zblocks[zentry.block].size - zentry.off <= zentry.len) {
+			rc = -EIO;
+			break;
 		}
 
-		i = entry->len - 1;
-		while (i > 0 && (entry->desc[i] == '\n' || entry->desc[i] == '\r')) {
-			entry->desc[i] = 0;
-			i--;
+		str = parse_z_str(strs, &str_cnt, &zentry);
+		entry = str ? pw_avl_alloc(g_state.avl) : NULL;
+		if (!entry) {
+			rc = -ENOMEM;
+			break;
 		}
+
+		entry->id = zentry.id;
+		entry->len = zentry.len;
+		entry->str = str;
+
+		keys[i] = entry->id;
+		entries[i] = entry;
+		*parsed = i + 1;
 	}
 
-	return 0;
+	free(strs);
+	return rc;
 }
 
 static void
-save_entry_cb(void *el, void *ctx1, void *ctx2)
+dir_disable(void)
 {
-	FILE *fp = ctx1;
-	struct pw_avl_node *node = el;
-	struct pw_item_desc_entry *entry = (void *)node->data;
-	struct pw_item_desc_file_entry file_entry;
-	uint32_t *count = ctx2;
+	uint32_t i;
+
+	for (i = 0; i < g_state.dir_cnt; i++) {
+		free(g_state.dir[i]);
+	}
+	free(g_state.dir);
+	g_state.dir = NULL;
+	g_state.dir_cnt = 0;
+	g_state.dir_disabled = true;
+}
+
+/* on failure the index is dropped and lookups go to the tree from then on */
+static void
+dir_add(struct pw_item_desc_entry *entry)
+{
+	uint32_t top = entry->id >> ITEM_DESC_DIR_LEAF_BITS;
+	struct pw_item_desc_entry **leaf;
+
+	if (g_state.dir_disabled || entry->id >= ITEM_DESC_DIR_MAX_ID) {
+		return;
+	}
+
+	if (top >= g_state.dir_cnt) {
+		/* ids mostly grow one by one, don't realloc each time */
+		uint32_t cnt = (top + 64) & ~63u;
+		struct pw_item_desc_entry ***dir = realloc(g_state.dir, cnt * sizeof(*dir));
+
+		if (!dir) {
+			dir_disable();
+			return;
+		}
+
+		memset(dir + g_state.dir_cnt, 0, (cnt - g_state.dir_cnt) * sizeof(*dir));
+		g_state.dir = dir;
+		g_state.dir_cnt = cnt;
+	}
+
+	leaf = g_state.dir[top];
+	if (!leaf) {
+		leaf = g_state.dir[top] = calloc(ITEM_DESC_DIR_LEAF_SIZE, sizeof(*leaf));
+		if (!leaf) {
+			dir_disable();
+			return;
+		}
+	}
+
+	/* same as the tree, the first one with this id wins */
+	if (!leaf[entry->id & (ITEM_DESC_DIR_LEAF_SIZE - 1)]) {
+		leaf[entry->id & (ITEM_DESC_DIR_LEAF_SIZE - 1)] = entry;
+	}
+}
+
+/* copy the unique strings out of the file buffer, false if out of memory */
+static bool
+compact_raw(void **entries, uint32_t count, char *buf, size_t size)
+{
+	uint32_t i;
+
+	for (i = 0; i < count; i++) {
+		struct pw_item_desc_str *str = ((struct pw_item_desc_entry *)entries[i])->str;
+		char *desc;
+
+		if (str->desc < buf || str->desc >= buf + size) {
+			/* already copied */
+			continue;
+		}
+
+		desc = arena_alloc(str->len + 1);
+		if (!desc) {
+			return false;
+		}
 
-	file_entry.id = entry->id;
-	file_entry.len = entry->len;
-	fwrite(&file_entry, sizeof(file_entry), 1, fp);
-	fwrite(entry->desc, entry->len + 1, 1, fp);
-	(*count)++;
+		memcpy(desc, str->desc, str->len + 1);
+		/* just replaces the key, can't fail */
+		if (str->hash) {
+			pw_hashmap_set_hashed(g_state.strs, desc, str->hash, str);
+		}
+		str->desc = desc;
+	}
+
+	return true;
 }
 
 int
-pw_item_desc_save(void)
+pw_item_desc_load(const char *filepath)
 {
-	struct pw_item_desc_hdr hdr = {};
-	FILE *fp = fopen(g_state.filename, "wb");
+	struct pw_item_desc_hdr hdr;
+	struct pw_item_desc_tail tail;
+	uint64_t *keys = NULL;
+	void **entries = NULL;
+	bool sorted = true;
+	size_t size, dup_bytes = 0;
+	char *buf = NULL;
+	int i = 0, rc = 0;
 
-	if (!fp) {
-		return -errno;
+	g_state.filename = strdup(filepath);
+	if (!g_state.filename) {
+		return -ENOMEM;
 	}
 
-	fwrite(&hdr, sizeof(hdr), 1, fp);
-	pw_avl_foreach(g_state.avl, save_entry_cb, fp, &hdr.count);
+#ifdef _WIN32
+	InitializeCriticalSection(&g_state.lock);
+#else
+	pthread_mutex_init(&g_state.lock, NULL);
+#endif
 
-	hdr.magic = ITEM_DESC_MAGIC;
-	hdr.ver = ITEM_DESC_VERSION;
-	fseek(fp, 0, SEEK_SET);
-	fwrite(&hdr, sizeof(hdr), 1, fp);
+	g_state.avl = g_pw_item_desc_avl = pw_avl_init_pooled(sizeof(struct pw_item_desc_entry),
+			ITEM_DESC_POOL_CHUNK_SIZE);
+	g_state.strs = pw_hashmap_init(0);
+	if (!g_state.avl || !g_state.strs) {
+		pw_hashmap_deinit(g_state.strs);
+		free(g_state.filename);
+		return -ENOMEM;
+	}
+
+	FILE *fp = fopen(filepath, "rb");
+	if (!fp) {
+		/* no problem, we'll create this file later */
+		return 0;
+	}
 
+	/* one read for everything, the file isn't kept open (or mapped) so
+	 * it can be overwritten by pw_item_desc_save() later on */
+	rc = read_file(fp, &buf, &size);
 	fclose(fp);
+	if (rc != 0) {
+		return rc;
+	}
+
+	if (size < sizeof(hdr)) {
+		rc = -EIO;
+		goto out;
+	}
+
+	memcpy(&hdr, buf, sizeof(hdr));
+	if (size >= sizeof(hdr) + sizeof(tail)) {
+		memcpy(&tail, buf + size - sizeof(tail), sizeof(tail));
+		/* files of older versions don't have it */
+		g_state.base_id = tail.magic == ITEM_DESC_TAIL_MAGIC ? tail.base_id : 0;
+	}
+
+	if (hdr.magic != ITEM_DESC_MAGIC) {
+		/* fail because we don't want to override this file later on */
+		rc = -EIO;
+		goto out;
+	}
+
+	if (hdr.ver != ITEM_DESC_VERSION && hdr.ver != ITEM_DESC_VERSION_Z) {
+		rc = 0;
+		goto out;
+	}
+
+	/* every entry takes at least 8 bytes, so that's a corrupted header */
+	if (hdr.count > size / sizeof(struct pw_item_desc_file_entry)) {
+		rc = -EIO;
+		goto out;
+	}
+
+	keys = malloc(hdr.count * sizeof(*keys));
+	entries = malloc(hdr.count * sizeof(*entries));
+	if (!keys || !entries) {
+		rc = -ENOMEM;
+		goto out;
+	}
+
+	if (hdr.ver == ITEM_DESC_VERSION_Z) {
+		rc = parse_z(buf, size, hdr.count, keys, entries, &i);
+	} else {
+		if (g_state.dedup) {
+			/* sized for all the strings upfront, it's still empty */
+			pw_hashmap_deinit(g_state.strs);
+			g_state.strs = pw_hashmap_init(hdr.count + hdr.count / 3);
+			if (!g_state.strs) {
+				rc = -ENOMEM;
+				goto out;
+			}
+		}
+
+		rc = parse_raw(buf, size, hdr.count, keys, entries, &i, &dup_bytes);
+	}
+	if (rc != 0) {
+		goto out;
+	}
+
+	for (i = 1; i < hdr.count; i++) {
+		if (keys[i] < keys[i - 1]) {
+			sorted = false;
+			break;
+		}
+	}
+
+	/* files written in key order can skip the per-entry rebalancing */
+	if (!sorted || pw_avl_build_sorted(g_state.avl, keys, entries, hdr.count) != 0) {
+		for (i = 0; i < hdr.count; i++) {
+			pw_avl_insert(g_state.avl, keys[i], entries[i]);
+		}
+	}
+
+	for (i = 0; i < hdr.count; i++) {
+		dir_add(entries[i]);
+	}
+
+	/* with enough duplicates, keeping just the unique strings takes less
+	 * than the whole file. Otherwise the entries keep pointing into it */
+	if (dup_bytes > 0 && dup_bytes >= (size - sizeof(hdr)) / 8 &&
+			compact_raw(entries, hdr.count, buf, size)) {
+		free(buf);
+		buf = NULL;
+	}
+
+	g_state.file_buf = buf;
+	g_state.compressed = hdr.ver == ITEM_DESC_VERSION_Z;
+	g_state.base_compressed = g_state.compressed;
+	g_state.base_size = size;
+	/* without an id, the next save has to write one */
+	g_state.can_append = g_state.base_id != 0;
+	buf = NULL;
+	rc = 0;
+out:
+	if (rc != 0) {
+		free(g_state.zblocks);
+		g_state.zblocks = NULL;
+		g_state.zblock_cnt = 0;
+		/* the keys point into the buffer */
+		pw_hashmap_deinit(g_state.strs);
+		g_state.strs = pw_hashmap_init(0);
+	}
+	if (rc != 0 && entries) {
+		/* entries allocated so far aren't in the tree yet */
+		while (--i >= 0) {
+			pw_avl_free(g_state.avl, entries[i]);
+		}
+	}
+	free(buf);
+	free(keys);
+	free(entries);
+
+	if (rc == 0 && g_state.can_append) {
+		rc = replay_journal();
+	}
+
+	/* the descriptions are mostly read from now on. Freeze only after the
+	 * replay, as any insert would drop the index */
+	if (rc == 0) {
+		pw_avl_freeze(g_state.avl);
+	}
+	return rc;
+}
+
+struct pw_item_desc_entry *
+pw_item_desc_get(int id)
+{
+	struct pw_item_desc_entry **leaf;
+
+	if ((uint32_t)id < g_state.dir_cnt << ITEM_DESC_DIR_LEAF_BITS) {
+		leaf = g_state.dir[(uint32_t)id >> ITEM_DESC_DIR_LEAF_BITS];
+		return leaf ? leaf[id & (ITEM_DESC_DIR_LEAF_SIZE - 1)] : NULL;
+	}
+
+	/* the tree is keyed by id, so the first match is the one */
+	return pw_avl_get(g_state.avl, id);
+}
+
+static void
+lock(void)
+{
+#ifdef _WIN32
+	EnterCriticalSection(&g_state.lock);
+#else
+	pthread_mutex_lock(&g_state.lock);
+#endif
+}
+
+static void
+unlock(void)
+{
+#ifdef _WIN32
+	LeaveCriticalSection(&g_state.lock);
+#else
+	pthread_mutex_unlock(&g_state.lock);
+#endif
+}
+
+static void
+lru_unlink(struct pw_item_desc_wstr *wstr)
+{
+	if (wstr->prev) {
+		wstr->prev->next = wstr->next;
+	} else {
+		g_state.lru_head = wstr->next;
+	}
+
+	if (wstr->next) {
+		wstr->next->prev = wstr->prev;
+	} else {
+		g_state.lru_tail = wstr->prev;
+	}
+}
+
+static void
+lru_push_front(struct pw_item_desc_wstr *wstr)
+{
+	wstr->prev = NULL;
+	wstr->next = g_state.lru_head;
+	if (g_state.lru_head) {
+		g_state.lru_head->prev = wstr;
+	} else {
+		g_state.lru_tail = wstr;
+	}
+	g_state.lru_head = wstr;
+}
+
+static void
+wstr_drop(struct pw_item_desc_wstr *wstr)
+{
+	lru_unlink(wstr);
+	g_state.wstr_bytes -= wstr->size;
+	wstr->owner->wstr = NULL;
+	free(wstr);
+}
+
+/* must be called with the lock held */
+static void
+str_put(struct pw_item_desc_str *str)
+{
+	if (str == &g_empty_str || --str->refcnt > 0) {
+		return;
+	}
+
+	if (str->hash) {
+		pw_hashmap_del_hashed(g_state.strs, str->desc, str->hash);
+	}
+	if (str->wstr) {
+		wstr_drop(str->wstr);
+	}
+
+	/* the text itself stays where it was, descriptions are rarely
+	 * changed at runtime */
+	str->next_free = g_state.str_free;
+	g_state.str_free = str;
+}
+
+/* must be called with the lock held, the result is valid until unlocked */
+static const char *
+block_get(uint32_t block)
+{
+	struct pw_item_desc_zblock *zblock = &g_state.zblocks[block];
+	struct item_desc_block_slot *slot = NULL;
+	uLongf size = zblock->size;
+	int i;
+
+	for (i = 0; i < ITEM_DESC_BLOCK_CACHE_SIZE; i++) {
+		struct item_desc_block_slot *s = &g_state.block_cache[i];
+
+		if (s->buf && s->block == block) {
+			s->last_use = ++g_state.block_tick;
+			return s->buf;
+		}
+
+		if (!slot || !s->buf || (slot->buf && s->last_use < slot->last_use)) {
+			slot = s;
+		}
+	}
+
+	if (slot->cap < zblock->size) {
+		char *buf = realloc(slot->buf, zblock->size);
+
+		if (!buf) {
+			return NULL;
+		}
+		slot->buf = buf;
+		slot->cap = zblock->size;
+	}
+
+	slot->block = block;
+	if (uncompress((Bytef *)slot->buf, &size, (Bytef *)g_state.file_buf + zblock->file_off,
+				zblock->zsize) != Z_OK || size != zblock->size) {
+		/* don't let it be found */
+		slot->block = UINT32_MAX;
+		return NULL;
+	}
+
+	slot->last_use = ++g_state.block_tick;
+	return slot->buf;
+}
+
+/* must be called with the lock held, the result is valid until unlocked */
+static const char *
+str_desc(struct pw_item_desc_str *str)
+{
+	const char *block;
+
+	if (str->desc) {
+		return str->desc;
+	}
+
+	block = block_get(str->zblock);
+	if (!block || block[str->zoff + str->len] != 0) {
+		return NULL;
+	}
+
+	return block + str->zoff;
+}
+
+/* must be called with the lock held, the result is valid until unlocked */
+static const char *
+entry_desc(struct pw_item_desc_entry *entry)
+{
+	return str_desc(entry->str);
+}
+
+static struct pw_item_desc_wstr *
+wstr_convert(struct pw_item_desc_str *str)
+{
+	struct pw_item_desc_wstr *wstr;
+	size_t i, size = sizeof(*wstr) + (str->len + 1) * sizeof(wchar_t);
+	const char *desc = str_desc(str);
+	wchar_t *c;
+
+	if (!desc) {
+		return NULL;
+	}
+
+	wstr = malloc(size);
+	if (!wstr) {
+		return NULL;
+	}
+
+	wstr->owner = str;
+	wstr->size = size;
+
+	/* one wchar per byte, same as the "%S" conversion this replaces */
+	for (i = 0; i <= str->len; i++) {
+		wstr->str[i] = (unsigned char)desc[i];
+	}
+
+	/* the descriptions have escaped newlines */
+	for (c = wstr->str; *c; c++) {
+		if (c[0] == '\\' && c[1] == 'n') {
+			c[0] = '\r';
+			c[1] = '\n';
+			c++;
+		}
+	}
+
+	return wstr;
+}
+
+const wchar_t *
+pw_item_desc_get_wstr(struct pw_item_desc_entry *entry)
+{
+	struct pw_item_desc_str *str;
+	struct pw_item_desc_wstr *wstr;
+
+	lock();
+	/* read under the lock, pw_item_desc_set() might be changing it */
+	str = entry->str;
+	wstr = str->wstr;
+	if (wstr) {
+		lru_unlink(wstr);
+		lru_push_front(wstr);
+		unlock();
+		return wstr->str;
+	}
+
+	wstr = wstr_convert(str);
+	if (!wstr) {
+		unlock();
+		return NULL;
+	}
+
+	str->wstr = wstr;
+	lru_push_front(wstr);
+	g_state.wstr_bytes += wstr->size;
+
+	/* always keep the one just returned */
+	while (g_state.wstr_bytes > g_state.wstr_budget && g_state.lru_tail != wstr) {
+		wstr_drop(g_state.lru_tail);
+	}
+	unlock();
+
+	return wstr->str;
+}
+
+void
+pw_item_desc_set_wstr_budget(size_t bytes)
+{
+	g_state.wstr_budget = bytes;
+}
+
+/* convert the queued ids, must be called with the lock held */
+static void
+prewarm_drain(void)
+{
+	struct pw_item_desc_entry *entry;
+	struct pw_item_desc_str *str;
+	struct pw_item_desc_wstr *wstr;
+	uint32_t id;
+
+	while (g_state.prewarm_cnt > 0 && !g_state.prewarm_quit) {
+		id = g_state.prewarm_ids[--g_state.prewarm_cnt];
+		entry = pw_item_desc_get(id);
+		str = entry ? entry->str : NULL;
+		/* never evict anything here, the game thread might be using it */
+		if (str && !str->wstr && g_state.wstr_bytes + sizeof(*wstr) +
+				(str->len + 1) * sizeof(wchar_t) <= g_state.wstr_budget) {
+			wstr = wstr_convert(str);
+			if (wstr) {
+				str->wstr = wstr;
+				/* at the back, they weren't actually used yet */
+				wstr->next = NULL;
+				wstr->prev = g_state.lru_tail;
+				if (g_state.lru_tail) {
+					g_state.lru_tail->next = wstr;
+				} else {
+					g_state.lru_head = wstr;
+				}
+				g_state.lru_tail = wstr;
+				g_state.wstr_bytes += wstr->size;
+			}
+		}
+
+		/* let the game thread in between */
+		unlock();
+		lock();
+	}
+
+	g_state.prewarm_running = false;
+}
+
+static void
+prewarm_worker(void)
+{
+	lock();
+	while (!g_state.prewarm_quit) {
+		prewarm_drain();
+		if (g_state.prewarm_cnt > 0 || g_state.prewarm_quit) {
+			continue;
+		}
+
+#ifdef _WIN32
+		/* auto-reset, so a wake-up before this wait isn't lost */
+		unlock();
+		WaitForSingleObject(g_state.prewarm_event, INFINITE);
+		lock();
+#else
+		pthread_cond_wait(&g_state.prewarm_cond, &g_state.lock);
+#endif
+	}
+	unlock();
+}
+
+#ifdef _WIN32
+static DWORD __stdcall
+prewarm_thread_fn(void *arg)
+{
+	prewarm_worker();
+	return 0;
+}
+#else
+static void *
+prewarm_thread_fn(void *arg)
+{
+	prewarm_worker();
+	return NULL;
+}
+#endif
+
+/* must be called with the lock held */
+static int
+prewarm_start(void)
+{
+#ifdef _WIN32
+	g_state.prewarm_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (!g_state.prewarm_event) {
+		return -ENOMEM;
+	}
+
+	g_state.prewarm_thr = CreateThread(NULL, 0, prewarm_thread_fn, NULL, 0, NULL);
+	if (!g_state.prewarm_thr) {
+		CloseHandle(g_state.prewarm_event);
+		return -ENOMEM;
+	}
+#else
+	if (pthread_cond_init(&g_state.prewarm_cond, NULL) != 0) {
+		return -ENOMEM;
+	}
+
+	if (pthread_create(&g_state.prewarm_thr, NULL, prewarm_thread_fn, NULL) != 0) {
+		pthread_cond_destroy(&g_state.prewarm_cond);
+		return -ENOMEM;
+	}
+#endif
+	g_state.prewarm_started = true;
+	return 0;
+}
+
+void
+pw_item_desc_prewarm(const uint32_t *ids, size_t count)
+{
+	struct pw_item_desc_entry *entry;
+	size_t i;
+
+	lock();
+	for (i = 0; i < count && g_state.prewarm_cnt < ITEM_DESC_PREWARM_QUEUE_SIZE; i++) {
+		/* the same id is usually requested over and over until it's shown */
+		entry = pw_item_desc_get(ids[i]);
+		if (!entry || entry->str->wstr || (g_state.prewarm_cnt > 0 &&
+				g_state.prewarm_ids[g_state.prewarm_cnt - 1] == ids[i])) {
+			continue;
+		}
+
+		g_state.prewarm_ids[g_state.prewarm_cnt++] = ids[i];
+	}
+
+	if (g_state.prewarm_cnt == 0) {
+		unlock();
+		return;
+	}
+
+	g_state.prewarm_running = true;
+	if (g_state.prewarm_started || prewarm_start() == 0) {
+#ifdef _WIN32
+		SetEvent(g_state.prewarm_event);
+#else
+		pthread_cond_signal(&g_state.prewarm_cond);
+#endif
+	} else {
+		/* no thread, do it right here */
+		prewarm_drain();
+	}
+	unlock();
+}
+
+/* must be called with the lock held */
+static int
+set(int id, const char *desc)
+{
+	struct pw_item_desc_entry *entry;
+	struct pw_item_desc_str *str = &g_empty_str;
+	size_t len = desc ? strlen(desc) : 0;
+	char *copy = NULL;
+	uint32_t hash;
+
+	/* trailing newlines are dropped, but never the first character */
+	while (len > 1 && (desc[len - 1] == '\n' || desc[len - 1] == '\r')) {
+		len--;
+	}
+
+	entry = pw_item_desc_get(id);
+	if (!entry) {
+		entry = pw_avl_alloc(g_state.avl);
+		if (!entry) {
+			return -ENOMEM;
+		}
+
+		entry->id = id;
+		entry->len = 0;
+		entry->str = &g_empty_str;
+
+		pw_avl_insert(g_state.avl, id, entry);
+		dir_add(entry);
+	}
+
+	if (len > 0) {
+		if (desc[len] != 0) {
+			/* the lookup needs it null-terminated */
+			copy = arena_alloc(len + 1);
+			if (!copy) {
+				return -ENOMEM;
+			}
+			memcpy(copy, desc, len);
+			copy[len] = 0;
+		}
+
+		hash = str_hash(desc, len);
+		str = pw_hashmap_get_hashed(g_state.strs, copy ? copy : desc, hash);
+		if (str) {
+			str->refcnt++;
+		} else {
+			if (!copy) {
+				copy = arena_alloc(len + 1);
+				if (copy) {
+					memcpy(copy, desc, len + 1);
+				}
+			}
+
+			str = copy ? str_new(copy, len, hash) : NULL;
+			if (!str) {
+				return -ENOMEM;
+			}
+		}
+	}
+
+	/* also drops the wide string if this was its last user */
+	str_put(entry->str);
+	entry->str = str;
+	entry->len = str->len;
+	return 0;
+}
+
+/* must be called with the lock held */
+static void
+mark_dirty(int id)
+{
+	if (!g_state.can_append) {
+		/* everything will be saved anyway */
+		return;
+	}
+
+	if (g_state.dirty_cnt == g_state.dirty_cap) {
+		size_t cap = g_state.dirty_cap ? g_state.dirty_cap * 2 : 64;
+		int *dirty = realloc(g_state.dirty, cap * sizeof(*dirty));
+
+		if (!dirty) {
+			/* can't tell what changed anymore */
+			g_state.can_append = false;
+			return;
+		}
+
+		g_state.dirty = dirty;
+		g_state.dirty_cap = cap;
+	}
+
+	g_state.dirty[g_state.dirty_cnt++] = id;
+}
+
+int
+pw_item_desc_set(int id, const char *desc)
+{
+	int rc;
+
+	lock();
+	rc = set(id, desc);
+	if (rc == 0) {
+		mark_dirty(id);
+	}
+	unlock();
+	return rc;
+}
+
+static void
+journal_path(char *buf, size_t len)
+{
+	snprintf(buf, len, "%s.journal", g_state.filename);
+}
+
+static uint32_t
+journal_rec_crc(struct pw_item_desc_journal_rec *rec, const char *desc)
+{
+	uint32_t crc = pw_crc32(0, rec, offsetof(struct pw_item_desc_journal_rec, crc));
+
+	return pw_crc32(crc, desc, rec->len + 1);
+}
+
+static int
+replay_journal(void)
+{
+	struct pw_item_desc_journal_hdr jhdr;
+	struct pw_item_desc_journal_rec rec;
+	char path[512], *buf;
+	size_t size, off;
+	FILE *fp;
+	int rc;
+
+	journal_path(path, sizeof(path));
+	fp = fopen(path, "rb");
+	if (!fp) {
+		return 0;
+	}
+
+	rc = read_file(fp, &buf, &size);
+	fclose(fp);
+	if (rc != 0) {
+		return rc;
+	}
+
+	if (size < sizeof(jhdr)) {
+		/* the very first append was torn */
+		g_state.can_append = false;
+		free(buf);
+		return 0;
+	}
+
+	memcpy(&jhdr, buf, sizeof(jhdr));
+	if (jhdr.magic != ITEM_DESC_JOURNAL_MAGIC || jhdr.base_id == 0 ||
+			jhdr.base_id != g_state.base_id) {
+		/* left over from an older file, the next save removes it */
+		g_state.can_append = false;
+		free(buf);
+		return 0;
+	}
+
+	lock();
+	off = sizeof(jhdr);
+	while (off < size) {
+		const char *desc = buf + off + sizeof(rec);
+
+		/* a crash in the middle of an append leaves a torn record at the
+		 * end. It can't be appended to anymore, so rewrite the whole
+		 * file on the next save */
+		if (size - off < sizeof(rec)) {
+			g_state.can_append = false;
+			break;
+		}
+
+		memcpy(&rec, buf + off, sizeof(rec));
+		if (rec.magic != ITEM_DESC_JOURNAL_REC_MAGIC || rec.len >= size - off - sizeof(rec) ||
+				desc[rec.len] != 0 || rec.crc != journal_rec_crc(&rec, desc)) {
+			g_state.can_append = false;
+			break;
+		}
+
+		/* don't continue without it, the next save would drop it */
+		rc = set((int)rec.id, desc);
+		if (rc != 0) {
+			break;
+		}
+
+		off += sizeof(rec) + rec.len + 1;
+	}
+	g_state.journal_size = off;
+	unlock();
+
+	free(buf);
+	return rc;
+}
+
+
+void
+pw_item_desc_set_dedup(bool dedup)
+{
+	g_state.dedup = dedup;
+}
+
+void
+pw_item_desc_set_compressed(bool compressed)
+{
+	g_state.compressed = compressed;
+}
+
+static int
+save_raw(FILE *fp, uint32_t *count)
+{
+	struct pw_item_desc_entry *entry;
+	struct pw_avl_cursor cur;
+
+	/* write in id order, so the file can be loaded without rebalancing */
+	entry = pw_avl_cursor_first(g_state.avl, &cur);
+	while (entry) {
+		struct pw_item_desc_file_entry file_entry;
+		const char *desc = entry_desc(entry);
+
+		if (!desc) {
+			return -EIO;
+		}
+
+		file_entry.id = entry->id;
+		file_entry.len = entry->len;
+		fwrite(&file_entry, sizeof(file_entry), 1, fp);
+		fwrite(desc, entry->len + 1, 1, fp);
+		(*count)++;
+
+		entry = pw_avl_cursor_next(&cur);
+	}
+
+	return 0;
+}
+
+static int
+save_z_block(FILE *fp, const char *block, size_t size, struct pw_item_desc_zblock *zblock,
+		Bytef **zbuf, uLongf *zbuf_cap)
+{
+	uLongf zsize = compressBound(size);
+
+	if (*zbuf_cap < zsize) {
+		Bytef *buf = realloc(*zbuf, zsize);
+
+		if (!buf) {
+			return -ENOMEM;
+		}
+		*zbuf = buf;
+		*zbuf_cap = zsize;
+	}
+
+	if (compress2(*zbuf, &zsize, (const Bytef *)block, size, Z_BEST_COMPRESSION) != Z_OK) {
+		return -EIO;
+	}
+
+	zblock->file_off = ftell(fp);
+	zblock->zsize = zsize;
+	zblock->size = size;
+	fwrite(*zbuf, zsize, 1, fp);
+	return 0;
+}
+
+static int
+save_z(FILE *fp, uint32_t *count)
+{
+	struct pw_item_desc_zhdr zhdr = {};
+	struct pw_item_desc_zentry *index;
+	struct pw_item_desc_zblock *zblocks = NULL;
+	struct pw_item_desc_entry *entry;
+	struct pw_item_desc_str *str;
+	struct pw_avl_cursor cur;
+	size_t zblock_cap = 0, block_cap = ITEM_DESC_BLOCK_SIZE, block_size = 0;
+	char *block = malloc(block_cap);
+	Bytef *zbuf = NULL;
+	uLongf zbuf_cap = 0;
+	long zhdr_off = ftell(fp);
+	int rc = 0;
+
+	index = malloc(g_state.avl->el_count * sizeof(*index) + 1);
+	if (!index || !block) {
+		rc = -ENOMEM;
+		goto out;
+	}
+
+	fwrite(&zhdr, sizeof(zhdr), 1, fp);
+
+	/* each shared string is written just once */
+	g_state.save_gen++;
+
+	entry = pw_avl_cursor_first(g_state.avl, &cur);
+	while (true) {
+		const char *desc;
+
+		str = entry ? entry->str : NULL;
+		if (str && str->save_gen == g_state.save_gen) {
+			index[*count].id = entry->id;
+			index[*count].len = str->len;
+			index[*count].block = str->save_block;
+			index[*count].off = str->save_off;
+			(*count)++;
+
+			entry = pw_avl_cursor_next(&cur);
+			continue;
+		}
+
+		desc = str ? str_desc(str) : NULL;
+		if (str && !desc) {
+			rc = -EIO;
+			goto out;
+		}
+
+		/* close the block before it gets too big, or at the end */
+		if (block_size > 0 && (!entry || block_size + entry->len + 1 > ITEM_DESC_BLOCK_SIZE)) {
+			if (zhdr.block_cnt == zblock_cap) {
+				struct pw_item_desc_zblock *tmp;
+
+				zblock_cap = zblock_cap ? zblock_cap * 2 : 256;
+				tmp = realloc(zblocks, zblock_cap * sizeof(*zblocks));
+				if (!tmp) {
+					rc = -ENOMEM;
+					goto out;
+				}
+				zblocks = tmp;
+			}
+
+			rc = save_z_block(fp, block, block_size, &zblocks[zhdr.block_cnt],
+					&zbuf, &zbuf_cap);
+			if (rc != 0) {
+				goto out;
+			}
+			zhdr.block_cnt++;
+			block_size = 0;
+		}
+
+		if (!entry) {
+			break;
+		}
+
+		if (entry->len + 1 > block_cap) {
+			char *tmp = realloc(block, entry->len + 1);
+
+			if (!tmp) {
+				rc = -ENOMEM;
+				goto out;
+			}
+			block = tmp;
+			block_cap = entry->len + 1;
+		}
+
+		str->save_gen = g_state.save_gen;
+		str->save_block = zhdr.block_cnt;
+		str->save_off = block_size;
+
+		index[*count].id = entry->id;
+		index[*count].len = str->len;
+		index[*count].block = zhdr.block_cnt;
+		index[*count].off = block_size;
+		memcpy(block + block_size, desc, str->len + 1);
+		block_size += str->len + 1;
+		(*count)++;
+
+		entry = pw_avl_cursor_next(&cur);
+	}
+
+	zhdr.index_off = ftell(fp);
+	fwrite(index, sizeof(*index), *count, fp);
+	zhdr.blocks_off = ftell(fp);
+	fwrite(zblocks, sizeof(*zblocks), zhdr.block_cnt, fp);
+
+	fseek(fp, zhdr_off, SEEK_SET);
+	fwrite(&zhdr, sizeof(zhdr), 1, fp);
+	fseek(fp, 0, SEEK_END);
+out:
+	free(index);
+	free(zblocks);
+	free(block);
+	free(zbuf);
+	return rc;
+}
+
+static int
+replace_file(const char *tmp_path, const char *path)
+{
+#ifdef _WIN32
+	if (!MoveFileExA(tmp_path, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+		return -EIO;
+	}
+#else
+	if (rename(tmp_path, path) != 0) {
+		return -errno;
+	}
+#endif
+	return 0;
+}
+
+/* make sure the data reaches the disk before a rename makes it visible */
+static int
+sync_file(FILE *fp)
+{
+	if (fflush(fp) != 0) {
+		return -EIO;
+	}
+
+#ifdef _WIN32
+	if (_commit(_fileno(fp)) != 0) {
+		return -EIO;
+	}
+#else
+	if (fsync(fileno(fp)) != 0) {
+		return -errno;
+	}
+#endif
+	return 0;
+}
+
+/*
+ * An id for the file being saved. A counter would give the same id to two
+ * files saved from the same one, so mix the file's size and entry count with
+ * whatever differs between saves and processes instead.
+ */
+static uint64_t
+new_base_id(long size, uint32_t count)
+{
+	static uint64_t cnt;
+	uint64_t x = (uint64_t)size << 24 ^ count ^ g_state.base_id ^ ++cnt;
+
+	x ^= (uint64_t)time(NULL) * 0x9e3779b97f4a7c15ULL ^ (uint64_t)clock() << 20;
+	x ^= (uintptr_t)&x;
+#ifdef _WIN32
+	LARGE_INTEGER pc;
+
+	QueryPerformanceCounter(&pc);
+	x ^= (uint64_t)pc.QuadPart << 7 ^ (uint64_t)GetCurrentProcessId() << 40;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	x ^= (uint64_t)ts.tv_nsec << 7 ^ (uint64_t)getpid() << 40;
+#endif
+
+	/* splitmix64 finalizer */
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x ? x : 1;
+}
+
+/* write everything into a new file, then atomically replace the old one */
+static int
+save_base(void)
+{
+	struct pw_item_desc_hdr hdr = {};
+	struct pw_item_desc_tail tail = {};
+	char tmp_path[512], *vbuf;
+	long size;
+	FILE *fp;
+	int rc;
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", g_state.filename);
+	fp = fopen(tmp_path, "wb");
+	if (!fp) {
+		return -errno;
+	}
+
+	/* not a problem if it fails, just slower */
+	vbuf = malloc(ITEM_DESC_SAVE_BUF_SIZE);
+	if (vbuf) {
+		setvbuf(fp, vbuf, _IOFBF, ITEM_DESC_SAVE_BUF_SIZE);
+	}
+
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+	if (g_state.compressed) {
+		rc = save_z(fp, &hdr.count);
+	} else {
+		rc = save_raw(fp, &hdr.count);
+	}
+
+	tail.magic = ITEM_DESC_TAIL_MAGIC;
+	tail.base_id = new_base_id(ftell(fp), hdr.count);
+	fwrite(&tail, sizeof(tail), 1, fp);
+	size = ftell(fp);
+
+	hdr.magic = ITEM_DESC_MAGIC;
+	hdr.ver = g_state.compressed ? ITEM_DESC_VERSION_Z : ITEM_DESC_VERSION;
+	fseek(fp, 0, SEEK_SET);
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+
+	if (rc == 0 && (ferror(fp) || size < 0)) {
+		rc = -EIO;
+	}
+	/* or a power loss could leave an empty file after the rename */
+	if (rc == 0) {
+		rc = sync_file(fp);
+	}
+	if (fclose(fp) != 0 && rc == 0) {
+		rc = -EIO;
+	}
+	free(vbuf);
+
+	if (rc == 0) {
+		rc = replace_file(tmp_path, g_state.filename);
+	}
+
+	if (rc != 0) {
+		remove(tmp_path);
+		return rc;
+	}
+
+	g_state.base_id = tail.base_id;
+	g_state.base_size = size;
+	g_state.base_compressed = g_state.compressed;
+	return 0;
+}
+
+static int
+dirty_cmp(const void *a, const void *b)
+{
+	int id_a = *(const int *)a, id_b = *(const int *)b;
+
+	return id_a < id_b ? -1 : id_a > id_b;
+}
+
+/* drop the repeated ids, \return how big the journal records will be */
+static size_t
+dirty_unique(void)
+{
+	size_t i, cnt = 0, bytes = 0;
+
+	qsort(g_state.dirty, g_state.dirty_cnt, sizeof(*g_state.dirty), dirty_cmp);
+	for (i = 0; i < g_state.dirty_cnt; i++) {
+		if (cnt == 0 || g_state.dirty[cnt - 1] != g_state.dirty[i]) {
+			g_state.dirty[cnt++] = g_state.dirty[i];
+			bytes += sizeof(struct pw_item_desc_journal_rec) +
+					pw_item_desc_get(g_state.dirty[i])->len + 1;
+		}
+	}
+
+	g_state.dirty_cnt = cnt;
+	return bytes;
+}
+
+static int
+append_journal(void)
+{
+	struct pw_item_desc_journal_hdr jhdr;
+	struct pw_item_desc_journal_rec rec;
+	char path[512];
+	size_t i, size = 0;
+	FILE *fp;
+	int rc = 0;
+
+	journal_path(path, sizeof(path));
+	fp = fopen(path, "ab");
+	if (!fp) {
+		return -errno;
+	}
+
+	if (g_state.journal_size == 0) {
+		jhdr.magic = ITEM_DESC_JOURNAL_MAGIC;
+		jhdr.base_id = g_state.base_id;
+		if (fwrite(&jhdr, sizeof(jhdr), 1, fp) != 1) {
+			rc = -EIO;
+		}
+		size += sizeof(jhdr);
+	}
+
+	for (i = 0; i < g_state.dirty_cnt && rc == 0; i++) {
+		struct pw_item_desc_entry *entry = pw_item_desc_get(g_state.dirty[i]);
+		const char *desc = entry_desc(entry);
+
+		if (!desc) {
+			rc = -EIO;
+			break;
+		}
+
+		rec.magic = ITEM_DESC_JOURNAL_REC_MAGIC;
+		rec.id = entry->id;
+		rec.len = entry->len;
+		rec.crc = journal_rec_crc(&rec, desc);
+		if (fwrite(&rec, sizeof(rec), 1, fp) != 1 || fwrite(desc, rec.len + 1, 1, fp) != 1) {
+			rc = -EIO;
+		}
+		size += sizeof(rec) + rec.len + 1;
+	}
+
+	if (fclose(fp) != 0 && rc == 0) {
+		rc = -EIO;
+	}
+
+	if (rc != 0) {
+		/* we don't know how much got written, start over */
+		g_state.can_append = false;
+		return rc;
+	}
+
+	g_state.journal_size += size;
+	return 0;
+}
+
+/* ids added with pw_item_desc_set() since the load dropped the lookup index.
+ * A save ends a batch of edits, so rebuild it there */
+static void
+refreeze(void)
+{
+	if (!pw_avl_is_frozen(g_state.avl)) {
+		pw_avl_freeze(g_state.avl);
+	}
+}
+
+int
+pw_item_desc_save(void)
+{
+	size_t compact_at;
+	char path[512];
+	int rc;
+
+	/* the compressed strings are decompressed into a shared cache */
+	lock();
+	compact_at = g_state.base_size / ITEM_DESC_JOURNAL_COMPACT_RATIO;
+	if (compact_at < ITEM_DESC_JOURNAL_COMPACT_MIN) {
+		compact_at = ITEM_DESC_JOURNAL_COMPACT_MIN;
+	}
+
+	/* small edits are just appended */
+	if (g_state.can_append && g_state.compressed == g_state.base_compressed &&
+			g_state.journal_size + dirty_unique() <= compact_at) {
+		rc = g_state.dirty_cnt ? append_journal() : 0;
+		if (rc == 0) {
+			g_state.dirty_cnt = 0;
+			refreeze();
+			unlock();
+			return 0;
+		}
+		/* fallback to a full save */
+	}
+
+	rc = save_base();
+	if (rc == 0) {
+		/* it's been folded into the file now. If we crash before removing
+		 * it, it won't be replayed either, see struct pw_item_desc_tail */
+		journal_path(path, sizeof(path));
+		remove(path);
+		g_state.journal_size = 0;
+		g_state.dirty_cnt = 0;
+		g_state.can_append = true;
+	}
+	refreeze();
+	unlock();
+
+	return rc;
+}
+
+#ifdef PW_ITEM_DESC_TEST
+/*
+ * gcc -O2 -DPW_ITEM_DESC_TEST pw_item_desc.c avl.c crc.c hashmap.c -lpthread -lz \
+ *	-Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,--wrap=strdup
+ */
+#include <assert.h>
+#include <sys/stat.h>
+
+static size_t g_heap_blocks;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *
+__wrap_malloc(size_t size)
+{
+	g_heap_blocks++;
+	return __real_malloc(size);
+}
+
+void *
+__wrap_calloc(size_t nmemb, size_t size)
+{
+	g_heap_blocks++;
+	return __real_calloc(nmemb, size);
+}
+
+void *
+__wrap_realloc(void *ptr, size_t size)
+{
+	g_heap_blocks += !ptr;
+	return __real_realloc(ptr, size);
+}
+
+char *
+__wrap_strdup(const char *str)
+{
+	char *ret = __wrap_malloc(strlen(str) + 1);
+
+	return ret ? strcpy(ret, str) : NULL;
+}
+
+static double
+elapsed_ms(struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) * 1000.0 + (end.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/* load the test file, \return how long it took */
+static double
+timed_load(const char *path)
+{
+	struct timespec start;
+	double ms;
+	int rc;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	rc = pw_item_desc_load(path);
+	ms = elapsed_ms(&start);
+	assert(rc == 0);
+	return ms;
+}
+
+static void
+free_desc_cb(void *el, void *ctx1, void *ctx2)
+{
+	struct pw_avl_node *node = el;
+
+	free(((struct pw_item_desc_entry *)(void *)node->data)->str);
+}
+
+static void
+unload(void)
+{
+	struct item_desc_arena_chunk *chunk;
+	int i;
+
+	/* the worker goes away with everything else */
+	if (g_state.prewarm_started) {
+		lock();
+		g_state.prewarm_quit = true;
+		pthread_cond_signal(&g_state.prewarm_cond);
+		unlock();
+		pthread_join(g_state.prewarm_thr, NULL);
+		pthread_cond_destroy(&g_state.prewarm_cond);
+	}
+	while (g_state.lru_head) {
+		wstr_drop(g_state.lru_head);
+	}
+	for (i = 0; i < ITEM_DESC_BLOCK_CACHE_SIZE; i++) {
+		free(g_state.block_cache[i].buf);
+	}
+	free(g_state.zblocks);
+	dir_disable();
+	pw_hashmap_deinit(g_state.strs);
+	while ((chunk = g_state.arena)) {
+		g_state.arena = chunk->next;
+		free(chunk);
+	}
+	pw_avl_deinit(g_state.avl);
+	free(g_state.file_buf);
+	free(g_state.filename);
+	free(g_state.dirty);
+	memset(&g_state, 0, sizeof(g_state));
+	g_state.wstr_budget = ITEM_DESC_WSTR_DEF_BUDGET;
+}
+
+/* the previous loader, two fread()s and a malloc() per entry, no sharing */
+static int
+load_per_entry(const char *filepath)
+{
+	struct pw_item_desc_hdr hdr;
+	uint64_t *keys;
+	void **entries;
+	FILE *fp;
+	int i, rc;
+
+	g_state.filename = strdup(filepath);
+	g_state.avl = pw_avl_init_pooled(sizeof(struct pw_item_desc_entry),
+			ITEM_DESC_POOL_CHUNK_SIZE);
+	fp = fopen(filepath, "rb");
+	fread(&hdr, sizeof(hdr), 1, fp);
+	keys = malloc(hdr.count * sizeof(*keys));
+	entries = malloc(hdr.count * sizeof(*entries));
+
+	for (i = 0; i < hdr.count; i++) {
+		struct pw_item_desc_file_entry file_entry;
+		struct pw_item_desc_entry *entry = pw_avl_alloc(g_state.avl);
+		struct pw_item_desc_str *str;
+
+		fread(&file_entry, sizeof(file_entry), 1, fp);
+		str = malloc(sizeof(*str) + file_entry.len + 1);
+		memset(str, 0, sizeof(*str));
+		str->refcnt = 1;
+		str->len = file_entry.len;
+		str->desc = (char *)(str + 1);
+		fread(str->desc, str->len + 1, 1, fp);
+		entry->id = file_entry.id;
+		entry->len = file_entry.len;
+		entry->str = str;
+		keys[i] = entry->id;
+		entries[i] = entry;
+	}
+
+	rc = pw_avl_build_sorted(g_state.avl, keys, entries, hdr.count);
+	assert(rc == 0);
+	pw_avl_freeze(g_state.avl);
+	free(keys);
+	free(entries);
+	fclose(fp);
+	return 0;
+}
+
+/* all converted at startup like before, vs on first use while hovering */
+static void
+bench_wstr(const char *path, int count)
+{
+	struct pw_item_desc_entry *entry;
+	struct pw_avl_cursor cur;
+	struct timespec start;
+	size_t eager_bytes = 0;
+	double load_ms, eager_ms, lazy_ms;
+	int i, hovers = 5000;
+
+	load_ms = timed_load(path);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	entry = pw_avl_cursor_first(g_state.avl, &cur);
+	while (entry) {
+		struct pw_item_desc_wstr *wstr = wstr_convert(entry->str);
+
+		eager_bytes += wstr->size;
+		free(wstr);
+		entry = pw_avl_cursor_next(&cur);
+	}
+	eager_ms = elapsed_ms(&start);
+
+	/* a session hovering mostly the same few hundred items */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < hovers; i++) {
+		int n = (i * 2654435761u) % (i % 8 ? 300 : count);
+		const wchar_t *wstr = pw_item_desc_get_wstr(pw_item_desc_get(n * 3 + 1000));
+
+		assert(wstr);
+	}
+	lazy_ms = elapsed_ms(&start);
+
+	fprintf(stderr, "startup: load %.2f ms + convert all %.2f ms, %zu KB of wide strings\n",
+			load_ms, eager_ms, eager_bytes / 1024);
+	fprintf(stderr, "lazy: load %.2f ms, %d hovers %.2f ms, %zu KB cached\n",
+			load_ms, hovers, lazy_ms, g_state.wstr_bytes / 1024);
+	unload();
+}
+
+static void
+gen_desc(char *buf, size_t size, int id)
+{
+	static const char *syl[] = { "ka", "ron", "mi", "sha", "tel", "vo", "ra", "dun",
+		"el", "gor", "is", "fa", "lu", "nor", "pe", "zan" };
+	/* items in a series (refine levels) share most of the text, and every
+	 * third series (e.g. fashion in a few colours) all of it */
+	uint32_t series = (id / 6) * 2654435761u, h = series;
+	size_t len = 0, words = 8 + series % 60, w;
+	int var = series % 3 == 0 ? id / 6 : id;
+
+	len += snprintf(buf + len, size - len, "^ffcb4aLevel %d\\n^ffffff", 1 + var % 100);
+	for (w = 0; w < words && len < size - 32; w++) {
+		int nsyl = 1 + h % 3;
+
+		h = h * 1103515245 + 12345;
+		while (nsyl-- > 0) {
+			len += snprintf(buf + len, size - len, "%s", syl[(h >> 8) % 16]);
+			h = h * 1103515245 + 12345;
+		}
+		buf[len++] = (w % 9 == 8) ? '.' : ' ';
+		if (w % 17 == 16) {
+			len += snprintf(buf + len, size - len, "\\n");
+		}
+	}
+	snprintf(buf + len, size - len, "\\n^00ff00+%d Attack", var % 37);
+}
+
+/* ids with identical text share it, \return how many did */
+static int
+check_shared(int count)
+{
+	char desc[512], next[512];
+	int i, shared = 0;
+
+	/* the first one was changed by an earlier test */
+	gen_desc(desc, sizeof(desc), 1);
+	for (i = 1; i < count - 1; i++) {
+		struct pw_item_desc_str *str = pw_item_desc_get(i * 3 + 1000)->str;
+		struct pw_item_desc_str *next_str = pw_item_desc_get((i + 1) * 3 + 1000)->str;
+
+		gen_desc(next, sizeof(next), i + 1);
+		assert((strcmp(desc, next) == 0) == (str == next_str));
+		shared += str == next_str;
+		memcpy(desc, next, sizeof(desc));
+	}
+
+	return shared;
+}
+
+/* memory of the narrow and wide strings, vs a copy of each per id */
+static void
+bench_dedup(const char *path, int count)
+{
+	struct pw_item_desc_entry *entry;
+	struct pw_avl_cursor cur;
+	const wchar_t *wstr, *wstr2;
+	size_t narrow = 0, narrow_per_id = 0, wide_per_id = 0, strs = 0;
+	double ms, plain_ms;
+	int i, rc;
+
+	plain_ms = timed_load(path);
+	/* without dedup every id has its own text */
+	for (i = 1; i < count - 1; i++) {
+		assert(pw_item_desc_get(i * 3 + 1000)->str != pw_item_desc_get((i + 1) * 3 + 1000)->str);
+	}
+	unload();
+
+	pw_item_desc_set_dedup(true);
+	ms = timed_load(path);
+	assert(check_shared(count) > 0);
+
+	/* everything hovered at least once */
+	pw_item_desc_set_wstr_budget(SIZE_MAX);
+	entry = pw_avl_cursor_first(g_state.avl, &cur);
+	while (entry) {
+		if (!entry->str->wstr) {
+			narrow += entry->len + 1;
+			strs++;
+		}
+		wstr = pw_item_desc_get_wstr(entry);
+		assert(wstr);
+
+		narrow_per_id += entry->len + 1;
+		wide_per_id += sizeof(struct pw_item_desc_wstr) + (entry->len + 1) * sizeof(wchar_t);
+		entry = pw_avl_cursor_next(&cur);
+	}
+
+	fprintf(stderr, "dedup: %d ids, %zu unique texts (%zu KB of nodes), load %.2f ms vs %.2f ms%s\n",
+			count, strs, strs * sizeof(struct pw_item_desc_str) / 1024, ms, plain_ms,
+			g_state.file_buf ? "" : ", file buffer freed");
+	fprintf(stderr, "dedup: narrow %zu KB -> %zu KB, all wide %zu KB -> %zu KB\n",
+			narrow_per_id / 1024, narrow / 1024, wide_per_id / 1024, g_state.wstr_bytes / 1024);
+	unload();
+
+	/* set() shares too, and the last user frees the string */
+	rc = pw_item_desc_load(path);
+	assert(rc == 0);
+	rc = pw_item_desc_set(11, "same\n");
+	assert(rc == 0);
+	rc = pw_item_desc_set(12, "same");
+	assert(rc == 0);
+	assert(pw_item_desc_get(11)->str == pw_item_desc_get(12)->str);
+	assert(pw_item_desc_get(11)->str->refcnt == 2 && pw_item_desc_get(11)->len == 4);
+	wstr = pw_item_desc_get_wstr(pw_item_desc_get(11));
+	assert(wstr);
+	wstr2 = pw_item_desc_get_wstr(pw_item_desc_get(12));
+	assert(wstr2 == wstr);
+	rc = pw_item_desc_set(11, "other");
+	assert(rc == 0);
+	assert(pw_item_desc_get(12)->str->refcnt == 1 && pw_item_desc_get(12)->str->wstr);
+	rc = pw_item_desc_set(12, NULL);
+	assert(rc == 0);
+	assert(!pw_hashmap_get_hashed(g_state.strs, "same", str_hash("same", 4)) && g_state.str_free);
+	rc = pw_item_desc_set(13, "same");
+	assert(rc == 0);
+	assert(pw_item_desc_get(13)->str->refcnt == 1 && !pw_item_desc_get(13)->str->wstr);
+	unload();
+}
+
+static long
+file_size(const char *path)
+{
+	FILE *fp = fopen(path, "rb");
+	long size;
+
+	assert(fp);
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	fclose(fp);
+	return size;
+}
+
+/* best of a few loads, then random lookups of the narrow string */
+static void
+bench_lookup(const char *path, int count, const char *name)
+{
+	double load_ms = 1e9, hot_ms, ms;
+	struct timespec start;
+	uint64_t sum = 0;
+	int i, run, lookups = 200000;
+
+	for (run = 0; run < 3; run++) {
+		ms = timed_load(path);
+		load_ms = ms < load_ms ? ms : load_ms;
+		if (run < 2) {
+			unload();
+		}
+	}
+
+	/* a few dozen hot items, then anything */
+	lock();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < lookups; i++) {
+		sum += entry_desc(pw_item_desc_get((i * 2654435761u) % 40 * 3 + 1000))[0];
+	}
+	hot_ms = elapsed_ms(&start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < lookups; i++) {
+		sum += entry_desc(pw_item_desc_get((i * 2654435761u) % count * 3 + 1000))[0];
+	}
+	ms = elapsed_ms(&start);
+	unlock();
+
+	fprintf(stderr, "%-12s %6ld KB, load %6.2f ms, lookup: hot %5.0f ns, random %5.0f ns\n",
+			name, file_size(path) / 1024, load_ms, hot_ms * 1e6 / lookups, ms * 1e6 / lookups);
+	assert(sum > 0);
+	unload();
+}
+
+/* the direct index vs the (frozen) tree it used to go through */
+static void
+bench_get(const char *path, int count)
+{
+	struct timespec start;
+	uint64_t dir_sum = 0, avl_sum = 0;
+	double dir_ms, avl_ms;
+	size_t dir_bytes;
+	int i, rc, lookups = 2000000;
+	uint32_t j;
+
+	rc = pw_item_desc_load(path);
+	assert(rc == 0);
+	dir_bytes = g_state.dir_cnt * sizeof(*g_state.dir);
+	for (j = 0; j < g_state.dir_cnt; j++) {
+		dir_bytes += g_state.dir[j] ? ITEM_DESC_DIR_LEAF_SIZE * sizeof(**g_state.dir) : 0;
+	}
+
+	/* tooltips of random items, some of which have no description */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < lookups; i++) {
+		struct pw_item_desc_entry *entry = pw_item_desc_get(1000 + (i * 2654435761u) % (count * 3));
+
+		dir_sum += entry ? entry->len : 1;
+	}
+	dir_ms = elapsed_ms(&start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < lookups; i++) {
+		struct pw_item_desc_entry *entry = pw_avl_get(g_state.avl, 1000 + (i * 2654435761u) % (count * 3));
+
+		avl_sum += entry ? entry->len : 1;
+	}
+	avl_ms = elapsed_ms(&start);
+	assert(dir_sum == avl_sum);
+
+	fprintf(stderr, "get: direct index %.1f ns (%zu KB), frozen tree %.1f ns\n",
+			dir_ms * 1e6 / lookups, dir_bytes / 1024, avl_ms * 1e6 / lookups);
+	unload();
+}
+
+static void
+test_compressed(const char *path, int count)
+{
+	char z_path[512], desc[512];
+	struct pw_item_desc_entry *entry;
+	const wchar_t *wstr;
+	FILE *fp;
+	int i, rc;
+
+	snprintf(z_path, sizeof(z_path), "%s.z", path);
+	remove(z_path);
+
+	/* the compressed file keeps whatever was shared when it was saved */
+	pw_item_desc_set_dedup(true);
+	rc = pw_item_desc_load(path);
+	assert(rc == 0);
+	pw_item_desc_set_compressed(true);
+	free(g_state.filename);
+	g_state.filename = strdup(z_path);
+	rc = pw_item_desc_save();
+	assert(rc == 0);
+	unload();
+
+	/* the same contents, and it stays compressed on the next save */
+	rc = pw_item_desc_load(z_path);
+	assert(rc == 0);
+	assert(g_state.compressed && g_state.zblock_cnt > 0);
+	/* written once, so still shared */
+	assert(check_shared(count) > 0);
+	for (i = 1; i < count - 1; i++) {
+		entry = pw_item_desc_get(i * 3 + 1000);
+		gen_desc(desc, sizeof(desc), i);
+		lock();
+		assert(entry && entry->len == strlen(desc) && strcmp(entry_desc(entry), desc) == 0);
+		unlock();
+	}
+	rc = pw_item_desc_set(1003, "changed");
+	assert(rc == 0);
+	wstr = pw_item_desc_get_wstr(pw_item_desc_get(1003));
+	assert(wstr && wcscmp(wstr, L"changed") == 0);
+	rc = pw_item_desc_save();
+	assert(rc == 0);
+	unload();
+
+	rc = pw_item_desc_load(z_path);
+	assert(rc == 0);
+	lock();
+	assert(strcmp(entry_desc(pw_item_desc_get(1003)), "changed") == 0);
+	unlock();
+	unload();
+
+	bench_lookup(path, count, "raw");
+	bench_lookup(z_path, count, "compressed");
+
+	/* a corrupted block makes just its descriptions unavailable */
+	rc = pw_item_desc_load(z_path);
+	assert(rc == 0);
+	i = g_state.zblocks[0].file_off + g_state.zblocks[0].zsize / 2;
+	unload();
+	fp = fopen(z_path, "r+b");
+	fseek(fp, i, SEEK_SET);
+	fputc(0x55 ^ 0xaa, fp);
+	fclose(fp);
+	rc = pw_item_desc_load(z_path);
+	assert(rc == 0);
+	wstr = pw_item_desc_get_wstr(pw_item_desc_get(1000));
+	assert(wstr == NULL);
+	wstr = pw_item_desc_get_wstr(pw_item_desc_get((count - 2) * 3 + 1000));
+	assert(wstr != NULL);
+	unload();
+	remove(z_path);
+	strcat(z_path, ".journal");
+	remove(z_path);
+}
+
+static long
+journal_size(const char *path)
+{
+	char journal[512];
+	FILE *fp;
+	long size;
+
+	snprintf(journal, sizeof(journal), "%s.journal", path);
+	fp = fopen(journal, "rb");
+	if (!fp) {
+		return -1;
+	}
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	fclose(fp);
+	return size;
+}
+
+static int
+copy_file(const char *src, const char *dst)
+{
+	char *buf;
+	size_t size;
+	FILE *fp;
+	int rc;
+
+	fp = fopen(src, "rb");
+	if (!fp) {
+		return -errno;
+	}
+	rc = read_file(fp, &buf, &size);
+	fclose(fp);
+	if (rc != 0) {
+		return rc;
+	}
+
+	fp = fopen(dst, "wb");
+	if (!fp) {
+		free(buf);
+		return -errno;
+	}
+	if (fwrite(buf, 1, size, fp) != size) {
+		rc = -EIO;
+	}
+	fclose(fp);
+	free(buf);
+	return rc;
+}
+
+static void
+test_journal(const char *path)
+{
+	char journal[512], old_journal[520], tmp_path[520], old_base[520];
+	long base_size;
+	FILE *fp;
+	int i, rc;
+
+	snprintf(journal, sizeof(journal), "%s.journal", path);
+	snprintf(old_journal, sizeof(old_journal), "%s.old", journal);
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	snprintf(old_base, sizeof(old_base), "%s.old", path);
+
+	/* start with no journal */
+	rc = pw_item_desc_load(path);
+	assert(rc == 0);
+	g_state.can_append = false;
+	rc = pw_item_desc_save();
+	assert(rc == 0);
+	assert(journal_size(path) == -1);
+	unload();
+
+	/* small edits only go to the journal */
+	base_size = file_size(path);
+	rc = pw_item_desc_load(path);
+	assert(rc == 0);
+	rc = pw_item_desc_set(1003, "j1");
+	assert(rc == 0);
+	rc = pw_item_desc_set(1006, NULL);
+	assert(rc == 0);
+	rc = pw_item_desc_set(1003, "j2");
+	assert(rc == 0);
+	rc = pw_item_desc_save();
+	assert(rc == 0);
+	rc = pw_item_desc_save();
+	assert(rc == 0);
+	rc = pw_item_desc_set(-5, "j3\n");
+	assert(rc == 0);
+	/* a new id outside the direct index goes into the tree */
+	assert(!pw_avl_is_frozen(g_state.avl));
+	rc = pw_item_desc_save();
+	assert(rc == 0);
+	assert(pw_avl_is_frozen(g_state.avl));
+	unload();
+	assert(file_size(path) == base_size);
+	assert(journal_size(path) == sizeof(struct pw_item_desc_journal_hdr) +
+			3 * sizeof(struct pw_item_desc_journal_rec) + 3 + 1 + 3);
+
+	rc = pw_item_desc_load(path);
+	assert(rc == 0);
+	assert(g_state.can_append);
+	/* the replay inserted -5, the index must have been built after that */
+	assert(pw_avl_is_frozen(g_state.avl));
+	assert(strcmp(pw_item_desc_get(1003)->str->desc, "j2") == 0);
+	assert(pw_item_desc_get(1006)->len == 0);
+	assert(strcmp(pw_item_desc_get(-5)->str->desc, "j3") == 0);
+	unload();
+
+	/* a torn record is dropped, and the next save rewrites the file */
+	fp = fopen(journal, "r+b");
+	assert(fp);
+	rc = ftruncate(fileno(fp), journal_size(path) - 2);
+	assert(rc == 0);
+	fclose(fp);
+	rc = pw_item_desc_load(path);
+	assert(rc == 0);
+	assert(!g_state.can_append);
+	assert(strcmp(pw_item_desc_get(1003)->str->desc, "j2") == 0);
+	assert(!pw_item_desc_get(-5));
+	rc = pw_item_desc_save();
+	assert(rc == 0);
+	assert(journal_size(path) == -1 && file_size(path) != base_size);
+	unload();
+
+	/* a journal that was already folded into the file is ignored */
+	rc = pw_item_desc_load(path);
+	assert(rc == 0);
+	rc = pw_item_desc_set(1003, "j4");
+	assert(rc == 0);
+	rc = pw_item_desc_save();
+	assert(rc == 0);
+	rc = rename(journal, old_journal);
+	assert(rc == 0);
+	rc = pw_item_desc_set(1003, "j5");
+	assert(rc == 0);
+	g_state.can_append = false;
+	rc = pw_item_desc_save();
+	assert(rc == 0);
+	unload();
+	rc = rename(old_journal, journal);
+	assert(rc == 0);
+	rc = pw_item_desc_load(path);
+	assert(rc == 0);
+	assert(strcmp(pw_item_desc_get(1003)->str->desc, "j5") == 0);
+	assert(!g_state.can_append);
+	unload();
+
+	/* two files saved from the same one don't share a journal, e.g. when
+	 * the patcher puts back a file the client saved before */
+	rc = copy_file(path, old_base);
+	assert(rc == 0);
+	rc = pw_item_desc_load(path);
+	assert(rc == 0);
+	rc = pw_item_desc_set(1003, "j8");
+	assert(rc == 0);
+	g_state.can_append = false;
+	rc = pw_item_desc_save();
+	assert(rc == 0);
+	rc = pw_item_desc_set(1006, "j9");
+	assert(rc == 0);
+	rc = pw_item_desc_save();
+	assert(rc == 0);
+	unload();
+	rc = rename(journal, old_journal);
+	assert(rc == 0);
+	rc = copy_file(old_base, path);
+	assert(rc == 0);
+	rc = pw_item_desc_load(path);
+	assert(rc == 0);
+	rc = pw_item_desc_set(1003, "j10");
+	assert(rc == 0);
+	g_state.can_append = false;
+	rc = pw_item_desc_save();
+	assert(rc == 0);
+	unload();
+	rc = rename(old_journal, journal);
+	assert(rc == 0);
+	rc = pw_item_desc_load(path);
+	assert(rc == 0);
+	assert(strcmp(pw_item_desc_get(1003)->str->desc, "j10") == 0);
+	assert(pw_item_desc_get(1006)->len == 0);
+	assert(!g_state.can_append);
+	unload();
+
+	/* and a file without an id never takes a journal */
+	fp = fopen(path, "r+b");
+	assert(fp);
+	rc = ftruncate(fileno(fp), file_size(path) - sizeof(struct pw_item_desc_tail));
+	assert(rc == 0);
+	fclose(fp);
+	rc = pw_item_desc_load(path);
+	assert(rc == 0);
+	assert(g_state.base_id == 0 && !g_state.can_append);
+	assert(pw_item_desc_get(1006)->len == 0);
+	rc = pw_item_desc_save();
+	assert(rc == 0);
+	assert(g_state.base_id != 0 && journal_size(path) == -1);
+	unload();
+	remove(old_base);
+
+	/* a failed save leaves the old file intact */
+	base_size = file_size(path);
+	rc = mkdir(tmp_path, 0700);
+	assert(rc == 0);
+	rc = pw_item_desc_load(path);
+	assert(rc == 0);
+	rc = pw_item_desc_set(1003, "j6");
+	assert(rc == 0);
+	g_state.can_append = false;
+	rc = pw_item_desc_save();
+	assert(rc != 0);
+	unload();
+	rc = rmdir(tmp_path);
+	assert(rc == 0);
+	assert(file_size(path) == base_size);
+	rc = pw_item_desc_load(path);
+	assert(rc == 0);
+	assert(strcmp(pw_item_desc_get(1003)->str->desc, "j10") == 0);
+
+	/* and once the journal grows too big, it's folded into the file */
+	rc = pw_item_desc_set(1003, "j7");
+	assert(rc == 0);
+	rc = pw_item_desc_save();
+	assert(rc == 0);
+	for (i = 0; journal_size(path) != -1; i++) {
+		char desc[64];
+
+		assert(i < 1000000);
+		snprintf(desc, sizeof(desc), "edit %d", i);
+		rc = pw_item_desc_set(1000 + i % 30000 * 3, desc);
+		assert(rc == 0);
+		rc = pw_item_desc_save();
+		assert(rc == 0);
+	}
+	assert(g_state.journal_size == 0 && g_state.can_append);
+	unload();
+}
+
+/* a few edits appended, vs rewriting the file each time */
+static void
+bench_save(const char *path)
+{
+	struct timespec start;
+	double append_ms, full_ms;
+	int i, rc, saves = 20;
+
+	rc = pw_item_desc_load(path);
+	assert(rc == 0);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < saves; i++) {
+		rc = pw_item_desc_set(1000 + i * 3, "edited");
+		assert(rc == 0);
+		rc = pw_item_desc_save();
+		assert(rc == 0);
+	}
+	append_ms = elapsed_ms(&start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < saves; i++) {
+		rc = pw_item_desc_set(1000 + i * 3, "edited again");
+		assert(rc == 0);
+		g_state.can_append = false;
+		rc = pw_item_desc_save();
+		assert(rc == 0);
+	}
+	full_ms = elapsed_ms(&start);
+
+	fprintf(stderr, "save: %ld KB file, full %.2f ms, a small edit %.3f ms\n",
+			file_size(path) / 1024, full_ms / saves, append_ms / saves);
+	unload();
+}
+
+static void
+prewarm_wait_idle(void)
+{
+	while (true) {
+		bool running;
+
+		lock();
+		running = g_state.prewarm_running;
+		unlock();
+		if (!running) {
+			break;
+		}
+		usleep(1000);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *path = argc > 1 ? argv[1] : "item_desc_test.data";
+	struct pw_item_desc_entry *entry;
+	int i, rc, count = 60000, run;
+	const wchar_t *wstr;
+	char desc[512];
+	pthread_t thr;
+	uint32_t id;
+	FILE *fp;
+
+	remove(path);
+	snprintf(desc, sizeof(desc), "%s.journal", path);
+	remove(desc);
+	rc = pw_item_desc_load(path);
+	assert(rc == 0);
+	for (i = 0; i < count; i++) {
+		gen_desc(desc, sizeof(desc), i);
+		rc = pw_item_desc_set(i * 3 + 1000, desc);
+		assert(rc == 0);
+	}
+	rc = pw_item_desc_save();
+	assert(rc == 0);
+	unload();
+
+	for (run = 0; run < 3; run++) {
+		struct timespec start;
+		size_t blocks;
+		double ms;
+
+		g_heap_blocks = 0;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		rc = load_per_entry(path);
+		assert(rc == 0);
+		ms = elapsed_ms(&start);
+		blocks = g_heap_blocks;
+		pw_avl_foreach(g_state.avl, free_desc_cb, NULL, NULL);
+		unload();
+		fprintf(stderr, "per-entry load: %7.2f ms, %6zu heap blocks\n", ms, blocks);
+
+		g_heap_blocks = 0;
+		ms = timed_load(path);
+		fprintf(stderr, "single read:    %7.2f ms, %6zu heap blocks\n", ms, g_heap_blocks);
+
+		for (i = 0; i < count; i++) {
+			entry = pw_item_desc_get(i * 3 + 1000);
+			gen_desc(desc, sizeof(desc), i);
+			assert(entry && entry->len == strlen(desc) && strcmp(entry->str->desc, desc) == 0);
+		}
+		assert(!pw_item_desc_get(1001));
+		unload();
+	}
+
+	/* updates go to the arena, and survive a save and reload */
+	rc = pw_item_desc_load(path);
+	assert(rc == 0);
+	rc = pw_item_desc_set(1000, "changed\n");
+	assert(rc == 0);
+	rc = pw_item_desc_set(7, "new");
+	assert(rc == 0);
+	rc = pw_item_desc_set(8, NULL);
+	assert(rc == 0);
+	assert(strcmp(pw_item_desc_get(1000)->str->desc, "changed") == 0);
+	rc = pw_item_desc_save();
+	assert(rc == 0);
+	unload();
+
+	rc = pw_item_desc_load(path);
+	assert(rc == 0);
+	assert(strcmp(pw_item_desc_get(1000)->str->desc, "changed") == 0);
+	assert(strcmp(pw_item_desc_get(7)->str->desc, "new") == 0);
+	assert(pw_item_desc_get(8)->len == 0);
+	unload();
+
+	rc = pw_item_desc_load(path);
+	assert(rc == 0);
+	rc = pw_item_desc_set(5, "a\\nb");
+	assert(rc == 0);
+	wstr = pw_item_desc_get_wstr(pw_item_desc_get(5));
+	assert(wstr && wcscmp(wstr, L"a\r\nb") == 0);
+
+	/* the cache stays within its budget, the most recently used are kept */
+	pw_item_desc_set_wstr_budget(64 * 1024);
+	for (i = 1; i < count; i++) {
+		entry = pw_item_desc_get(i * 3 + 1000);
+		wstr = pw_item_desc_get_wstr(entry);
+		assert(wstr && wcslen(wstr) == entry->len);
+		assert(g_state.wstr_bytes <= 64 * 1024);
+	}
+	assert(pw_item_desc_get((count - 1) * 3 + 1000)->str->wstr);
+	assert(!pw_item_desc_get(1003)->str->wstr);
+	rc = pw_item_desc_set((count - 1) * 3 + 1000, "x");
+	assert(rc == 0);
+	assert(!pw_item_desc_get((count - 1) * 3 + 1000)->str->wstr);
+
+	/* pre-warm in the background, without evicting anything */
+	pw_item_desc_set_wstr_budget(64 * 1024 * 1024);
+	for (i = 0; i < 300; i++) {
+		id = i * 3 + 1000;
+		pw_item_desc_prewarm(&id, 1);
+	}
+	prewarm_wait_idle();
+	for (i = 0; i < 256; i++) {
+		assert(pw_item_desc_get(i * 3 + 1000)->str->wstr);
+	}
+
+	/* converted ones aren't queued again, the same worker takes the rest */
+	thr = g_state.prewarm_thr;
+	id = 1000;
+	pw_item_desc_prewarm(&id, 1);
+	assert(g_state.prewarm_cnt == 0 && !g_state.prewarm_running);
+	id = (count - 1) * 3 + 1000;
+	pw_item_desc_prewarm(&id, 1);
+	prewarm_wait_idle();
+	assert(pw_item_desc_get(id)->str->wstr);
+	assert(pthread_equal(thr, g_state.prewarm_thr));
+	unload();
+
+	/* set() keeps the direct index in sync, big and negative ids go to the tree */
+	rc = pw_item_desc_load(path);
+	assert(rc == 0);
+	assert(g_state.dir_cnt > 0 && !g_state.dir_disabled);
+	rc = pw_item_desc_set(1001, "a");
+	assert(rc == 0);
+	rc = pw_item_desc_set(5000000, "b");
+	assert(rc == 0);
+	rc = pw_item_desc_set(ITEM_DESC_DIR_MAX_ID + 5, "c");
+	assert(rc == 0);
+	rc = pw_item_desc_set(-3, "d");
+	assert(rc == 0);
+	assert(strcmp(pw_item_desc_get(1001)->str->desc, "a") == 0);
+	assert(strcmp(pw_item_desc_get(5000000)->str->desc, "b") == 0);
+	assert(strcmp(pw_item_desc_get(ITEM_DESC_DIR_MAX_ID + 5)->str->desc, "c") == 0);
+	assert(strcmp(pw_item_desc_get(-3)->str->desc, "d") == 0);
+	assert(!pw_item_desc_get(5000001) && !pw_item_desc_get(1002));
+	unload();
+
+	bench_dedup(path, count);
+	bench_wstr(path, count);
+	bench_get(path, count);
+	test_compressed(path, count);
+	/* these change a lot of descriptions */
+	test_journal(path);
+	bench_save(path);
+
+	/* a truncated file is rejected, not half-loaded */
+	fp = fopen(path, "r+b");
+	assert(fp);
+	rc = ftruncate(fileno(fp), 60000);
+	assert(rc == 0);
+	fclose(fp);
+	rc = pw_item_desc_load(path);
+	assert(rc == -EIO);
+	unload();
+
+	fprintf(stderr, "item_desc ok\n");
 	return 0;
 }
+#endif
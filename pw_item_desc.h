@@ -5,19 +5,52 @@
 #ifndef PW_ITEM_DESC_H
 #define PW_ITEM_DESC_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
 struct pw_avl;
 extern struct pw_avl *g_pw_item_desc_avl;
 
+struct pw_item_desc_str;
+
 struct pw_item_desc_entry {
 	uint32_t id;
 	uint32_t len;
-	char *desc;
-	wchar_t *aux;
+	/** the text, shared (and refcounted) by all the ids with identical one */
+	struct pw_item_desc_str *str;
 };
 
 int pw_item_desc_load(const char *filepath);
+/**
+ * Share identical texts of the next pw_item_desc_load()ed raw file, which
+ * takes a hash of each one. About a quarter less memory for the strings
+ * (and their wide forms), but the load is a few times slower. Off by
+ * default, compressed files are always shared and texts set later too.
+ */
+void pw_item_desc_set_dedup(bool dedup);
 struct pw_item_desc_entry *pw_item_desc_get(int id);
+/**
+ * UTF-16 form of the description, with escaped newlines expanded. It's
+ * converted on first use and kept in an LRU cache of limited size, so the
+ * string is only valid until the next pw_item_desc_get_wstr() or
+ * pw_item_desc_set() call.
+ *
+ * \return NULL on allocation failure
+ */
+const wchar_t *pw_item_desc_get_wstr(struct pw_item_desc_entry *entry);
+/** memory limit of the above cache, the most recent string is always kept */
+void pw_item_desc_set_wstr_budget(size_t bytes);
+/**
+ * Convert the given descriptions in a background thread, ahead of their
+ * first pw_item_desc_get_wstr(). Only as many as fit in the cache without
+ * evicting anything. Ids that are already converted or don't fit in the
+ * queue are ignored. The thread is started on the first call.
+ */
+void pw_item_desc_prewarm(const uint32_t *ids, size_t count);
 int pw_item_desc_set(int id, const char *desc);
+/** save zlib-compressed blocks, by default the same format as loaded */
+void pw_item_desc_set_compressed(bool compressed);
 int pw_item_desc_save(void);
 
 #endif /* PW_ITEM_DESC_H */
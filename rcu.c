@@ -0,0 +1,233 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright(c) 2022 Darek Stojaczyk for pwmirage.com
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <assert.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sched.h>
+#endif
+
+#include "rcu.h"
+
+static void
+cpu_yield(void)
+{
+#ifdef _WIN32
+	SwitchToThread();
+#else
+	sched_yield();
+#endif
+}
+
+struct pw_rcu *
+pw_rcu_init(void)
+{
+	return calloc(1, sizeof(struct pw_rcu));
+}
+
+void
+pw_rcu_deinit(struct pw_rcu *rcu)
+{
+	if (!rcu) {
+		return;
+	}
+
+	assert(rcu->readers[0] == 0 && rcu->readers[1] == 0);
+	free(rcu);
+}
+
+int
+pw_rcu_read_lock(struct pw_rcu *rcu)
+{
+	int idx = __atomic_load_n(&rcu->epoch, __ATOMIC_RELAXED) & 1;
+
+	/* a full barrier, so nothing read inside the section can be loaded
+	 * before the writer sees our counter */
+	__atomic_fetch_add(&rcu->readers[idx], 1, __ATOMIC_SEQ_CST);
+	return idx;
+}
+
+void
+pw_rcu_read_unlock(struct pw_rcu *rcu, int idx)
+{
+	__atomic_fetch_sub(&rcu->readers[idx], 1, __ATOMIC_RELEASE);
+}
+
+static void
+flip_and_wait(struct pw_rcu *rcu)
+{
+	uint32_t old = __atomic_fetch_add(&rcu->epoch, 1, __ATOMIC_SEQ_CST) & 1;
+
+	while (__atomic_load_n(&rcu->readers[old], __ATOMIC_ACQUIRE) != 0) {
+		cpu_yield();
+	}
+}
+
+void
+pw_rcu_synchronize(struct pw_rcu *rcu)
+{
+	while (__atomic_exchange_n(&rcu->sync_lock, 1, __ATOMIC_ACQUIRE)) {
+		cpu_yield();
+	}
+
+	/* a reader may have sampled the old epoch just before the first flip
+	 * and incremented its counter after we saw it drop to zero. Such
+	 * reader could only have seen the new data (it's published before we
+	 * get here), but it's still accounted on the counter we're about to
+	 * reuse. The second flip waits for it. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	flip_and_wait(rcu);
+	flip_and_wait(rcu);
+
+	__atomic_store_n(&rcu->sync_lock, 0, __ATOMIC_RELEASE);
+}
+
+#ifdef PW_RCU_TEST
+#include <pthread.h>
+#include <time.h>
+
+#define TEST_SLOTS 64
+#define TEST_MAGIC 0x5ca1ab1e
+
+/* a published version; the writer never modifies one in place */
+struct test_ver {
+	uint32_t magic;
+	uint32_t gen;
+	uint32_t slots[TEST_SLOTS];
+};
+
+static struct pw_rcu *g_rcu;
+static struct test_ver *g_ver;
+static bool g_stop;
+
+static double
+wall_ms(void)
+{
+	struct timespec ts;
+
+	timespec_get(&ts, TIME_UTC);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void
+check_ver(struct test_ver *ver)
+{
+	size_t i;
+
+	/* the writer poisons a version before freeing it, run with asan too */
+	if (ver->magic != TEST_MAGIC) {
+		fprintf(stderr, "reader saw a freed version: magic=%x\n", ver->magic);
+		abort();
+	}
+
+	for (i = 0; i < TEST_SLOTS; i++) {
+		if (ver->slots[i] != ver->gen + i) {
+			fprintf(stderr, "torn version %u: slot %zu = %u\n", ver->gen, i, ver->slots[i]);
+			abort();
+		}
+	}
+}
+
+static void *
+reader_thread(void *arg)
+{
+	unsigned long long *lookups = arg;
+	unsigned long long n = 0;
+	uint32_t last_gen = 0;
+
+	while (!__atomic_load_n(&g_stop, __ATOMIC_RELAXED)) {
+		struct test_ver *ver;
+		int idx;
+
+		idx = pw_rcu_read_lock(g_rcu);
+		ver = pw_rcu_dereference(g_ver);
+		check_ver(ver);
+		/* versions are published in order */
+		assert(ver->gen >= last_gen);
+		last_gen = ver->gen;
+		pw_rcu_read_unlock(g_rcu, idx);
+		n++;
+	}
+
+	*lookups = n;
+	return NULL;
+}
+
+static struct test_ver *
+new_ver(uint32_t gen)
+{
+	struct test_ver *ver = malloc(sizeof(*ver));
+	size_t i;
+
+	assert(ver);
+	ver->magic = TEST_MAGIC;
+	ver->gen = gen;
+	for (i = 0; i < TEST_SLOTS; i++) {
+		ver->slots[i] = gen + i;
+	}
+
+	return ver;
+}
+
+static void
+run(unsigned nreaders, unsigned duration_ms)
+{
+	pthread_t threads[16];
+	unsigned long long lookups[16] = {}, total = 0;
+	struct test_ver *old;
+	uint32_t gen = 0;
+	unsigned i;
+	double start;
+	int rc;
+
+	g_rcu = pw_rcu_init();
+	assert(g_rcu);
+	g_ver = new_ver(gen++);
+	g_stop = false;
+
+	for (i = 0; i < nreaders; i++) {
+		rc = pthread_create(&threads[i], NULL, reader_thread, &lookups[i]);
+		assert(rc == 0);
+	}
+
+	start = wall_ms();
+	while (wall_ms() - start < duration_ms) {
+		old = g_ver;
+		pw_rcu_assign_pointer(g_ver, new_ver(gen++));
+		pw_rcu_synchronize(g_rcu);
+		memset(old, 0xcc, sizeof(*old));
+		free(old);
+	}
+
+	__atomic_store_n(&g_stop, true, __ATOMIC_RELAXED);
+	for (i = 0; i < nreaders; i++) {
+		pthread_join(threads[i], NULL);
+		total += lookups[i];
+	}
+
+	fprintf(stderr, "%2u readers: %8.2f Mreads/s, %u grace periods\n",
+			nreaders, total / (double)duration_ms / 1000, gen - 1);
+	free(g_ver);
+	pw_rcu_deinit(g_rcu);
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned duration_ms = argc > 1 ? atoi(argv[1]) : 1000;
+	unsigned nreaders;
+
+	for (nreaders = 1; nreaders <= 8; nreaders *= 2) {
+		run(nreaders, duration_ms);
+	}
+
+	return 0;
+}
+#endif
@@ -0,0 +1,41 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright(c) 2022 Darek Stojaczyk for pwmirage.com
+ */
+
+#ifndef PW_RCU_H
+#define PW_RCU_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+/**
+ * Minimal sleepable RCU domain. Readers increment a counter of the current
+ * epoch and never block. A writer publishes a new version of its data,
+ * then waits in pw_rcu_synchronize() until every reader that could still
+ * see the old version is gone, and only then frees the old version.
+ *
+ * Read sections can nest and can run on any thread. pw_rcu_synchronize()
+ * must not be called from within a read section, and concurrent callers
+ * are serialized by the domain itself.
+ */
+struct pw_rcu {
+	uint32_t epoch;
+	long readers[2];
+	long sync_lock;
+};
+
+struct pw_rcu *pw_rcu_init(void);
+void pw_rcu_deinit(struct pw_rcu *rcu);
+
+/** \return value to be passed to pw_rcu_read_unlock() */
+int pw_rcu_read_lock(struct pw_rcu *rcu);
+void pw_rcu_read_unlock(struct pw_rcu *rcu, int idx);
+
+/** wait for all read sections started before this call to finish */
+void pw_rcu_synchronize(struct pw_rcu *rcu);
+
+/** store a pointer so that readers who load it see a fully initialized object */
+#define pw_rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#define pw_rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+
+#endif /* PW_RCU_H */